@@ -54,13 +54,23 @@ int main(int argc, const char** argv)
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc == 2)
+    rst::rasterizer r(700, 700);
+
+    if (argc >= 2)
     {
         command_line = true;
         filename = std::string(argv[1]);
-    }
 
-    rst::rasterizer r(700, 700);
+        // Samples per pixel: 1 samples pixel centers, 2, 4 (the default) or 8 multisample
+        if (argc >= 3)
+        {
+            int samples = std::atoi(argv[2]);
+            if (samples == 1 || samples == 2 || samples == 4 || samples == 8)
+                r.set_sampling(rst::Sampling(samples));
+            else
+                std::cout << "Unsupported sample count " << argv[2] << ", using 4\n";
+        }
+    }
 
     Eigen::Vector3f eye_pos = {0,0,5};
 
@@ -95,6 +105,9 @@ int main(int argc, const char** argv)
     auto ind_id = r.load_indices(ind);
     auto col_id = r.load_colors(cols);
 
+    // Both triangles face the camera
+    r.set_culling(rst::Culling::Back);
+
     int key = 0;
     int frame_count = 0;
 
@@ -113,6 +126,12 @@ int main(int argc, const char** argv)
 
         cv::imwrite(filename, image);
 
+        const rst::frame_stats& stats = r.stats();
+        std::cout << stats.triangles_in << " triangles in: " << stats.backface_culled << " back facing, "
+                  << stats.degenerate_culled << " degenerate, " << stats.small_culled << " between samples culled\n";
+        std::cout << stats.depth_passes << " of " << stats.depth_tests << " depth tests passed, "
+                  << stats.fragments_shaded << " fragments shaded\n";
+
         return 0;
     }
 
@@ -4,8 +4,12 @@
 //
 
 #include <algorithm>
+#include <array>
+#include <bitset>
 #include <vector>
 #include "rasterizer.hpp"
+#include "EdgeFunction.hpp"
+#include "Simd.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
 
@@ -39,45 +43,55 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
+// Sample positions of every sampling mode as offsets from the pixel center in 1/16 pixel, y down: the standard
+// multisample patterns of Direct3D. They are rotated grids, no two samples share a row or a column, so edges close
+// to horizontal or vertical get as many coverage steps as there are samples.
+static const int MAX_SAMPLES = 8;
+static const int SAMPLE_PATTERNS[4][MAX_SAMPLES][2] = {
+    { { 0, 0 } },
+    { { 4, 4 }, { -4, -4 } },
+    { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } },
+    { { 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 }, { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 } },
+};
+
+// Position of a sample relative to the lower left pixel corner (y up)
+static Eigen::Vector2f sample_position(int samples, int sample)
+{
+    const int* offset = SAMPLE_PATTERNS[samples == 1 ? 0 : samples == 2 ? 1 : samples == 4 ? 2 : 3][sample];
+    return { 0.5f + offset[0] / 16.0f, 0.5f - offset[1] / 16.0f };
+}
 
-static bool insideTriangle(float x, float y, const Vector3f* _v)
-{   
-    // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
-
-    // Inspired by https://cs184.eecs.berkeley.edu/sp24/lecture/2/drawing-triangles
-    Vector2f p0(_v[0][0], _v[0][1]);
-    Vector2f p1(_v[1][0], _v[1][1]);
-    Vector2f p2(_v[2][0], _v[2][1]);
-
-    float dX0 = p1[0] - p0[0];
-    float dY0 = p1[1] - p0[1];
-    float L0 = -(x - p0[0]) * dY0 + (y - p0[1]) * dX0;
-
-    float dX1 = p2[0] - p1[0];
-    float dY1 = p2[1] - p1[1];
-    float L1 = -(x - p1[0]) * dY1 + (y - p1[1]) * dX1;
-
-    float dX2 = p0[0] - p2[0];
-    float dY2 = p0[1] - p2[1];
-    float L2 = -(x - p2[0]) * dY2 + (y - p2[1]) * dX2;
-
-    if (L0 > 0 && L1 > 0 && L2 > 0) {
-        return true;
-    }
-    else if (L0 < 0 && L1 < 0 && L2 < 0) {
-        return true;
-    }
-    else {
-        return false;
+enum class cull_result
+{
+    Keep,
+    Degenerate,
+    Backface,
+    Small
+};
+
+// Why a screen space triangle is dropped before rasterization, if it is
+static cull_result cull_reason(const Eigen::Vector4f* v, rst::Culling culling, int samples)
+{
+    float area2 = rst::signed_area2(v);
+    if (area2 == 0 || !std::isfinite(area2))
+        return cull_result::Degenerate;
+    if ((culling == rst::Culling::Back && area2 < 0) || (culling == rst::Culling::Front && area2 > 0))
+        return cull_result::Backface;
+    for (int s = 0; s < samples; ++s)
+    {
+        Eigen::Vector2f position = sample_position(samples, s);
+        if (!rst::misses_sample(v, position.x(), position.y()))
+            return cull_result::Keep;
     }
+    return cull_result::Small;
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
+static uint32_t pack_rgba8(const Eigen::Vector3f& color)
 {
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+    uint32_t packed = 0xff000000;
+    for (int c = 0; c < 3; ++c)
+        packed |= (uint32_t)std::lrint(std::min(std::max(color[c], 0.0f), 255.0f)) << (8 * c);
+    return packed;
 }
 
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
@@ -110,6 +124,15 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
             vert.z() = vert.z() * f1 + f2;
         }
 
+        ++frame.triangles_in;
+        switch (cull_reason(v, culling, samples))
+        {
+            case cull_result::Degenerate: ++frame.degenerate_culled; continue;
+            case cull_result::Backface:   ++frame.backface_culled; continue;
+            case cull_result::Small:      ++frame.small_culled; continue;
+            default: break;
+        }
+
         for (int i = 0; i < 3; ++i)
         {
             t.setVertex(i, v[i].head<3>());
@@ -148,94 +171,169 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t) {
     float ymin = std::min({ v[0].y(), v[1].y(), v[2].y() });
     float ymax = std::max({ v[0].y(), v[1].y(), v[2].y() });
 
-    bool MSAA = true;
-
-    if (MSAA) {
-        int N = 2;
-
-        for (int x = std::floor(xmin); x < std::ceil(xmax); ++x) {
-            for (int y = std::floor(ymin); y < std::ceil(ymax); ++y) {
-
-                if (x < 0 || x > width - 1 || y < 0 || y > height - 1) {
-                    continue;
-                }
-
-                float z_min = std::numeric_limits<float>::infinity();
-                Eigen::Vector3f accumulated_color(0.0f, 0.0f, 0.0f);
-                float num_samples = 0;
+    // Bounding box clamped to the screen
+    int x0 = std::max((int)std::floor(xmin), 0);
+    int x1 = std::min((int)std::ceil(xmax), width);
+    int y0 = std::max((int)std::floor(ymin), 0);
+    int y1 = std::min((int)std::ceil(ymax), height);
 
-                float dx = 1.0f / N;
-                float dy = 1.0f / N;
+    // Edge equations and 1/area are set up once; the loops below only step them.
+    // The edge values are barycentric coordinates, so no per-sample computeBarycentric2D is needed.
+    triangle_setup setup;
+    if (!setup.init(t.v))
+        return;
 
-                for (int i = 0; i < N; ++i) {
-                    for (int j = 0; j < N; ++j) {
-                        float sx = x + (i + 0.5f) * dx;
-                        float sy = y + (j + 0.5f) * dy;
+    using namespace simd;
 
-                        if (insideTriangle(sx, sy, t.v)) { // Note: Modified function input type int to type float
-                            auto [alpha, beta, gamma] = computeBarycentric2D(sx, sy, t.v);
-
-                            float w_reciprocal = 1.0f / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                            float z_interpolated = (alpha * v[0].z() / v[0].w() +
-                                beta * v[1].z() / v[1].w() +
-                                gamma * v[2].z() / v[2].w()) * w_reciprocal;
-
-                            z_min = std::min(z_min, z_interpolated);
+    // Per vertex terms of the perspective correct depth
+    float inv_w[3], z_over_w[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        inv_w[i] = 1.0f / v[i].w();
+        z_over_w[i] = v[i].z() / v[i].w();
+    }
 
-                            accumulated_color += t.getColor();
+    auto depth_of = [&](const vfloat* e) {
+        vfloat w_reciprocal = vfloat(1.0f) / (e[0] * inv_w[0] + e[1] * inv_w[1] + e[2] * inv_w[2]);
+        return (e[0] * z_over_w[0] + e[1] * z_over_w[1] + e[2] * z_over_w[2]) * w_reciprocal;
+    };
+
+    // A sample on an edge is covered only if that edge is top-left, so compare with >= there and > elsewhere
+    auto covered = [&](const vfloat* e) {
+        vmask m = all_lanes(true);
+        for (int k = 0; k < 3; ++k)
+            m = m & (setup.top_left[k] ? e[k] >= 0.0f : e[k] > 0.0f);
+        return m;
+    };
+
+    const vfloat lane = vfloat::ramp();
+    const int BLOCK = 8;
+
+    // Offset of every sample's edge values from the pixel corner's, computed once per triangle, and the
+    // rectangle the samples span inside a pixel
+    float sample_offsets[MAX_SAMPLES][3];
+    Eigen::Vector2f lo(1, 1), hi(0, 0);
+    for (int s = 0; s < samples; ++s) {
+        Eigen::Vector2f p = sample_position(samples, s);
+        for (int k = 0; k < 3; ++k)
+            sample_offsets[s][k] = setup.A[k] * p.x() + setup.B[k] * p.y();
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
 
-                            num_samples++;
-                        }
+    // Walk the bounding box in BLOCK x BLOCK blocks. Blocks entirely outside an edge are skipped, blocks entirely
+    // inside all edges skip the per sample coverage test. Within a block, WIDTH pixels of a row are processed at once.
+    for (int by = y0 / BLOCK * BLOCK; by < y1; by += BLOCK) {
+        for (int bx = x0 / BLOCK * BLOCK; bx < x1; bx += BLOCK) {
+
+            int px0 = std::max(bx, x0), px1 = std::min(bx + BLOCK, x1) - 1;
+            int py0 = std::max(by, y0), py1 = std::min(by + BLOCK, y1) - 1;
+
+            block_coverage block = setup.classify(px0 + lo.x(), py0 + lo.y(), px1 + hi.x(), py1 + hi.y());
+            if (block == block_coverage::None)
+                continue;
+
+            // Edge values at the lower left corner of the first pixel of the block row, stepped by B per row
+            float e_row[3];
+            for (int k = 0; k < 3; ++k)
+                e_row[k] = setup.eval(k, bx, py0);
+
+            for (int y = py0; y <= py1; ++y, e_row[0] += setup.B[0], e_row[1] += setup.B[1], e_row[2] += setup.B[2]) {
+                for (int x = bx; x < bx + BLOCK && x <= px1; x += WIDTH) {
+
+                    vfloat px = lane + (float)x;
+                    vmask valid = (px >= (float)px0) & (px <= (float)px1);
+
+                    // Edge values at the lower left corner of every lane's pixel
+                    vfloat corner[3];
+                    for (int k = 0; k < 3; ++k)
+                        corner[k] = vfloat(e_row[k]) + vfloat(setup.A[k]) * (lane + (float)(x - bx));
+
+                    // Coverage and depth test of every sample; each sample keeps its own depth. The last lanes
+                    // of a row may fall off the screen.
+                    int lanes = std::min(WIDTH, width - x);
+                    int passed[MAX_SAMPLES];
+                    int any_passed = 0;
+                    for (int s = 0; s < samples; ++s) {
+                        vfloat e[3] = { corner[0] + sample_offsets[s][0], corner[1] + sample_offsets[s][1], corner[2] + sample_offsets[s][2] };
+                        vmask m = valid;
+                        if (block == block_coverage::Partial)
+                            m = m & covered(e);
+                        passed[s] = 0;
+                        if (!m.bits())
+                            continue;
+                        frame.depth_tests += std::bitset<WIDTH>(m.bits()).count();
+
+                        float* row = &depth_buf[get_sample_index(x, y, s)];
+                        float depth[WIDTH];
+                        std::fill(depth, depth + WIDTH, 0.0f);
+                        std::copy_n(row, lanes, depth);
+                        vfloat z = depth_of(e);
+                        m = m & (z < vfloat::load(depth));
+
+                        passed[s] = m.bits();
+                        if (!passed[s])
+                            continue;
+                        frame.depth_passes += std::bitset<WIDTH>(passed[s]).count();
+                        select(m, z, vfloat::load(depth)).store(depth);
+                        std::copy_n(depth, lanes, row);
+                        any_passed |= passed[s];
                     }
-                }
-
-                // Inspired by https://scarletsky.github.io/2020/06/10/games101-notes-rasterization/
-                if (num_samples > 0) {
-                    accumulated_color /= (N * N);
 
-                    int index = get_index(x, y);
-
-                    if (z_min < depth_buf[index]) {
-                        depth_buf[index] = z_min;
-                        set_pixel(Eigen::Vector3f(x, y, z_min), accumulated_color); // Imagine a pixel with 2 samples being black 2 samples being white get handled by averaing => get smoothing effect
+                    // Shade once per pixel, and store the color to every sample that passed
+                    for (int l = 0; l < lanes; ++l) {
+                        if (!(any_passed & (1 << l)))
+                            continue;
+                        Eigen::Vector3f color = t.getColor();
+                        ++frame.fragments_shaded;
+                        if (samples == 1) {
+                            set_pixel(Eigen::Vector3f(x + l, y, 0), color);
+                            continue;
+                        }
+                        uint32_t packed = pack_rgba8(color);
+                        for (int s = 0; s < samples; ++s) {
+                            if (passed[s] & (1 << l))
+                                sample_color[get_sample_index(x + l, y, s)] = packed;
+                        }
                     }
+                    if (any_passed && samples > 1)
+                        resolve_pending = true;
                 }
             }
         }
     }
+}
 
-    else {
-        // Note: NDC->ViewPort => [-1, 1] to [0, width]
-        for (int x = std::floor(xmin); x < std::ceil(xmax); ++x) {
-            for (int y = std::floor(ymin); y < std::ceil(ymax); ++y) {
-
-                if (x < 0 || x > width - 1 || y < 0 || y > height - 1) {
-                    continue;
-                }
-
-                float sx = x + 0.5f;
-                float sy = y + 0.5f;
-
-                if (insideTriangle(sx, sy, t.v)) {
-
-                    auto [alpha, beta, gamma] = computeBarycentric2D(sx, sy, t.v);
-                    float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                    z_interpolated *= w_reciprocal;
-
-                    Eigen::Vector3f point(sx, sy, z_interpolated);
-                    Eigen::Vector3f color = t.getColor();
-
-                    int ind = get_index(x, y);
-                    if (z_interpolated < depth_buf[ind]) {
-                        depth_buf[ind] = z_interpolated;
-                        set_pixel(Eigen::Vector3f(x, y, z_interpolated), color);
-                    }
-                }
+// Averages the samples of every pixel into frame_buf
+void rst::rasterizer::resolve()
+{
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t sum[3] = { 0, 0, 0 };
+            for (int s = 0; s < samples; ++s) {
+                uint32_t packed = sample_color[get_sample_index(x, y, s)];
+                for (int c = 0; c < 3; ++c)
+                    sum[c] += (packed >> (8 * c)) & 0xff;
             }
+            frame_buf[get_index(x, y)] = Eigen::Vector3f(sum[0], sum[1], sum[2]) / (float)samples;
         }
     }
+    resolve_pending = false;
+}
+
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
+{
+    if (resolve_pending)
+        resolve();
+    return frame_buf;
+}
 
+void rst::rasterizer::set_sampling(Sampling mode)
+{
+    samples = (int)mode;
+    depth_buf.assign((size_t)width * height * samples, std::numeric_limits<float>::infinity());
+    sample_color.assign(samples > 1 ? (size_t)width * height * samples : 0, 0);
+    clear(Buffers::Color);
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -258,17 +356,22 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(sample_color.begin(), sample_color.end(), 0);
+        resolve_pending = false;
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+
+        // A depth clear starts a new frame
+        frame = {};
     }
 }
 
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    set_sampling(Sampling::MSAA4x);
 }
 
 int rst::rasterizer::get_index(int x, int y)
@@ -282,6 +385,13 @@ void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vecto
     auto ind = (height-1-point.y())*width + point.x();
     frame_buf[ind] = color;
 
+    // With multisampling the color goes to all samples, so the next resolve keeps it
+    if (samples > 1)
+    {
+        for (int s = 0; s < samples; ++s)
+            sample_color[get_sample_index(point.x(), point.y(), s)] = pack_rgba8(color);
+    }
+
 }
 
 // clang-format on
\ No newline at end of file
@@ -6,6 +6,7 @@
 
 #include <eigen3/Eigen/Eigen>
 #include <algorithm>
+#include <cstdint>
 #include "global.hpp"
 #include "Triangle.hpp"
 using namespace Eigen;
@@ -34,6 +35,35 @@ namespace rst
         Triangle
     };
 
+    // Faces dropped before rasterization. Front faces wind counter clockwise on screen (y up).
+    enum class Culling
+    {
+        None,
+        Back,
+        Front
+    };
+
+    // Samples per pixel: the pixel center only, or 2, 4 or 8 samples in rotated grid patterns (multisampling)
+    enum class Sampling
+    {
+        Center = 1,
+        MSAA2x = 2,
+        MSAA4x = 4,
+        MSAA8x = 8
+    };
+
+    // Counters of the current frame, reset by clear(Buffers::Depth)
+    struct frame_stats
+    {
+        long long triangles_in = 0;         // triangles submitted to draw
+        long long backface_culled = 0;      // triangles facing the culled side
+        long long degenerate_culled = 0;    // zero area on screen
+        long long small_culled = 0;         // bounding box without a sample position inside
+        long long depth_tests = 0;          // covered samples tested against the depth buffer
+        long long depth_passes = 0;
+        long long fragments_shaded = 0;     // pixels colored, once for all of their samples
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -66,19 +96,29 @@ namespace rst
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
+        void set_culling(Culling mode) { culling = mode; }
+
+        // Reallocates the sample buffers, clearing them
+        void set_sampling(Sampling mode);
+
         void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Resolves the samples drawn since the last call first
+        std::vector<Eigen::Vector3f>& frame_buffer();
+
+        const frame_stats& stats() const { return frame; }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
         void rasterize_triangle(const Triangle& t);
 
+        void resolve();
+
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
@@ -92,9 +132,23 @@ namespace rst
 
         std::vector<Eigen::Vector3f> frame_buf;
 
+        /*
+         * With multisampling, depth and color are kept per sample and frame_buf only gets the average of each
+         * pixel's samples in resolve(). Each screen row stores its samples as `samples` rows of width values,
+         * sample s of every pixel next to each other, so the lanes of the rasterizer load and store one sample
+         * of consecutive pixels at once. Colors are packed 8-bit rgba, 4 bytes per sample.
+         * Without multisampling depth_buf has one value per pixel and colors go straight to frame_buf.
+         * */
         std::vector<float> depth_buf;
+        std::vector<uint32_t> sample_color;
+        int samples = 1;
+        bool resolve_pending = false;
+
+        Culling culling = Culling::None;
+        frame_stats frame;
 
         int get_index(int x, int y);
+        int get_sample_index(int x, int y, int sample) { return ((height - 1 - y) * samples + sample) * width + x; }
 
         int width, height;
 
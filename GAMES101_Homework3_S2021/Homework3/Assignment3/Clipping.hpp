@@ -0,0 +1,133 @@
+//
+// Clip space clipping of triangles before the perspective division.
+//
+
+#ifndef RASTERIZER_CLIPPING_H
+#define RASTERIZER_CLIPPING_H
+
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+
+namespace rst
+{
+    /*
+     * Triangles are clipped in homogeneous clip space, where every attribute is still linear along an edge, so
+     * a new vertex is a plain lerp of the two it lies between. w is the distance in front of the eye.
+     *
+     * A triangle is only clipped against the planes that actually cut it:
+     *  - near and far: w in [z_near, z_far]. Without the near plane, vertices behind the eye divide by w <= 0
+     *    and the triangle wraps around through infinity.
+     *  - the guard band: x and y within GUARD_BAND * w, a region much larger than the screen. Triangles that
+     *    merely stick out of the screen are not clipped; their pixels off screen are cut by clamping the
+     *    bounding box. Only triangles reaching past the guard band, whose screen coordinates would grow large
+     *    enough to lose precision, are cut down to it.
+     * Triangles entirely outside one of the planes of the view volume (the screen edges, near or far) are
+     * dropped without clipping.
+     * */
+    constexpr float GUARD_BAND = 16.0f; // in units of the half screen size: 8 screens in every direction
+
+    struct clip_vertex
+    {
+        Eigen::Vector4f position;   // clip space
+        Eigen::Vector3f view_pos;
+        Eigen::Vector3f normal;     // view space
+        Eigen::Vector2f tex_coords;
+
+        static clip_vertex lerp(const clip_vertex& a, const clip_vertex& b, float t)
+        {
+            return { a.position + t * (b.position - a.position), a.view_pos + t * (b.view_pos - a.view_pos),
+                     a.normal + t * (b.normal - a.normal), a.tex_coords + t * (b.tex_coords - a.tex_coords) };
+        }
+    };
+
+    enum clip_plane
+    {
+        CLIP_NEAR,
+        CLIP_FAR,
+        CLIP_GUARD_LEFT,
+        CLIP_GUARD_RIGHT,
+        CLIP_GUARD_BOTTOM,
+        CLIP_GUARD_TOP,
+        CLIP_PLANE_COUNT,
+
+        // Screen edges, only used to reject triangles
+        CULL_LEFT = CLIP_PLANE_COUNT,
+        CULL_RIGHT,
+        CULL_BOTTOM,
+        CULL_TOP,
+        PLANE_COUNT
+    };
+
+    constexpr int CLIP_PLANE_MASK = (1 << CLIP_PLANE_COUNT) - 1;
+    constexpr int MAX_CLIP_VERTICES = 3 + CLIP_PLANE_COUNT; // every plane adds at most one vertex
+
+    struct clip_volume
+    {
+        float z_near, z_far;
+
+        // Signed distance of p to plane, positive inside
+        float distance(int plane, const Eigen::Vector4f& p) const
+        {
+            switch (plane)
+            {
+                case CLIP_NEAR:         return p.w() - z_near;
+                case CLIP_FAR:          return z_far - p.w();
+                case CLIP_GUARD_LEFT:   return GUARD_BAND * p.w() + p.x();
+                case CLIP_GUARD_RIGHT:  return GUARD_BAND * p.w() - p.x();
+                case CLIP_GUARD_BOTTOM: return GUARD_BAND * p.w() + p.y();
+                case CLIP_GUARD_TOP:    return GUARD_BAND * p.w() - p.y();
+                case CULL_LEFT:         return p.w() + p.x();
+                case CULL_RIGHT:        return p.w() - p.x();
+                case CULL_BOTTOM:       return p.w() + p.y();
+                default:                return p.w() - p.y();
+            }
+        }
+
+        // Bit i is set if p is outside plane i
+        int outcode(const Eigen::Vector4f& p) const
+        {
+            int code = 0;
+            for (int plane = 0; plane < PLANE_COUNT; ++plane)
+            {
+                if (distance(plane, p) < 0)
+                    code |= 1 << plane;
+            }
+            return code;
+        }
+
+        // Sutherland-Hodgman: clips the triangle against every plane in the planes mask, leaving a convex polygon
+        // of up to MAX_CLIP_VERTICES vertices in out. Returns the number of vertices, less than 3 if nothing is left.
+        int clip_triangle(const clip_vertex* triangle, int planes, clip_vertex* out) const
+        {
+            clip_vertex polygons[2][MAX_CLIP_VERTICES];
+            clip_vertex* src = polygons[0];
+            clip_vertex* dst = polygons[1];
+            int count = 3;
+            std::copy(triangle, triangle + 3, src);
+
+            for (int plane = 0; plane < CLIP_PLANE_COUNT && count >= 3; ++plane)
+            {
+                if (!(planes & (1 << plane)))
+                    continue;
+
+                int kept = 0;
+                for (int i = 0; i < count; ++i)
+                {
+                    const clip_vertex& a = src[i];
+                    const clip_vertex& b = src[(i + 1) % count];
+                    float da = distance(plane, a.position), db = distance(plane, b.position);
+                    if (da >= 0)
+                        dst[kept++] = a;
+                    if ((da >= 0) != (db >= 0))
+                        dst[kept++] = clip_vertex::lerp(a, b, da / (da - db));
+                }
+                count = kept;
+                std::swap(src, dst);
+            }
+            std::copy(src, src + count, out);
+            return count;
+        }
+    };
+}
+
+#endif //RASTERIZER_CLIPPING_H
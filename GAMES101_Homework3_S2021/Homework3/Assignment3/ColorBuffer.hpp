@@ -0,0 +1,222 @@
+//
+// Frame color buffer in a selectable pixel format.
+//
+
+#ifndef RASTERIZER_COLORBUFFER_H
+#define RASTERIZER_COLORBUFFER_H
+
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace rst
+{
+    enum class ColorFormat
+    {
+        RGB32F,     // float rgb, 12 bytes per pixel
+        BGR8,       // 8-bit bgr, OpenCV's channel order: ready for imshow/imwrite
+        RGBA8,      // 8-bit rgba, alpha 255
+        RGB16F      // half float rgb for HDR output
+    };
+
+    /*
+     * Shaders produce float colors in [0, 255]; tiles are shaded and blended in float in their local buffer.
+     * Only the frame's copy is stored in the selected format, converted when a tile is flushed (and back when
+     * a later draw call of the frame loads it again). 8-bit channels are rounded to nearest and saturated, like
+     * cv::Mat::convertTo to CV_8U. Rows are stored top to bottom, so the pixels can be wrapped by a cv::Mat
+     * without copying.
+     * */
+    class color_buffer
+    {
+    public:
+        void resize(size_t count)
+        {
+            size = count;
+            allocate();
+        }
+
+        void set_format(ColorFormat f)
+        {
+            format = f;
+            allocate();
+        }
+
+        ColorFormat get_format() const { return format; }
+
+        size_t pixel_bytes() const
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F: return 12;
+                case ColorFormat::BGR8:   return 3;
+                case ColorFormat::RGBA8:  return 4;
+                default:                  return 6;
+            }
+        }
+
+        std::vector<Eigen::Vector3f>& rgb32f() { return f32; }
+        void* data() { return format == ColorFormat::RGB32F ? (void*)f32.data() : format == ColorFormat::RGB16F ? (void*)f16.data() : (void*)u8.data(); }
+
+        void load(size_t index, int count, Eigen::Vector3f* out) const
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F:
+                    std::copy_n(&f32[index], count, out);
+                    break;
+                case ColorFormat::BGR8:
+                    for (int i = 0; i < count; ++i)
+                    {
+                        const uint8_t* p = &u8[(index + i) * 3];
+                        out[i] = { (float)p[2], (float)p[1], (float)p[0] };
+                    }
+                    break;
+                case ColorFormat::RGBA8:
+                    for (int i = 0; i < count; ++i)
+                    {
+                        const uint8_t* p = &u8[(index + i) * 4];
+                        out[i] = { (float)p[0], (float)p[1], (float)p[2] };
+                    }
+                    break;
+                case ColorFormat::RGB16F:
+                    for (int i = 0; i < count; ++i)
+                    {
+                        const uint16_t* p = &f16[(index + i) * 3];
+                        out[i] = { half_to_float(p[0]), half_to_float(p[1]), half_to_float(p[2]) };
+                    }
+                    break;
+            }
+        }
+
+        void store(size_t index, int count, const Eigen::Vector3f* in)
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F:
+                    std::copy_n(in, count, &f32[index]);
+                    break;
+                case ColorFormat::BGR8:
+                    for (int i = 0; i < count; ++i)
+                    {
+                        uint8_t* p = &u8[(index + i) * 3];
+                        p[0] = to_unorm8(in[i].z());
+                        p[1] = to_unorm8(in[i].y());
+                        p[2] = to_unorm8(in[i].x());
+                    }
+                    break;
+                case ColorFormat::RGBA8:
+                    for (int i = 0; i < count; ++i)
+                    {
+                        uint8_t* p = &u8[(index + i) * 4];
+                        p[0] = to_unorm8(in[i].x());
+                        p[1] = to_unorm8(in[i].y());
+                        p[2] = to_unorm8(in[i].z());
+                        p[3] = 255;
+                    }
+                    break;
+                case ColorFormat::RGB16F:
+                    for (int i = 0; i < count; ++i)
+                    {
+                        uint16_t* p = &f16[(index + i) * 3];
+                        p[0] = float_to_half(in[i].x());
+                        p[1] = float_to_half(in[i].y());
+                        p[2] = float_to_half(in[i].z());
+                    }
+                    break;
+            }
+        }
+
+        void fill(size_t index, int count, const Eigen::Vector3f& color)
+        {
+            if (format == ColorFormat::RGB32F)
+            {
+                std::fill_n(&f32[index], count, color);
+                return;
+            }
+            for (int i = 0; i < count; ++i)
+                store(index + i, 1, &color);
+        }
+
+    private:
+        void allocate()
+        {
+            f32.assign(format == ColorFormat::RGB32F ? size : 0, Eigen::Vector3f::Zero());
+            u8.assign(format == ColorFormat::BGR8 ? size * 3 : format == ColorFormat::RGBA8 ? size * 4 : 0, 0);
+            f16.assign(format == ColorFormat::RGB16F ? size * 3 : 0, 0);
+        }
+
+        static uint8_t to_unorm8(float v)
+        {
+            v = v > 0 ? (v < 255 ? v : 255) : 0; // NaN goes to 0
+            return (uint8_t)std::lrint(v);
+        }
+
+        static uint16_t float_to_half(float v)
+        {
+#if defined(__F16C__)
+            return (uint16_t)_mm_extract_epi16(_mm_cvtps_ph(_mm_set_ss(v), _MM_FROUND_TO_NEAREST_INT), 0);
+#else
+            uint32_t bits;
+            std::memcpy(&bits, &v, 4);
+            uint32_t sign = (bits >> 16) & 0x8000;
+            uint32_t abs = bits & 0x7fffffff;
+            if (abs >= 0x7f800000)
+                return (uint16_t)(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0)); // inf, nan
+            if (abs >= 0x477ff000)
+                return (uint16_t)(sign | 0x7c00); // rounds past the largest half
+            if (abs < 0x38800000)
+            {
+                // Subnormal half: scale so the float's rounding does the work
+                float f;
+                std::memcpy(&f, &abs, 4);
+                return (uint16_t)(sign | (uint32_t)std::lrint(f * 16777216.0f));
+            }
+            uint32_t half = (abs >> 13) - (112 << 10);
+            uint32_t rest = abs & 0x1fff;
+            half += rest > 0x1000 || (rest == 0x1000 && (half & 1)); // round to nearest even
+            return (uint16_t)(sign | half);
+#endif
+        }
+
+        static float half_to_float(uint16_t h)
+        {
+#if defined(__F16C__)
+            return _mm_cvtss_f32(_mm_cvtph_ps(_mm_cvtsi32_si128(h)));
+#else
+            uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+            uint32_t exponent = (h >> 10) & 0x1f;
+            uint32_t mantissa = h & 0x3ff;
+            float magnitude;
+            if (exponent == 0)
+                magnitude = mantissa / 16777216.0f; // subnormal: mantissa * 2^-24
+            else if (exponent == 31)
+                magnitude = mantissa ? NAN : INFINITY;
+            else
+            {
+                uint32_t bits = (exponent + 112) << 23 | mantissa << 13;
+                std::memcpy(&magnitude, &bits, 4);
+            }
+            uint32_t bits;
+            std::memcpy(&bits, &magnitude, 4);
+            bits |= sign;
+            std::memcpy(&magnitude, &bits, 4);
+            return magnitude;
+#endif
+        }
+
+        ColorFormat format = ColorFormat::RGB32F;
+        size_t size = 0;
+
+        std::vector<Eigen::Vector3f> f32;
+        std::vector<uint8_t> u8;
+        std::vector<uint16_t> f16;
+    };
+}
+
+#endif //RASTERIZER_COLORBUFFER_H
@@ -0,0 +1,121 @@
+//
+// Frame depth buffer in a selectable storage format.
+//
+
+#ifndef RASTERIZER_DEPTHBUFFER_H
+#define RASTERIZER_DEPTHBUFFER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace rst
+{
+    enum class DepthFormat
+    {
+        Float32,
+        Unorm24,    // 24 bits in the low bits of a 32-bit word, like a D24X8 target
+        Unorm16
+    };
+
+    /*
+     * Tiles are rasterized against float depth in their local buffer; only the frame's copy is stored in the
+     * selected format, converted when a tile is loaded and flushed.
+     *
+     * The integer formats map the depth range [z_min, z_max] linearly onto the codes 0 .. 2^bits - 2; the
+     * largest code is infinitely far, the cleared state. Depths are rounded towards the eye, so a stored value
+     * is never farther than what the tile had: the hierarchical z, taken from the unrounded tile values, stays
+     * a valid upper bound of the stored depths.
+     * */
+    class depth_buffer
+    {
+    public:
+        void resize(size_t count)
+        {
+            size = count;
+            allocate();
+        }
+
+        void set_format(DepthFormat f)
+        {
+            format = f;
+            allocate();
+        }
+
+        DepthFormat get_format() const { return format; }
+
+        void set_range(float z_min, float z_max)
+        {
+            lo = z_min;
+            int bits = format == DepthFormat::Unorm16 ? 16 : 24;
+            far_code = (1u << bits) - 1;
+            scale = (far_code - 1) / std::max(z_max - z_min, std::numeric_limits<float>::min());
+            inv_scale = 1.0f / scale;
+        }
+
+        size_t bytes() const
+        {
+            return f32.size() * sizeof(float) + u24.size() * sizeof(uint32_t) + u16.size() * sizeof(uint16_t);
+        }
+
+        // Decodes count depths starting at index into out
+        void load(size_t index, int count, float* out) const
+        {
+            switch (format)
+            {
+                case DepthFormat::Float32: std::copy_n(&f32[index], count, out); break;
+                case DepthFormat::Unorm24: decode(&u24[index], count, out); break;
+                case DepthFormat::Unorm16: decode(&u16[index], count, out); break;
+            }
+        }
+
+        void store(size_t index, int count, const float* in)
+        {
+            switch (format)
+            {
+                case DepthFormat::Float32: std::copy_n(in, count, &f32[index]); break;
+                case DepthFormat::Unorm24: encode(in, count, &u24[index]); break;
+                case DepthFormat::Unorm16: encode(in, count, &u16[index]); break;
+            }
+        }
+
+    private:
+        void allocate()
+        {
+            f32.assign(format == DepthFormat::Float32 ? size : 0, std::numeric_limits<float>::infinity());
+            u24.assign(format == DepthFormat::Unorm24 ? size : 0, 0xffffff);
+            u16.assign(format == DepthFormat::Unorm16 ? size : 0, 0xffff);
+        }
+
+        template <typename Code>
+        void encode(const float* in, int count, Code* out) const
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                float code = std::floor((in[i] - lo) * scale);
+                out[i] = in[i] == std::numeric_limits<float>::infinity() ? (Code)far_code
+                                                                           : (Code)std::min(std::max(code, 0.0f), (float)(far_code - 1));
+            }
+        }
+
+        template <typename Code>
+        void decode(const Code* in, int count, float* out) const
+        {
+            for (int i = 0; i < count; ++i)
+                out[i] = in[i] == far_code ? std::numeric_limits<float>::infinity() : lo + in[i] * inv_scale;
+        }
+
+        DepthFormat format = DepthFormat::Float32;
+        size_t size = 0;
+        float lo = 0, scale = 1, inv_scale = 1;
+        uint32_t far_code = 0xffffff;
+
+        std::vector<float> f32;
+        std::vector<uint32_t> u24;
+        std::vector<uint16_t> u16;
+    };
+}
+
+#endif //RASTERIZER_DEPTHBUFFER_H
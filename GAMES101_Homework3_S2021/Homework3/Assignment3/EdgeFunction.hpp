@@ -0,0 +1,122 @@
+//
+// Triangle setup for edge function rasterization.
+//
+
+#ifndef RASTERIZER_EDGEFUNCTION_H
+#define RASTERIZER_EDGEFUNCTION_H
+
+#include <algorithm>
+#include <cmath>
+
+namespace rst
+{
+    /*
+     * E_i(x, y) = A[i] * (x - X[i]) + B[i] * (y - Y[i]) is the edge function of the edge opposite vertex i,
+     * (X[i], Y[i]) being the first vertex of that edge. Evaluating it relative to a vertex instead of
+     * as A * x + B * y + C avoids cancellation for small triangles far from the origin.
+     * The coefficients are divided by twice the signed area of the triangle, so that inside the triangle
+     * all three values are positive and E_i is exactly the barycentric weight of vertex i.
+     * Moving one pixel right adds A[i], moving one pixel up adds B[i]: coverage and barycentrics
+     * are updated with additions only.
+     *
+     * Samples lying exactly on an edge belong to the triangle only if it is a top or a left edge
+     * (y points up on screen), so pixels on an edge shared by two triangles are drawn exactly once.
+     * */
+    enum class block_coverage
+    {
+        None,
+        Partial,
+        Full
+    };
+
+    struct triangle_setup
+    {
+        float A[3], B[3], X[3], Y[3];
+        bool top_left[3];
+
+        // Returns false for degenerate (zero area) triangles, which cover nothing.
+        template <typename Vec>
+        bool init(const Vec* v)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                const Vec& p = v[(i + 1) % 3];
+                const Vec& q = v[(i + 2) % 3];
+                A[i] = p.y() - q.y();
+                B[i] = q.x() - p.x();
+                X[i] = p.x();
+                Y[i] = p.y();
+            }
+
+            float area2 = eval(0, v[0].x(), v[0].y()); // E_0(v_0) = twice the signed area
+            if (area2 == 0 || !std::isfinite(area2))
+                return false;
+
+            // Top-left is decided on the un-normalized edge, oriented so the inside is positive
+            for (int i = 0; i < 3; ++i)
+            {
+                float a = area2 > 0 ? A[i] : -A[i];
+                float b = area2 > 0 ? B[i] : -B[i];
+                top_left[i] = a > 0 || (a == 0 && b < 0);
+            }
+
+            float inv_area2 = 1.0f / area2;
+            for (int i = 0; i < 3; ++i)
+            {
+                A[i] *= inv_area2;
+                B[i] *= inv_area2;
+            }
+            return true;
+        }
+
+        float eval(int i, float x, float y) const { return A[i] * (x - X[i]) + B[i] * (y - Y[i]); }
+
+        // Classifies the rectangle of sample positions [x0, x1] x [y0, y1] against the triangle. The edge
+        // functions are linear, so only the corner where an edge is largest (or smallest) has to be checked.
+        block_coverage classify(float x0, float y0, float x1, float y1) const
+        {
+            bool full = true;
+            for (int i = 0; i < 3; ++i)
+            {
+                float e_max = eval(i, A[i] > 0 ? x1 : x0, B[i] > 0 ? y1 : y0);
+                if (e_max < 0)
+                    return block_coverage::None; // every sample is outside this edge
+                float e_min = eval(i, A[i] > 0 ? x0 : x1, B[i] > 0 ? y0 : y1);
+                if (e_min <= 0)
+                    full = false;
+            }
+            return full ? block_coverage::Full : block_coverage::Partial;
+        }
+
+        bool inside(const float* e) const
+        {
+            return (e[0] > 0 || (e[0] == 0 && top_left[0])) &&
+                   (e[1] > 0 || (e[1] == 0 && top_left[1])) &&
+                   (e[2] > 0 || (e[2] == 0 && top_left[2]));
+        }
+    };
+
+    // Twice the signed area of the triangle, positive if it winds counter clockwise (y up)
+    template <typename Vec>
+    float signed_area2(const Vec* v)
+    {
+        return (v[1].x() - v[0].x()) * (v[2].y() - v[0].y()) - (v[2].x() - v[0].x()) * (v[1].y() - v[0].y());
+    }
+
+    // True if the bounding box of the triangle contains none of the sample positions (k + offset) * step, k an
+    // integer, in x or in y: the triangle can not cover a sample. Pixel centers are step 1, offset 0.5.
+    template <typename Vec>
+    bool misses_samples(const Vec* v, float step = 1.0f, float offset = 0.5f)
+    {
+        for (int axis = 0; axis < 2; ++axis)
+        {
+            float lo = std::min({ v[0][axis], v[1][axis], v[2][axis] }) / step - offset;
+            float hi = std::max({ v[0][axis], v[1][axis], v[2][axis] }) / step - offset;
+            if (std::ceil(lo) > std::floor(hi))
+                return true;
+        }
+        return false;
+    }
+}
+
+#endif //RASTERIZER_EDGEFUNCTION_H
@@ -0,0 +1,80 @@
+//
+// Background image encoder for rendering image sequences.
+//
+
+#include <algorithm>
+#include "ImageWriter.hpp"
+
+rst::image_writer::image_writer(int num_threads, int max_pending) : max_pending(std::max(1, max_pending))
+{
+    // Fast zlib level: frames are written at the rate they are rendered, a few percent larger files are fine
+    params = { cv::IMWRITE_PNG_COMPRESSION, 1 };
+
+    for (int i = 0; i < std::max(1, num_threads); ++i)
+        threads.emplace_back(&image_writer::worker_loop, this);
+}
+
+rst::image_writer::~image_writer()
+{
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        stop = true;
+    }
+    queued_cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+void rst::image_writer::write(const std::string& filename, const cv::Mat& image)
+{
+    // Copy outside the lock: the caller's image usually wraps the frame buffer the next frame draws to
+    job next{ filename, image.clone() };
+
+    std::unique_lock<std::mutex> lk(mtx);
+    taken_cv.wait(lk, [this] { return (int)jobs.size() < max_pending; });
+    jobs.push_back(std::move(next));
+    lk.unlock();
+    queued_cv.notify_one();
+}
+
+int rst::image_writer::finish()
+{
+    std::unique_lock<std::mutex> lk(mtx);
+    taken_cv.wait(lk, [this] { return jobs.empty() && writing == 0; });
+    return failures;
+}
+
+void rst::image_writer::worker_loop()
+{
+    while (true)
+    {
+        job current;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            queued_cv.wait(lk, [this] { return stop || !jobs.empty(); });
+            if (jobs.empty())
+                return; // stopping, and nothing left to write
+            current = std::move(jobs.front());
+            jobs.pop_front();
+            ++writing;
+        }
+        taken_cv.notify_all();
+
+        bool written = false;
+        try
+        {
+            written = cv::imwrite(current.filename, current.image, params);
+        }
+        catch (const cv::Exception&)
+        {
+        }
+
+        {
+            std::lock_guard<std::mutex> lg(mtx);
+            --writing;
+            if (!written)
+                ++failures;
+        }
+        taken_cv.notify_all();
+    }
+}
@@ -0,0 +1,61 @@
+//
+// Background image encoder for rendering image sequences.
+//
+
+#ifndef RASTERIZER_IMAGEWRITER_H
+#define RASTERIZER_IMAGEWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace rst
+{
+    /*
+     * Encodes and saves images on worker threads, so writing frame N overlaps with rendering frame N + 1.
+     * write() copies the image into the queue and returns. It only blocks while max_pending images are already
+     * waiting: an encoder slower than the renderer holds the renderer back instead of filling up memory.
+     * Images are written in any order, each to its own file.
+     * */
+    class image_writer
+    {
+    public:
+        explicit image_writer(int num_threads = 1, int max_pending = 4);
+        ~image_writer(); // writes everything still queued
+
+        image_writer(const image_writer&) = delete;
+        image_writer& operator=(const image_writer&) = delete;
+
+        void write(const std::string& filename, const cv::Mat& image);
+
+        // Blocks until every queued image is written. Returns the number of images that failed so far.
+        int finish();
+
+    private:
+        struct job
+        {
+            std::string filename;
+            cv::Mat image;
+        };
+
+        void worker_loop();
+
+        std::vector<std::thread> threads;
+        std::vector<int> params;    // encoder parameters passed to cv::imwrite
+
+        std::mutex mtx;
+        std::condition_variable queued_cv;      // a job was queued, or stop
+        std::condition_variable taken_cv;       // a job was taken or finished
+        std::deque<job> jobs;
+        int max_pending;
+        int writing = 0;
+        int failures = 0;
+        bool stop = false;
+    };
+}
+
+#endif //RASTERIZER_IMAGEWRITER_H
@@ -0,0 +1,39 @@
+//
+// Read-only memory mapping of a whole file.
+//
+
+#ifndef RASTERIZER_MAPPEDFILE_H
+#define RASTERIZER_MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace rst
+{
+    class mapped_file
+    {
+    public:
+        mapped_file() = default;
+        ~mapped_file() { close(); }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        // False if the file does not exist, is empty or cannot be mapped
+        bool open(const std::string& path);
+        void close();
+
+        const char* data() const { return (const char*)view; }
+        size_t size() const { return view_size; }
+
+    private:
+        void* view = nullptr;
+        size_t view_size = 0;
+#if defined(_WIN32)
+        void* file = nullptr;
+        void* mapping = nullptr;
+#endif
+    };
+}
+
+#endif //RASTERIZER_MAPPEDFILE_H
@@ -0,0 +1,193 @@
+//
+// Binary cache of parsed meshes, memory mapped on later runs.
+//
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "MeshCache.hpp"
+
+namespace
+{
+    constexpr char MAGIC[8] = { 'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H' };
+    constexpr uint32_t VERSION = 1;
+    constexpr int ARRAY_COUNT = 5;
+
+    struct cache_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t key;
+        uint64_t source_size;
+        int64_t source_time;
+        uint64_t source_hash;
+        uint64_t vertex_count, triangle_count, node_count;
+        uint64_t offsets[ARRAY_COUNT];  // of the arrays, from the start of the file
+    };
+
+    uint64_t align16(uint64_t offset) { return (offset + 15) & ~(uint64_t)15; }
+
+    // Sizes in bytes of the arrays, in file order
+    void array_sizes(uint64_t vertices, uint64_t triangles, uint64_t nodes, uint64_t* sizes)
+    {
+        sizes[0] = vertices * 3 * sizeof(float);
+        sizes[1] = vertices * 3 * sizeof(float);
+        sizes[2] = vertices * 2 * sizeof(float);
+        sizes[3] = triangles * 3 * sizeof(uint32_t);
+        sizes[4] = nodes * sizeof(rst::mesh_cache_node);
+    }
+
+    bool stat_source(const std::string& source, uint64_t& size, int64_t& time)
+    {
+        std::error_code error;
+        size = std::filesystem::file_size(source, error);
+        if (error)
+            return false;
+        time = (int64_t)std::filesystem::last_write_time(source, error).time_since_epoch().count();
+        return !error;
+    }
+
+    // FNV-1a over the 64-bit words of the file, then its last bytes
+    bool hash_source(const std::string& source, uint64_t& hash)
+    {
+        std::ifstream file(source, std::ios::binary);
+        if (!file)
+            return false;
+
+        const uint64_t prime = 1099511628211ull;
+        hash = 14695981039346656037ull;
+        std::vector<char> buffer(1 << 16);
+        while (file)
+        {
+            file.read(buffer.data(), buffer.size());
+            size_t count = (size_t)file.gcount();
+            size_t words = count / 8;
+            for (size_t i = 0; i < words; ++i)
+            {
+                uint64_t word;
+                std::memcpy(&word, &buffer[i * 8], 8);
+                hash = (hash ^ word) * prime;
+            }
+            for (size_t i = words * 8; i < count; ++i)
+                hash = (hash ^ (unsigned char)buffer[i]) * prime;
+        }
+        return true;
+    }
+}
+
+bool rst::mesh_cache::open(const std::string& source, uint32_t key)
+{
+    close();
+
+    uint64_t source_size;
+    int64_t source_time;
+    if (!stat_source(source, source_size, source_time))
+        return false;
+
+    if (!file.open(source + ".meshcache"))
+        return false;
+
+    const char* base = file.data();
+    size_t size = file.size();
+    cache_header header;
+    bool valid = size >= sizeof(header);
+    if (valid)
+    {
+        std::memcpy(&header, base, sizeof(header));
+        valid = std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.version == VERSION && header.key == key &&
+                header.source_size == source_size && header.vertex_count <= size &&
+                header.triangle_count <= size && header.node_count <= size;
+    }
+    if (valid)
+    {
+        uint64_t sizes[ARRAY_COUNT];
+        array_sizes(header.vertex_count, header.triangle_count, header.node_count, sizes);
+        for (int i = 0; i < ARRAY_COUNT; ++i)
+            valid = valid && header.offsets[i] % 16 == 0 && header.offsets[i] <= size && sizes[i] <= size - header.offsets[i];
+    }
+    if (valid && header.source_time != source_time)
+    {
+        uint64_t hash;
+        valid = hash_source(source, hash) && hash == header.source_hash;
+    }
+    if (!valid)
+    {
+        close();
+        return false;
+    }
+
+    mapped.positions = (const float*)(base + header.offsets[0]);
+    mapped.normals = (const float*)(base + header.offsets[1]);
+    mapped.tex_coords = (const float*)(base + header.offsets[2]);
+    mapped.vertex_count = (size_t)header.vertex_count;
+    mapped.indices = (const uint32_t*)(base + header.offsets[3]);
+    mapped.triangle_count = (size_t)header.triangle_count;
+    mapped.nodes = (const mesh_cache_node*)(base + header.offsets[4]);
+    mapped.node_count = (size_t)header.node_count;
+    return true;
+}
+
+void rst::mesh_cache::close()
+{
+    file.close();
+    mapped = {};
+}
+
+bool rst::mesh_cache::write(const std::string& source, uint32_t key, const mesh_arrays& arrays)
+{
+    cache_header header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.key = key;
+    if (!stat_source(source, header.source_size, header.source_time) || !hash_source(source, header.source_hash))
+        return false;
+    header.vertex_count = arrays.vertex_count;
+    header.triangle_count = arrays.triangle_count;
+    header.node_count = arrays.node_count;
+
+    const void* data[ARRAY_COUNT] = { arrays.positions, arrays.normals, arrays.tex_coords, arrays.indices, arrays.nodes };
+    uint64_t sizes[ARRAY_COUNT];
+    array_sizes(header.vertex_count, header.triangle_count, header.node_count, sizes);
+    uint64_t offset = align16(sizeof(header));
+    for (int i = 0; i < ARRAY_COUNT; ++i)
+    {
+        header.offsets[i] = offset;
+        offset = align16(offset + sizes[i]);
+    }
+
+    // Written to a temporary file first, so a run that is interrupted, or a concurrent run, never sees half a cache
+    std::string path = source + ".meshcache";
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+        const char padding[16] = {};
+        out.write((const char*)&header, sizeof(header));
+        uint64_t written = sizeof(header);
+        for (int i = 0; i < ARRAY_COUNT; ++i)
+        {
+            out.write(padding, (std::streamsize)(header.offsets[i] - written));
+            if (sizes[i])
+                out.write((const char*)data[i], (std::streamsize)sizes[i]);
+            written = header.offsets[i] + sizes[i];
+        }
+        if (!out)
+        {
+            out.close();
+            std::remove(temp.c_str());
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+    if (error)
+    {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+//
+// Binary cache of parsed meshes, memory mapped on later runs.
+//
+
+#ifndef RASTERIZER_MESHCACHE_H
+#define RASTERIZER_MESHCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "MappedFile.hpp"
+
+namespace rst
+{
+    /*
+     * The cache of a mesh file is written next to it as <source>.meshcache, holding the arrays the program built
+     * from the source: a header, then each array starting at a multiple of 16 bytes,
+     *   positions   float[3 * vertex_count]
+     *   normals     float[3 * vertex_count]
+     *   tex_coords  float[2 * vertex_count]
+     *   indices     uint32[3 * triangle_count]
+     *   bvh nodes   mesh_cache_node[node_count], optional
+     * in the byte order of the machine that wrote it.
+     *
+     * A cache is only used if it was written for the same key, which names what the caller did to the source
+     * (the vertex welding, a transform, the BVH build...), and for a source of the same size with the same
+     * modification time. If only the time differs, as after a fresh checkout, the content hash decides.
+     * Anything else is a miss: the caller parses the source and writes a new cache.
+     * */
+    struct mesh_cache_node
+    {
+        float bounds_min[3], bounds_max[3];
+        uint32_t right;     // interior nodes: index of the right child, the left child follows the node; 0 for leaves
+        uint32_t primitive; // leaves: index of the triangle
+    };
+
+    struct mesh_arrays
+    {
+        const float* positions = nullptr;
+        const float* normals = nullptr;
+        const float* tex_coords = nullptr;
+        size_t vertex_count = 0;
+        const uint32_t* indices = nullptr;
+        size_t triangle_count = 0;
+        const mesh_cache_node* nodes = nullptr;
+        size_t node_count = 0;
+    };
+
+    class mesh_cache
+    {
+    public:
+        mesh_cache() = default;
+        ~mesh_cache() { close(); }
+
+        mesh_cache(const mesh_cache&) = delete;
+        mesh_cache& operator=(const mesh_cache&) = delete;
+
+        // Maps the cache of source if it is valid for it and key. The arrays point into the mapping until close().
+        bool open(const std::string& source, uint32_t key);
+        void close();
+
+        const mesh_arrays& arrays() const { return mapped; }
+
+        // Writes the cache of source, replacing an old one. Returns false if it could not be written.
+        static bool write(const std::string& source, uint32_t key, const mesh_arrays& arrays);
+
+    private:
+        mesh_arrays mapped;
+        mapped_file file;
+    };
+}
+
+#endif //RASTERIZER_MESHCACHE_H
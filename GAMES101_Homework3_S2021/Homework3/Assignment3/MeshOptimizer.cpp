@@ -0,0 +1,317 @@
+//
+// Vertex welding and triangle reordering for indexed meshes.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+#include "MeshOptimizer.hpp"
+#include "ThreadPool.hpp"
+
+namespace
+{
+    constexpr uint32_t NONE = 0xffffffffu;
+
+    // Smaller meshes are welded on the calling thread
+    constexpr size_t MIN_PARALLEL_VERTICES = 1 << 16;
+
+    // Entries of the simulated post-transform cache; Forsyth's scores are tuned for 32
+    constexpr int CACHE_SIZE = 32;
+
+    // The attributes of a vertex as raw bits, so -0 and 0 or two NaNs compare like memcmp
+    struct vertex_bits
+    {
+        uint32_t words[8];
+
+        bool operator==(const vertex_bits& other) const { return std::memcmp(words, other.words, sizeof(words)) == 0; }
+    };
+
+    vertex_bits load_bits(const rst::obj_mesh& mesh, size_t i)
+    {
+        vertex_bits bits;
+        std::memcpy(&bits.words[0], &mesh.positions[3 * i], 3 * sizeof(float));
+        std::memcpy(&bits.words[3], &mesh.normals[3 * i], 3 * sizeof(float));
+        std::memcpy(&bits.words[6], &mesh.tex_coords[2 * i], 2 * sizeof(float));
+        return bits;
+    }
+
+    uint64_t hash_bits(const vertex_bits& bits)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (uint32_t word : bits.words)
+            hash = (hash ^ word) * 1099511628211ull;
+        return hash ^ (hash >> 32);
+    }
+
+    // The top bits of a hash pick the partition, the low bits the slot within the partition's table
+    size_t partition_of(uint64_t hash, size_t partitions) { return (size_t)(hash >> 48) % partitions; }
+
+    // Sets first[i] to the lowest index of a vertex with the same attributes as i, for the vertices of one partition.
+    // Vertices are visited in order, so the first copy of a vertex is the one that ends up in the table.
+    void match_partition(const rst::obj_mesh& mesh, const std::vector<uint64_t>& hashes, size_t partition,
+                         size_t partitions, std::vector<uint32_t>& first)
+    {
+        size_t count = 0;
+        for (uint64_t hash : hashes)
+            count += partition_of(hash, partitions) == partition;
+        size_t size = 16;
+        while (size < 2 * count)
+            size *= 2;
+
+        std::vector<uint32_t> slots(size, NONE);
+        for (size_t i = 0; i < hashes.size(); ++i)
+        {
+            if (partition_of(hashes[i], partitions) != partition)
+                continue;
+            vertex_bits bits = load_bits(mesh, i);
+            for (size_t s = hashes[i] & (size - 1);; s = (s + 1) & (size - 1))
+            {
+                uint32_t other = slots[s];
+                if (other == NONE)
+                {
+                    slots[s] = (uint32_t)i;
+                    first[i] = (uint32_t)i;
+                    break;
+                }
+                if (hashes[other] == hashes[i] && load_bits(mesh, other) == bits)
+                {
+                    first[i] = other;
+                    break;
+                }
+            }
+        }
+    }
+
+    float vertex_score(int cache_position, uint32_t remaining_triangles)
+    {
+        if (remaining_triangles == 0)
+            return -1.0f;
+
+        float score = 0;
+        if (cache_position >= 0)
+        {
+            // The last triangle's vertices score a little lower, so the next triangle does not reuse the same edge
+            // and strips run across the mesh instead of fanning around one vertex
+            if (cache_position < 3)
+                score = 0.75f;
+            else
+                score = std::pow(1.0f - (cache_position - 3) / (float)(CACHE_SIZE - 3), 1.5f);
+        }
+        // Vertices with few triangles left are finished first, so they do not stay behind as isolated triangles
+        return score + 2.0f / std::sqrt((float)remaining_triangles);
+    }
+
+    // Numbers the vertices in the order the index buffer first uses them and moves their attributes to match
+    void reorder_vertices(rst::obj_mesh& mesh)
+    {
+        std::vector<uint32_t> remap(mesh.vertex_count(), NONE);
+        uint32_t next = 0;
+        for (uint32_t& index : mesh.indices)
+        {
+            if (remap[index] == NONE)
+                remap[index] = next++;
+            index = remap[index];
+        }
+
+        rst::obj_mesh reordered;
+        reordered.positions.resize(3 * (size_t)next);
+        reordered.normals.resize(3 * (size_t)next);
+        reordered.tex_coords.resize(2 * (size_t)next);
+        for (size_t v = 0; v < remap.size(); ++v)
+        {
+            if (remap[v] == NONE)
+                continue;
+            std::copy_n(&mesh.positions[3 * v], 3, &reordered.positions[3 * (size_t)remap[v]]);
+            std::copy_n(&mesh.normals[3 * v], 3, &reordered.normals[3 * (size_t)remap[v]]);
+            std::copy_n(&mesh.tex_coords[2 * v], 2, &reordered.tex_coords[2 * (size_t)remap[v]]);
+        }
+        mesh.positions.swap(reordered.positions);
+        mesh.normals.swap(reordered.normals);
+        mesh.tex_coords.swap(reordered.tex_coords);
+    }
+}
+
+void rst::weld_vertices(obj_mesh& mesh, int num_threads)
+{
+    size_t vertex_count = mesh.vertex_count();
+    if (vertex_count == 0)
+        return;
+
+    if (num_threads <= 0)
+        num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    size_t partitions = vertex_count < MIN_PARALLEL_VERTICES ? 1 : (size_t)num_threads;
+    std::unique_ptr<rst::thread_pool> pool;
+    if (partitions > 1)
+        pool = std::make_unique<rst::thread_pool>(num_threads);
+    auto for_each_partition = [&](const std::function<void(size_t)>& job)
+    {
+        if (pool)
+            pool->parallel_for((int)partitions, [&](int p, int) { job((size_t)p); });
+        else
+            job(0);
+    };
+
+    // Each thread hashes a range of vertices, then matches the vertices whose hash falls into its partition
+    std::vector<uint64_t> hashes(vertex_count);
+    for_each_partition([&](size_t p)
+    {
+        size_t end = vertex_count * (p + 1) / partitions;
+        for (size_t i = vertex_count * p / partitions; i < end; ++i)
+            hashes[i] = hash_bits(load_bits(mesh, i));
+    });
+    std::vector<uint32_t> first(vertex_count);
+    for_each_partition([&](size_t p) { match_partition(mesh, hashes, p, partitions, first); });
+
+    std::vector<uint32_t> remap(vertex_count);
+    size_t welded = 0;
+    for (size_t i = 0; i < vertex_count; ++i)
+    {
+        if (first[i] != i)
+        {
+            remap[i] = remap[first[i]];
+            continue;
+        }
+        remap[i] = (uint32_t)welded;
+        std::copy_n(&mesh.positions[3 * i], 3, &mesh.positions[3 * welded]);
+        std::copy_n(&mesh.normals[3 * i], 3, &mesh.normals[3 * welded]);
+        std::copy_n(&mesh.tex_coords[2 * i], 2, &mesh.tex_coords[2 * welded]);
+        ++welded;
+    }
+    if (welded == vertex_count)
+        return;
+
+    mesh.positions.resize(3 * welded);
+    mesh.normals.resize(3 * welded);
+    mesh.tex_coords.resize(2 * welded);
+    for (uint32_t& index : mesh.indices)
+        index = remap[index];
+}
+
+void rst::optimize_vertex_cache(obj_mesh& mesh)
+{
+    size_t triangle_count = mesh.triangle_count();
+    size_t vertex_count = mesh.vertex_count();
+    if (triangle_count == 0)
+        return;
+    const std::vector<uint32_t>& indices = mesh.indices;
+
+    // The triangles of every vertex, in one array. The triangles not emitted yet are kept at the front of each
+    // vertex's range, remaining[v] of them.
+    std::vector<uint32_t> first_triangle(vertex_count + 1, 0);
+    for (uint32_t index : indices)
+        ++first_triangle[index + 1];
+    for (size_t v = 0; v < vertex_count; ++v)
+        first_triangle[v + 1] += first_triangle[v];
+    std::vector<uint32_t> remaining(vertex_count, 0);
+    std::vector<uint32_t> vertex_triangles(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+    {
+        uint32_t v = indices[i];
+        vertex_triangles[first_triangle[v] + remaining[v]++] = (uint32_t)(i / 3);
+    }
+
+    std::vector<int> cache_position(vertex_count, -1);
+    std::vector<float> vertex_scores(vertex_count);
+    for (size_t v = 0; v < vertex_count; ++v)
+        vertex_scores[v] = vertex_score(-1, remaining[v]);
+    std::vector<float> triangle_scores(triangle_count);
+    uint32_t best = 0;
+    for (size_t t = 0; t < triangle_count; ++t)
+    {
+        triangle_scores[t] = vertex_scores[indices[3 * t]] + vertex_scores[indices[3 * t + 1]] + vertex_scores[indices[3 * t + 2]];
+        if (triangle_scores[t] > triangle_scores[best])
+            best = (uint32_t)t;
+    }
+
+    std::vector<bool> emitted(triangle_count, false);
+    std::vector<uint32_t> order;
+    order.reserve(triangle_count);
+    std::vector<uint32_t> cache, next_cache;
+    cache.reserve(CACHE_SIZE + 3);
+    next_cache.reserve(CACHE_SIZE + 3);
+    size_t next_unemitted = 0;
+
+    for (size_t k = 0; k < triangle_count; ++k)
+    {
+        // No triangle touches the cache: continue with the next one in the old order rather than searching
+        // every triangle for the best score, which keeps the whole pass linear
+        if (best == NONE)
+        {
+            while (emitted[next_unemitted])
+                ++next_unemitted;
+            best = (uint32_t)next_unemitted;
+        }
+
+        order.push_back(best);
+        emitted[best] = true;
+        const uint32_t* corners = &indices[3 * (size_t)best];
+
+        // The triangle's vertices move to the front of the cache, the others move back
+        next_cache.clear();
+        for (int j = 0; j < 3; ++j)
+        {
+            if (std::find(next_cache.begin(), next_cache.end(), corners[j]) == next_cache.end())
+                next_cache.push_back(corners[j]);
+        }
+        size_t corner_count = next_cache.size();
+        for (uint32_t v : cache)
+        {
+            if (std::find(next_cache.begin(), next_cache.begin() + corner_count, v) == next_cache.begin() + corner_count)
+                next_cache.push_back(v);
+        }
+
+        // Take the triangle out of its vertices' lists of remaining triangles
+        for (int j = 0; j < 3; ++j)
+        {
+            uint32_t v = corners[j];
+            uint32_t* list = &vertex_triangles[first_triangle[v]];
+            uint32_t* end = list + remaining[v];
+            uint32_t* found = std::find(list, end, best);
+            if (found != end)
+            {
+                std::swap(*found, end[-1]);
+                --remaining[v];
+            }
+        }
+
+        // Rescore the vertices that were or are in the cache and pass the change on to their triangles, then
+        // continue with the best triangle among those
+        for (size_t i = 0; i < next_cache.size(); ++i)
+        {
+            uint32_t v = next_cache[i];
+            cache_position[v] = i < CACHE_SIZE ? (int)i : -1;
+            float score = vertex_score(cache_position[v], remaining[v]);
+            float delta = score - vertex_scores[v];
+            vertex_scores[v] = score;
+            for (uint32_t j = 0; j < remaining[v]; ++j)
+                triangle_scores[vertex_triangles[first_triangle[v] + j]] += delta;
+        }
+        best = NONE;
+        float best_score = -1e30f;
+        if (next_cache.size() > CACHE_SIZE)
+            next_cache.resize(CACHE_SIZE);
+        for (uint32_t v : next_cache)
+        {
+            for (uint32_t j = 0; j < remaining[v]; ++j)
+            {
+                uint32_t t = vertex_triangles[first_triangle[v] + j];
+                if (triangle_scores[t] > best_score)
+                {
+                    best = t;
+                    best_score = triangle_scores[t];
+                }
+            }
+        }
+        cache.swap(next_cache);
+    }
+
+    std::vector<uint32_t> reordered(indices.size());
+    for (size_t k = 0; k < triangle_count; ++k)
+        std::copy_n(&indices[3 * (size_t)order[k]], 3, &reordered[3 * k]);
+    mesh.indices.swap(reordered);
+
+    reorder_vertices(mesh);
+}
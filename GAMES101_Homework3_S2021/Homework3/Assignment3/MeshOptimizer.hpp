@@ -0,0 +1,24 @@
+//
+// Vertex welding and triangle reordering for indexed meshes.
+//
+
+#ifndef RASTERIZER_MESHOPTIMIZER_H
+#define RASTERIZER_MESHOPTIMIZER_H
+
+#include "ObjParser.hpp"
+
+namespace rst
+{
+    // Merges vertices whose position, normal and texture coordinates are bit for bit the same, as the corners of
+    // an obj that repeats its v lines per face. Vertices keep the order of their first copy. Large meshes are
+    // hashed and matched on num_threads threads (0: one per hardware core); the result does not depend on it.
+    void weld_vertices(obj_mesh& mesh, int num_threads = 0);
+
+    // Reorders the triangles so consecutive ones share vertices (Forsyth, "Linear-Speed Vertex Cache
+    // Optimisation"), then numbers the vertices in the order the triangles first use them, so a vertex stage
+    // walking the index buffer finds most vertices in its cache and reads the vertex arrays front to back.
+    // Vertices no triangle uses are dropped.
+    void optimize_vertex_cache(obj_mesh& mesh);
+}
+
+#endif //RASTERIZER_MESHOPTIMIZER_H
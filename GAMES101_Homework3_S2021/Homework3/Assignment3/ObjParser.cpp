@@ -0,0 +1,380 @@
+//
+// Streaming Wavefront obj parser producing indexed vertex arrays.
+//
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include "ObjParser.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+
+namespace
+{
+    // Files are split into chunks of at least this size, smaller ones are not worth starting threads for
+    constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+    constexpr uint32_t EMPTY_SLOT = 0xffffffffu;
+
+    // A face corner: indices into the v, vt and vn lines of the file, -1 for a missing vt or vn
+    struct corner
+    {
+        int32_t v, vt, vn;
+
+        bool operator==(const corner& other) const { return v == other.v && vt == other.vt && vn == other.vn; }
+    };
+
+    // Open addressing hash map from corners to their vertex index, kept at most half full
+    class corner_table
+    {
+    public:
+        // The index of c, or next if c was not in the table yet, which sets inserted
+        uint32_t insert(const corner& c, uint32_t next, bool& inserted)
+        {
+            if ((count + 1) * 2 > slots.size())
+                grow();
+
+            size_t mask = slots.size() - 1;
+            for (size_t i = hash(c) & mask;; i = (i + 1) & mask)
+            {
+                slot& s = slots[i];
+                if (s.value == EMPTY_SLOT)
+                {
+                    s = { c, next };
+                    ++count;
+                    inserted = true;
+                    return next;
+                }
+                if (s.key == c)
+                {
+                    inserted = false;
+                    return s.value;
+                }
+            }
+        }
+
+    private:
+        struct slot
+        {
+            corner key;
+            uint32_t value = EMPTY_SLOT;
+        };
+
+        static size_t hash(const corner& c)
+        {
+            uint64_t h = (uint32_t)c.v * 0x9e3779b97f4a7c15ull;
+            h ^= ((uint64_t)(uint32_t)c.vt << 32 | (uint32_t)c.vn) * 0xc2b2ae3d27d4eb4full;
+            return (size_t)(h ^ (h >> 29));
+        }
+
+        void grow()
+        {
+            std::vector<slot> old(std::max<size_t>(slots.size() * 2, 1024));
+            old.swap(slots);
+            size_t mask = slots.size() - 1;
+            for (const slot& s : old)
+            {
+                if (s.value == EMPTY_SLOT)
+                    continue;
+                size_t i = hash(s.key) & mask;
+                while (slots[i].value != EMPTY_SLOT)
+                    i = (i + 1) & mask;
+                slots[i] = s;
+            }
+        }
+
+        std::vector<slot> slots;
+        size_t count = 0;
+    };
+
+    // A range of whole lines of the file, parsed on its own
+    struct chunk
+    {
+        const char* begin;
+        const char* end;
+        size_t v_count = 0, vt_count = 0, vn_count = 0;     // lines of each kind in the chunk
+        size_t v_first = 0, vt_first = 0, vn_first = 0;     // and in the chunks before it
+
+        corner_table table;
+        std::vector<corner> corners;    // distinct corners of the chunk's faces, in order of first use
+        std::vector<uint32_t> indices;  // into corners, 3 per triangle
+        bool valid = true;
+    };
+
+    // Arrays of the v, vt and vn lines of the whole file; the chunks fill in their part
+    struct raw_attributes
+    {
+        std::vector<float> positions, tex_coords, normals;
+    };
+
+    const char* skip_blanks(const char* p, const char* end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        return p;
+    }
+
+    const char* line_end(const char* p, const char* end)
+    {
+        const char* newline = (const char*)std::memchr(p, '\n', end - p);
+        return newline ? newline : end;
+    }
+
+    // The kind of the line: 'v', 't' for vt, 'n' for vn, 'f', or 0 for lines that are skipped.
+    // args is set to the first character after the keyword.
+    char line_kind(const char* p, const char* end, const char*& args)
+    {
+        p = skip_blanks(p, end);
+        char kind = 0;
+        if (p < end && *p == 'f')
+        {
+            kind = 'f';
+            ++p;
+        }
+        else if (p < end && *p == 'v')
+        {
+            ++p;
+            kind = p < end && (*p == 't' || *p == 'n') ? *p++ : 'v';
+        }
+        if (p >= end || (*p != ' ' && *p != '\t'))
+            return 0;
+        args = p;
+        return kind;
+    }
+
+    // Missing or unreadable numbers are read as 0, like the components a vt line leaves out
+    const char* parse_float(const char* p, const char* end, float& value)
+    {
+        value = 0;
+        p = skip_blanks(p, end);
+        if (p < end && *p == '+')
+            ++p;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec == std::errc::result_out_of_range)
+            value = 0;
+        return result.ec == std::errc::invalid_argument ? p : result.ptr;
+    }
+
+    // Reads an index of a face corner: 1-based, or negative counting back from the last of count lines.
+    // An empty index, as the vt of v//vn, is -1. Returns false for 0 or an index before the first line.
+    bool parse_index(const char*& p, const char* end, size_t count, int32_t& index)
+    {
+        int64_t value;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc())
+        {
+            index = -1;
+            return result.ec == std::errc::invalid_argument;
+        }
+        p = result.ptr;
+        int64_t resolved = value > 0 ? value - 1 : (int64_t)count + value;
+        if (value == 0 || resolved < 0 || resolved > INT32_MAX)
+            return false;
+        index = (int32_t)resolved;
+        return true;
+    }
+
+    void count_lines(chunk& c)
+    {
+        const char* args;
+        for (const char* p = c.begin; p < c.end;)
+        {
+            const char* e = line_end(p, c.end);
+            switch (line_kind(p, e, args))
+            {
+                case 'v': ++c.v_count; break;
+                case 't': ++c.vt_count; break;
+                case 'n': ++c.vn_count; break;
+            }
+            p = e == c.end ? e : e + 1;
+        }
+    }
+
+    void parse_face(chunk& c, const char* p, const char* end, size_t v_seen, size_t vt_seen, size_t vn_seen,
+                    std::vector<uint32_t>& face)
+    {
+        face.clear();
+        while (true)
+        {
+            p = skip_blanks(p, end);
+            if (p >= end || *p == '\r' || *p == '#')
+                break;
+
+            corner k = { -1, -1, -1 };
+            bool valid = parse_index(p, end, v_seen, k.v) && k.v >= 0;
+            if (valid && p < end && *p == '/')
+            {
+                valid = parse_index(++p, end, vt_seen, k.vt);
+                if (valid && p < end && *p == '/')
+                    valid = parse_index(++p, end, vn_seen, k.vn);
+            }
+            if (!valid || (p < end && *p != ' ' && *p != '\t' && *p != '\r'))
+            {
+                c.valid = false;
+                return;
+            }
+
+            bool inserted;
+            face.push_back(c.table.insert(k, (uint32_t)c.corners.size(), inserted));
+            if (inserted)
+                c.corners.push_back(k);
+        }
+
+        for (size_t i = 2; i < face.size(); ++i)
+        {
+            c.indices.push_back(face[0]);
+            c.indices.push_back(face[i - 1]);
+            c.indices.push_back(face[i]);
+        }
+    }
+
+    void parse_chunk(chunk& c, raw_attributes& raw)
+    {
+        size_t v_seen = c.v_first, vt_seen = c.vt_first, vn_seen = c.vn_first;
+        std::vector<uint32_t> face;
+        const char* args;
+        for (const char* p = c.begin; p < c.end && c.valid;)
+        {
+            const char* e = line_end(p, c.end);
+            switch (line_kind(p, e, args))
+            {
+                case 'v':
+                {
+                    float* out = &raw.positions[3 * v_seen++];
+                    for (int i = 0; i < 3; ++i)
+                        args = parse_float(args, e, out[i]);
+                    break;
+                }
+                case 't':
+                {
+                    float* out = &raw.tex_coords[2 * vt_seen++];
+                    for (int i = 0; i < 2; ++i)
+                        args = parse_float(args, e, out[i]);
+                    break;
+                }
+                case 'n':
+                {
+                    float* out = &raw.normals[3 * vn_seen++];
+                    for (int i = 0; i < 3; ++i)
+                        args = parse_float(args, e, out[i]);
+                    break;
+                }
+                case 'f':
+                    parse_face(c, args, e, v_seen, vt_seen, vn_seen, face);
+                    break;
+            }
+            p = e == c.end ? e : e + 1;
+        }
+    }
+}
+
+bool rst::load_obj(const std::string& path, obj_mesh& mesh, int num_threads)
+{
+    mesh = {};
+
+    rst::mapped_file file;
+    if (!file.open(path))
+        return false;
+    const char* data = file.data();
+    const char* data_end = data + file.size();
+
+    if (num_threads <= 0)
+        num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    size_t chunk_count = std::clamp<size_t>(file.size() / MIN_CHUNK_BYTES, 1, num_threads);
+
+    // Chunks end after a newline, so no line is split between two of them
+    std::vector<chunk> chunks(chunk_count);
+    const char* begin = data;
+    for (size_t i = 0; i < chunk_count; ++i)
+    {
+        const char* end = i + 1 == chunk_count ? data_end : std::max(begin, data + file.size() * (i + 1) / chunk_count);
+        end = line_end(end, data_end);
+        end = end == data_end ? end : end + 1;
+        chunks[i].begin = begin;
+        chunks[i].end = end;
+        begin = end;
+    }
+
+    // First count the lines of each kind, so every chunk knows where its v, vt and vn lines go in the arrays of
+    // the file and how to resolve negative indices, then parse all of them at once
+    std::unique_ptr<rst::thread_pool> pool;
+    if (chunk_count > 1)
+    {
+        pool = std::make_unique<rst::thread_pool>((int)chunk_count);
+        pool->parallel_for((int)chunk_count, [&](int i, int) { count_lines(chunks[i]); });
+    }
+    else
+        count_lines(chunks[0]);
+
+    size_t v_total = 0, vt_total = 0, vn_total = 0;
+    for (chunk& c : chunks)
+    {
+        c.v_first = v_total;
+        c.vt_first = vt_total;
+        c.vn_first = vn_total;
+        v_total += c.v_count;
+        vt_total += c.vt_count;
+        vn_total += c.vn_count;
+    }
+
+    raw_attributes raw;
+    raw.positions.resize(3 * v_total);
+    raw.tex_coords.resize(2 * vt_total);
+    raw.normals.resize(3 * vn_total);
+    if (pool)
+        pool->parallel_for((int)chunk_count, [&](int i, int) { parse_chunk(chunks[i], raw); });
+    else
+        parse_chunk(chunks[0], raw);
+
+    for (const chunk& c : chunks)
+    {
+        if (!c.valid)
+            return false;
+    }
+
+    // Merge the corners of the chunks in file order, so vertices are numbered as if a single thread parsed the file
+    std::vector<corner> corners;
+    if (chunk_count == 1)
+    {
+        corners.swap(chunks[0].corners);
+        mesh.indices.swap(chunks[0].indices);
+    }
+    else
+    {
+        corner_table table;
+        std::vector<uint32_t> remap;
+        for (const chunk& c : chunks)
+        {
+            remap.resize(c.corners.size());
+            for (size_t i = 0; i < c.corners.size(); ++i)
+            {
+                bool inserted;
+                remap[i] = table.insert(c.corners[i], (uint32_t)corners.size(), inserted);
+                if (inserted)
+                    corners.push_back(c.corners[i]);
+            }
+            for (uint32_t index : c.indices)
+                mesh.indices.push_back(remap[index]);
+        }
+    }
+
+    mesh.positions.resize(3 * corners.size());
+    mesh.normals.resize(3 * corners.size());
+    mesh.tex_coords.resize(2 * corners.size());
+    for (size_t i = 0; i < corners.size(); ++i)
+    {
+        const corner& k = corners[i];
+        if ((size_t)k.v >= v_total || (k.vt >= 0 && (size_t)k.vt >= vt_total) || (k.vn >= 0 && (size_t)k.vn >= vn_total))
+        {
+            mesh = {};
+            return false;
+        }
+        std::copy_n(&raw.positions[3 * k.v], 3, &mesh.positions[3 * i]);
+        if (k.vn >= 0)
+            std::copy_n(&raw.normals[3 * k.vn], 3, &mesh.normals[3 * i]);
+        if (k.vt >= 0)
+            std::copy_n(&raw.tex_coords[2 * k.vt], 2, &mesh.tex_coords[2 * i]);
+    }
+    return true;
+}
@@ -8,6 +8,41 @@
 #include "Texture.hpp"
 
 
+struct light
+{
+    Eigen::Vector3f position;
+    Eigen::Vector3f intensity;
+};
+
+// Per draw constants of the shaders: lights, camera and material. Set up once per draw call and passed
+// to every batch, so nothing here is rebuilt per fragment.
+struct shader_uniforms
+{
+    static constexpr int MAX_LIGHTS = 4;
+    light lights[MAX_LIGHTS];
+    int num_lights = 0;
+
+    Eigen::Vector3f eye_pos{0, 0, 10};
+    Eigen::Vector3f amb_light_intensity{10, 10, 10};
+
+    // Blinn-Phong material, kd comes from the fragment color or the texture
+    Eigen::Vector3f ka{0.005, 0.005, 0.005};
+    Eigen::Vector3f ks{0.7937, 0.7937, 0.7937};
+    float p = 150;
+
+    // Bump and displacement mapping
+    float kh = 0.2, kn = 0.1;
+
+    // Returns false, and leaves the light out, once MAX_LIGHTS lights are set
+    bool add_light(const light& l)
+    {
+        if (num_lights == MAX_LIGHTS)
+            return false;
+        lights[num_lights++] = l;
+        return true;
+    }
+};
+
 struct fragment_shader_payload // a fragment is a datas structure designed to handle view, color, normal, tex_coordinates
 {
     fragment_shader_payload()
@@ -26,6 +61,53 @@ struct fragment_shader_payload // a fragment is a datas structure designed to ha
     Texture* texture;
 };
 
+// Fragments are shaded in batches of up to FRAGMENT_BATCH. Every attribute component is stored as its own
+// array (structure of arrays), so a shader is a plain loop over the batch the compiler can inline and vectorize.
+constexpr int FRAGMENT_BATCH = 64;
+
+struct fragment_batch
+{
+    int count = 0;
+    float view_pos[3][FRAGMENT_BATCH];
+    float normal[3][FRAGMENT_BATCH];
+    float color[3][FRAGMENT_BATCH];
+    float tex_coords[2][FRAGMENT_BATCH];
+    float tex_dx[2][FRAGMENT_BATCH];    // screen space derivatives of tex_coords, for mip level selection
+    float tex_dy[2][FRAGMENT_BATCH];
+    Texture* texture = nullptr;
+
+    bool full() const { return count == FRAGMENT_BATCH; }
+
+    void push(const Eigen::Vector3f& pos, const Eigen::Vector3f& nor, const Eigen::Vector3f& col, const Eigen::Vector2f& tc,
+              const Eigen::Vector2f& dx, const Eigen::Vector2f& dy)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            view_pos[c][count] = pos[c];
+            normal[c][count] = nor[c];
+            color[c][count] = col[c];
+        }
+        for (int c = 0; c < 2; ++c)
+        {
+            tex_coords[c][count] = tc[c];
+            tex_dx[c][count] = dx[c];
+            tex_dy[c][count] = dy[c];
+        }
+        ++count;
+    }
+};
+
+// What a fragment shader hands back: one rgb color per fragment of the batch
+struct fragment_output
+{
+    float color[3][FRAGMENT_BATCH];
+};
+
+// A fragment shader is any type with
+//     void shade(const fragment_batch& in, const shader_uniforms& uniforms, fragment_output& out) const;
+// rasterizer::draw is a template on it, so shade() is inlined into a batch function of its own per shader type.
+using batch_shader = void (*)(const void* shader, const fragment_batch& in, const shader_uniforms& uniforms, fragment_output& out);
+
 struct vertex_shader_payload
 {
     Eigen::Vector3f position;
@@ -0,0 +1,161 @@
+//
+// Thin wrapper over SSE/AVX float lanes used by the block rasterizer.
+//
+
+#ifndef RASTERIZER_SIMD_H
+#define RASTERIZER_SIMD_H
+
+#if defined(__AVX__)
+#define RST_SIMD_AVX 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RST_SIMD_SSE 1
+#include <emmintrin.h>
+#endif
+
+namespace rst
+{
+    namespace simd
+    {
+        /*
+         * vfloat holds WIDTH floats processed in lock step; vmask is the per lane result of a comparison.
+         * AVX gives 8 lanes, SSE 4 lanes, and without either the same interface is implemented with
+         * plain loops over 4 floats so the rasterizer code does not need to care.
+         * */
+#if defined(RST_SIMD_AVX)
+        constexpr int WIDTH = 8;
+
+        struct vmask
+        {
+            __m256 m;
+            int bits() const { return _mm256_movemask_ps(m); }
+            vmask operator&(vmask o) const { return { _mm256_and_ps(m, o.m) }; }
+            vmask operator|(vmask o) const { return { _mm256_or_ps(m, o.m) }; }
+        };
+
+        struct vfloat
+        {
+            __m256 v;
+            vfloat() = default;
+            vfloat(__m256 x) : v(x) {}
+            vfloat(float x) : v(_mm256_set1_ps(x)) {}
+            static vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+            void store(float* p) const { _mm256_storeu_ps(p, v); }
+            static vfloat ramp() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+        };
+
+        inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+        inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+        inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+        inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+        inline vmask operator<(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+        inline vmask operator>(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+        inline vmask operator<=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+        inline vmask operator>=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+        inline vmask operator==(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ) }; }
+        inline vfloat min(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+        inline vfloat max(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+        inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, m.m); }
+        inline vmask all_lanes(bool on) { return { _mm256_castsi256_ps(_mm256_set1_epi32(on ? -1 : 0)) }; }
+
+#elif defined(RST_SIMD_SSE)
+        constexpr int WIDTH = 4;
+
+        struct vmask
+        {
+            __m128 m;
+            int bits() const { return _mm_movemask_ps(m); }
+            vmask operator&(vmask o) const { return { _mm_and_ps(m, o.m) }; }
+            vmask operator|(vmask o) const { return { _mm_or_ps(m, o.m) }; }
+        };
+
+        struct vfloat
+        {
+            __m128 v;
+            vfloat() = default;
+            vfloat(__m128 x) : v(x) {}
+            vfloat(float x) : v(_mm_set1_ps(x)) {}
+            static vfloat load(const float* p) { return _mm_loadu_ps(p); }
+            void store(float* p) const { _mm_storeu_ps(p, v); }
+            static vfloat ramp() { return _mm_setr_ps(0, 1, 2, 3); }
+        };
+
+        inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+        inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+        inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+        inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+        inline vmask operator<(vfloat a, vfloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+        inline vmask operator>(vfloat a, vfloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+        inline vmask operator<=(vfloat a, vfloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+        inline vmask operator>=(vfloat a, vfloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+        inline vmask operator==(vfloat a, vfloat b) { return { _mm_cmpeq_ps(a.v, b.v) }; }
+        inline vfloat min(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+        inline vfloat max(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+        inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)); }
+        inline vmask all_lanes(bool on) { return { _mm_castsi128_ps(_mm_set1_epi32(on ? -1 : 0)) }; }
+
+#else
+        constexpr int WIDTH = 4;
+
+        struct vmask
+        {
+            bool m[WIDTH];
+            int bits() const
+            {
+                int b = 0;
+                for (int i = 0; i < WIDTH; ++i)
+                    b |= m[i] << i;
+                return b;
+            }
+            vmask operator&(vmask o) const { vmask r; for (int i = 0; i < WIDTH; ++i) r.m[i] = m[i] && o.m[i]; return r; }
+            vmask operator|(vmask o) const { vmask r; for (int i = 0; i < WIDTH; ++i) r.m[i] = m[i] || o.m[i]; return r; }
+        };
+
+        struct vfloat
+        {
+            float v[WIDTH];
+            vfloat() = default;
+            vfloat(float x) { for (int i = 0; i < WIDTH; ++i) v[i] = x; }
+            static vfloat load(const float* p) { vfloat r; for (int i = 0; i < WIDTH; ++i) r.v[i] = p[i]; return r; }
+            void store(float* p) const { for (int i = 0; i < WIDTH; ++i) p[i] = v[i]; }
+            static vfloat ramp() { vfloat r; for (int i = 0; i < WIDTH; ++i) r.v[i] = (float)i; return r; }
+        };
+
+#define RST_SIMD_BINARY(op, result, type)                                      \
+        inline result operator op(vfloat a, vfloat b)                          \
+        {                                                                      \
+            result r;                                                          \
+            for (int i = 0; i < WIDTH; ++i)                                    \
+                r.type[i] = a.v[i] op b.v[i];                                  \
+            return r;                                                          \
+        }
+        RST_SIMD_BINARY(+, vfloat, v)
+        RST_SIMD_BINARY(-, vfloat, v)
+        RST_SIMD_BINARY(*, vfloat, v)
+        RST_SIMD_BINARY(/, vfloat, v)
+        RST_SIMD_BINARY(<, vmask, m)
+        RST_SIMD_BINARY(>, vmask, m)
+        RST_SIMD_BINARY(<=, vmask, m)
+        RST_SIMD_BINARY(>=, vmask, m)
+        RST_SIMD_BINARY(==, vmask, m)
+#undef RST_SIMD_BINARY
+
+        inline vfloat min(vfloat a, vfloat b) { vfloat r; for (int i = 0; i < WIDTH; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; }
+        inline vfloat max(vfloat a, vfloat b) { vfloat r; for (int i = 0; i < WIDTH; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+        inline vfloat select(vmask m, vfloat a, vfloat b) { vfloat r; for (int i = 0; i < WIDTH; ++i) r.v[i] = m.m[i] ? a.v[i] : b.v[i]; return r; }
+        inline vmask all_lanes(bool on) { vmask r; for (int i = 0; i < WIDTH; ++i) r.m[i] = on; return r; }
+#endif
+
+        inline float reduce_max(vfloat a)
+        {
+            float lanes[WIDTH];
+            a.store(lanes);
+            float r = lanes[0];
+            for (int i = 1; i < WIDTH; ++i)
+                r = r > lanes[i] ? r : lanes[i];
+            return r;
+        }
+    }
+}
+
+#endif //RASTERIZER_SIMD_H
@@ -2,3 +2,39 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include "Texture.hpp"
+
+void Texture::buildMipmaps()
+{
+    mips.clear();
+
+    mip_level base(width, height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            auto color = image_data.at<cv::Vec3b>(y, x);
+            base.texels[base.index(x, y)] = texel(color[0], color[1], color[2], 0);
+        }
+    mips.push_back(std::move(base));
+
+    while (mips.back().width > 1 || mips.back().height > 1)
+    {
+        const mip_level& src = mips.back();
+        mip_level dst(std::max(1, src.width / 2), std::max(1, src.height / 2));
+
+        // Each texel averages a 2x2 block of the level above. When a size is odd the last block is 3 texels wide
+        // or high, so the last column or row is folded into the last texel rather than dropped.
+        for (int y = 0; y < dst.height; ++y)
+            for (int x = 0; x < dst.width; ++x)
+            {
+                int x_end = x == dst.width - 1 ? src.width : 2 * x + 2;
+                int y_end = y == dst.height - 1 ? src.height : 2 * y + 2;
+                texel sum = texel::Zero();
+                for (int sy = 2 * y; sy < y_end; ++sy)
+                    for (int sx = 2 * x; sx < x_end; ++sx)
+                        sum += src.texels[src.index(sx, sy)];
+                dst.texels[dst.index(x, y)] = sum / (float)((x_end - 2 * x) * (y_end - 2 * y));
+            }
+        mips.push_back(std::move(dst));
+    }
+}
@@ -7,10 +7,52 @@
 #include "global.hpp"
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 class Texture{
 private:
     cv::Mat image_data;
 
+    // Mip chain built at load time: level 0 is the image, every further level halves both sizes with a
+    // box filter, down to 1x1. Rows run top to bottom like the image.
+    //
+    // Texels are float rgb in [0, 255], padded to four floats so a tap is one aligned 16-byte load, stored row by row.
+    using texel = Eigen::Vector4f;
+
+    struct mip_level
+    {
+        int width, height;
+        std::vector<texel, Eigen::aligned_allocator<texel>> texels;
+
+        mip_level(int w, int h) : width(w), height(h), texels((size_t)w * h, texel::Zero()) {}
+
+        const texel* row(int y) const { return texels.data() + (size_t)y * width; }
+        int index(int x, int y) const { return y * width + x; }
+    };
+    std::vector<mip_level> mips;
+
+    void buildMipmaps();
+
+    // Bilinear filter between the four texel centers around (u, v), clamped at the borders
+    EIGEN_ALWAYS_INLINE static texel sampleBilinear(const mip_level& level, float u, float v)
+    {
+        float x = u * level.width - 0.5f;
+        float y = (1 - v) * level.height - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        float s = x - fx, t = y - fy;
+
+        int x1 = std::clamp((int)fx, 0, level.width - 1), x2 = std::clamp((int)fx + 1, 0, level.width - 1);
+        int y1 = std::clamp((int)fy, 0, level.height - 1), y2 = std::clamp((int)fy + 1, 0, level.height - 1);
+
+        const texel* row1 = level.row(y1);
+        const texel* row2 = level.row(y2);
+
+        texel u0 = row1[x1] + s * (row1[x2] - row1[x1]);
+        texel u1 = row2[x1] + s * (row2[x2] - row2[x1]);
+        return u0 + t * (u1 - u0);
+    }
+
 public:
     Texture(const std::string& name) // The convention is upper-left for image and lower-left for texture: (0, 0) to (width, height)
     {
@@ -18,6 +60,7 @@ public:
         cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
         width = image_data.cols;
         height = image_data.rows;
+        buildMipmaps();
     }
 
     int width, height;
@@ -70,5 +113,29 @@ public:
         Eigen::Vector3f color = u0 + t * (u1 - u0);
         return Eigen::Vector3f(color[0], color[1], color[2]) * 255.0f;
     }
+
+    int levels() const { return (int)mips.size(); }
+
+    // Level of detail from the screen space derivatives of (u, v): log2 of the number of level 0 texels
+    // the larger of one pixel step in x or y covers
+    float getLod(const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
+    {
+        Eigen::Vector2f size(width, height);
+        float rho2 = std::max(duv_dx.cwiseProduct(size).squaredNorm(), duv_dy.cwiseProduct(size).squaredNorm());
+        return 0.5f * std::log2(std::max(rho2, 1e-12f));
+    }
+
+    // Bilinear samples of the two mip levels around lod, blended by the fraction of lod
+    EIGEN_ALWAYS_INLINE Eigen::Vector3f getColorTrilinear(float u, float v, float lod) const
+    {
+        lod = std::min(std::max(lod, 0.0f), (float)(levels() - 1));
+        int level = (int)lod;
+        float f = lod - level; // 0 on the last level
+
+        texel color = sampleBilinear(mips[level], u, v);
+        if (f > 0)
+            color += f * (sampleBilinear(mips[level + 1], u, v) - color);
+        return color.head<3>();
+    }
 };
 #endif //RASTERIZER_TEXTURE_H
@@ -0,0 +1,97 @@
+//
+// Texture sampling microbenchmark: bilinear lookups on the 8-bit cv::Mat and on the float mip chain, fed with
+// the texture coordinates a rasterizer visits when it walks spot's triangles.
+//
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "Texture.hpp"
+#include "OBJ_Loader.h"
+
+// For every triangle, in mesh order, the points of a grid with spacing `step` texels that fall inside its
+// uv triangle, row by row: the same coherent order a scanline or tile rasterizer samples in.
+static std::vector<Eigen::Vector2f> uv_stream(const objl::Loader& loader, int width, int height, float step)
+{
+    std::vector<Eigen::Vector2f> stream;
+    for (const auto& mesh : loader.LoadedMeshes)
+    {
+        for (size_t i = 0; i + 2 < mesh.Vertices.size(); i += 3)
+        {
+            Eigen::Vector2f p[3];
+            for (int j = 0; j < 3; ++j)
+                p[j] = { mesh.Vertices[i + j].TextureCoordinate.X * width, mesh.Vertices[i + j].TextureCoordinate.Y * height };
+
+            float area = (p[1] - p[0]).x() * (p[2] - p[0]).y() - (p[1] - p[0]).y() * (p[2] - p[0]).x();
+            if (area == 0)
+                continue;
+
+            float xmin = std::min({ p[0].x(), p[1].x(), p[2].x() }), xmax = std::max({ p[0].x(), p[1].x(), p[2].x() });
+            float ymin = std::min({ p[0].y(), p[1].y(), p[2].y() }), ymax = std::max({ p[0].y(), p[1].y(), p[2].y() });
+            for (float y = std::floor(ymin / step) * step + step / 2; y <= ymax; y += step)
+                for (float x = std::floor(xmin / step) * step + step / 2; x <= xmax; x += step)
+                {
+                    bool inside = true;
+                    for (int j = 0; j < 3; ++j)
+                    {
+                        const Eigen::Vector2f& a = p[j];
+                        const Eigen::Vector2f& b = p[(j + 1) % 3];
+                        float e = (b.x() - a.x()) * (y - a.y()) - (b.y() - a.y()) * (x - a.x());
+                        inside = inside && e * area >= 0;
+                    }
+                    if (inside)
+                        stream.emplace_back(x / width, y / height);
+                }
+        }
+    }
+    return stream;
+}
+
+template <typename Sampler>
+static void run(const char* name, const std::vector<Eigen::Vector2f>& stream, Sampler sample)
+{
+    const int repeats = 5;
+    Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+    double best = 1e30;
+    for (int r = 0; r < repeats; ++r)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& uv : stream)
+            sum += sample(uv.x(), uv.y());
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(stop - start).count());
+    }
+    std::printf("  %-28s %7.2f ns/sample  (checksum %.0f)\n", name, best / stream.size(), sum.sum());
+}
+
+int main(int argc, const char** argv)
+{
+    std::string model_path = argc >= 2 ? argv[1] : "models/spot/";
+
+    objl::Loader loader;
+    if (!loader.LoadFile(model_path + "spot_triangulated_good.obj"))
+    {
+        std::printf("Could not load %sspot_triangulated_good.obj\n", model_path.c_str());
+        return 1;
+    }
+
+    std::string texture_path = model_path + "spot_texture.png";
+    Texture texture(texture_path);
+    std::printf("%s: %dx%d, %d mip levels\n", texture_path.c_str(), texture.width, texture.height, texture.levels());
+
+    // Texel spacing of consecutive pixels: magnified, one to one, and minified by 4
+    for (float step : { 0.5f, 1.0f, 4.0f })
+    {
+        auto stream = uv_stream(loader, texture.width, texture.height, step);
+        float lod = std::log2(step);
+        std::printf("step %.1f texels per pixel, %zu samples\n", step, stream.size());
+
+        run("8-bit cv::Mat bilinear", stream, [&](float u, float v) { return texture.getColorBilinear(u, v); });
+        run("float rows bilinear", stream, [&](float u, float v) { return texture.getColorTrilinear(u, v, 0); });
+        if (lod > 0)
+            run("float rows trilinear", stream, [&](float u, float v) { return texture.getColorTrilinear(u, v, lod + 0.5f); });
+    }
+    return 0;
+}
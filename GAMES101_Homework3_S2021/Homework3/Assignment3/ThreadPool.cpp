@@ -0,0 +1,126 @@
+//
+// Persistent worker pool used by the rasterizer to process screen tiles in parallel.
+//
+
+#include <algorithm>
+#include "ThreadPool.hpp"
+
+rst::thread_pool::thread_pool(int num_threads)
+{
+    if (num_threads <= 0)
+        num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    for (int i = 0; i < num_threads; ++i)
+        queues.emplace_back(std::make_unique<task_queue>());
+
+    // Worker 0 is whoever calls parallel_for
+    for (int i = 1; i < num_threads; ++i)
+        threads.emplace_back(&thread_pool::worker_loop, this, i);
+}
+
+rst::thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        stop = true;
+    }
+    start_cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+void rst::thread_pool::parallel_for(int num_tasks, const std::function<void(int, int)>& fn)
+{
+    if (num_tasks <= 0)
+        return;
+
+    // Hand out contiguous chunks, one per worker
+    int n = size();
+    for (int w = 0; w < n; ++w)
+    {
+        int begin = (int)((long long)num_tasks * w / n);
+        int end = (int)((long long)num_tasks * (w + 1) / n);
+        std::lock_guard<std::mutex> lg(queues[w]->mtx);
+        for (int task = begin; task < end; ++task)
+            queues[w]->tasks.push_back(task);
+    }
+
+    if (threads.empty())
+    {
+        job = &fn;
+        run_tasks(0);
+        job = nullptr;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        job = &fn;
+        busy = (int)threads.size();
+        ++generation;
+    }
+    start_cv.notify_all();
+
+    run_tasks(0);
+
+    std::unique_lock<std::mutex> lk(mtx);
+    done_cv.wait(lk, [this] { return busy == 0; });
+    job = nullptr;
+}
+
+void rst::thread_pool::worker_loop(int worker)
+{
+    int seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            start_cv.wait(lk, [&] { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+        }
+
+        run_tasks(worker);
+
+        std::lock_guard<std::mutex> lg(mtx);
+        if (--busy == 0)
+            done_cv.notify_one();
+    }
+}
+
+void rst::thread_pool::run_tasks(int worker)
+{
+    int task;
+    while (pop_or_steal(worker, task))
+        (*job)(task, worker);
+}
+
+bool rst::thread_pool::pop_or_steal(int worker, int& task)
+{
+    {
+        auto& own = *queues[worker];
+        std::lock_guard<std::mutex> lg(own.mtx);
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // Own queue is empty: steal from the back of the others, starting with the next worker
+    int n = size();
+    for (int i = 1; i < n; ++i)
+    {
+        auto& victim = *queues[(worker + i) % n];
+        std::lock_guard<std::mutex> lg(victim.mtx);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
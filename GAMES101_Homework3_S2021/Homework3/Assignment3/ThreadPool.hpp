@@ -0,0 +1,63 @@
+//
+// Persistent worker pool used by the rasterizer to process screen tiles in parallel.
+//
+
+#ifndef RASTERIZER_THREADPOOL_H
+#define RASTERIZER_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rst
+{
+    /*
+     * Every worker owns a deque of task indices. A worker pops from the front of its own deque and,
+     * once that runs dry, steals from the back of the other workers' deques. Tasks are handed out in
+     * contiguous chunks so neighbouring tiles usually end up on the same thread.
+     * The thread calling parallel_for() takes part in the work as worker 0.
+     * */
+    class thread_pool
+    {
+    public:
+        explicit thread_pool(int num_threads = 0); // 0: one thread per hardware core
+        ~thread_pool();
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        int size() const { return (int)queues.size(); }
+
+        // Calls job(task, worker) for every task in [0, num_tasks) and blocks until all of them are done.
+        // worker is in [0, size()) and can be used to index per-thread scratch data.
+        void parallel_for(int num_tasks, const std::function<void(int, int)>& job);
+
+    private:
+        struct task_queue
+        {
+            std::mutex mtx;
+            std::deque<int> tasks;
+        };
+
+        void worker_loop(int worker);
+        void run_tasks(int worker);
+        bool pop_or_steal(int worker, int& task);
+
+        std::vector<std::unique_ptr<task_queue>> queues;
+        std::vector<std::thread> threads;
+
+        std::mutex mtx;
+        std::condition_variable start_cv;
+        std::condition_variable done_cv;
+        const std::function<void(int, int)>* job = nullptr;
+        int generation = 0;
+        int busy = 0;
+        bool stop = false;
+    };
+}
+
+#endif //RASTERIZER_THREADPOOL_H
@@ -1,4 +1,9 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -6,7 +11,10 @@
 #include "Triangle.hpp"
 #include "Shader.hpp"
 #include "Texture.hpp"
-#include "OBJ_Loader.h"
+#include "ObjParser.hpp"
+#include "MeshOptimizer.hpp"
+#include "ImageWriter.hpp"
+#include "MeshCache.hpp"
 
 
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
@@ -72,13 +80,23 @@ Eigen::Vector3f vertex_shader(const vertex_shader_payload& payload)
     return payload.position;
 }
 
-Eigen::Vector3f normal_fragment_shader(const fragment_shader_payload& payload)
+// Every shader below takes a batch of fragments and writes one color per fragment to out.
+// Loops run over the fragments of the batch, with all attributes stored as separate float arrays.
+
+struct normal_shader
 {
-    Eigen::Vector3f return_color = (payload.normal.head<3>().normalized() + Eigen::Vector3f(1.0f, 1.0f, 1.0f)) / 2.f;
-    Eigen::Vector3f result;
-    result << return_color.x() * 255, return_color.y() * 255, return_color.z() * 255;
-    return result;
-}
+    void shade(const fragment_batch& in, const shader_uniforms&, fragment_output& out) const
+    {
+        for (int i = 0; i < in.count; ++i)
+        {
+            float nx = in.normal[0][i], ny = in.normal[1][i], nz = in.normal[2][i];
+            float inv_len = 1.0f / std::sqrt(nx * nx + ny * ny + nz * nz);
+            out.color[0][i] = (nx * inv_len + 1.0f) / 2.f * 255;
+            out.color[1][i] = (ny * inv_len + 1.0f) / 2.f * 255;
+            out.color[2][i] = (nz * inv_len + 1.0f) / 2.f * 255;
+        }
+    }
+};
 
 static Eigen::Vector3f reflect(const Eigen::Vector3f& vec, const Eigen::Vector3f& axis)
 {
@@ -86,330 +104,394 @@ static Eigen::Vector3f reflect(const Eigen::Vector3f& vec, const Eigen::Vector3f
     return (2 * costheta * axis - vec).normalized();
 }
 
-struct light
+// Blin-Phong Model: total color L = La + Ld + Ls summed over the lights, for every fragment of the batch.
+// kd, point (view space position) and normal are per fragment.
+static void blinn_phong(int count, const shader_uniforms& u, const float (&kd)[3][FRAGMENT_BATCH], const float (&point)[3][FRAGMENT_BATCH],
+                        const float (&normal)[3][FRAGMENT_BATCH], fragment_output& out)
 {
-    Eigen::Vector3f position;
-    Eigen::Vector3f intensity;
-};
+    // Ambient does not depend on the fragment
+    Eigen::Vector3f La = u.ka.cwiseProduct(u.amb_light_intensity);
 
-Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
-{
-    Eigen::Vector3f return_color = {0, 0, 0};
-    if (payload.texture)
+    for (int i = 0; i < count; ++i)
     {
-        // TODO: Get the texture value at the texture coordinates of the current fragment
-        return_color = payload.texture->getColorBilinear(payload.tex_coords[0], payload.tex_coords[1]);
-    }
-    Eigen::Vector3f texture_color;
-    texture_color << return_color.x(), return_color.y(), return_color.z();
-
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = texture_color / 255.f;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = texture_color;
-    Eigen::Vector3f point = payload.view_pos;
-    Eigen::Vector3f normal = payload.normal;
+        float px = point[0][i], py = point[1][i], pz = point[2][i];
+        float nx = normal[0][i], ny = normal[1][i], nz = normal[2][i];
 
-    Eigen::Vector3f result_color = {0, 0, 0};
+        // View direction is the same for every light
+        float vx = u.eye_pos.x() - px, vy = u.eye_pos.y() - py, vz = u.eye_pos.z() - pz;
+        float inv_v = 1.0f / std::sqrt(vx * vx + vy * vy + vz * vz);
+        vx *= inv_v; vy *= inv_v; vz *= inv_v;
 
-    for (auto& light : lights)
-    {
-        // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-         
-        // Ambient 
-        Eigen::Vector3f La = ka.cwiseProduct(amb_light_intensity);
+        float result[3] = {0, 0, 0};
+        for (int k = 0; k < u.num_lights; ++k)
+        {
+            const light& light = u.lights[k];
 
-        // Diffuse
-        Eigen::Vector3f v = (eye_pos - point).normalized();
-        Eigen::Vector3f l = (light.position - point).normalized();
-        float r_squared = (light.position - point).squaredNorm();
-        Eigen::Vector3f Ld = kd.cwiseProduct((light.intensity / r_squared)) * std::max(0.0f, normal.dot(l)); // Here, kd comes from texture_color / 255.0f
+            // Diffuse
+            float lx = light.position.x() - px, ly = light.position.y() - py, lz = light.position.z() - pz;
+            float r_squared = lx * lx + ly * ly + lz * lz;
+            float inv_l = 1.0f / std::sqrt(r_squared);
+            lx *= inv_l; ly *= inv_l; lz *= inv_l;
+            float diffuse = std::max(0.0f, nx * lx + ny * ly + nz * lz);
 
-        // Specular
-        Eigen::Vector3f h = (v + l).normalized();
-        Eigen::Vector3f Ls = ks.cwiseProduct((light.intensity / r_squared)) * std::pow(std::max(0.0f, normal.dot(h)), p); 
+            // Specular
+            float hx = vx + lx, hy = vy + ly, hz = vz + lz;
+            float inv_h = 1.0f / std::sqrt(hx * hx + hy * hy + hz * hz);
+            float specular = std::pow(std::max(0.0f, (nx * hx + ny * hy + nz * hz) * inv_h), u.p); // if n and h are close, bright light!
 
-        result_color += La + Ld + Ls;
+            for (int c = 0; c < 3; ++c)
+            {
+                float falloff = light.intensity[c] / r_squared;
+                result[c] += La[c] + kd[c][i] * falloff * diffuse + u.ks[c] * falloff * specular;
+            }
+        }
 
+        for (int c = 0; c < 3; ++c)
+            out.color[c][i] = result[c] * 255.f;
     }
-
-    return result_color * 255.f;
 }
 
-// Blin-Phong Model to compute total color L = La + Ld + Ls of type Eigen::Vector3f
-Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
+struct texture_shader
 {
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10}; // Intensity of light when no light source were present for computing ambient lightning
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
+    void shade(const fragment_batch& in, const shader_uniforms& u, fragment_output& out) const
+    {
+        // kd comes from the texture color / 255, filtered from the mip levels matching the pixel's footprint
+        float kd[3][FRAGMENT_BATCH];
+        for (int i = 0; i < in.count; ++i)
+        {
+            Eigen::Vector3f texture_color = {0, 0, 0};
+            if (in.texture)
+            {
+                float lod = in.texture->getLod({in.tex_dx[0][i], in.tex_dx[1][i]}, {in.tex_dy[0][i], in.tex_dy[1][i]});
+                texture_color = in.texture->getColorTrilinear(in.tex_coords[0][i], in.tex_coords[1][i], lod);
+            }
+            for (int c = 0; c < 3; ++c)
+                kd[c][i] = texture_color[c] / 255.f;
+        }
 
-    Eigen::Vector3f color = payload.color;
-    Eigen::Vector3f point = payload.view_pos; // position relative to camera(at origin) where camera is the center of the world
-    Eigen::Vector3f normal = payload.normal;
+        blinn_phong(in.count, u, kd, in.view_pos, in.normal, out);
+    }
+};
 
-    Eigen::Vector3f result_color = {0, 0, 0};
-    for (auto& light : lights)
+struct phong_shader
+{
+    void shade(const fragment_batch& in, const shader_uniforms& u, fragment_output& out) const
     {
-        // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-        
-        // Ambient 
-        Eigen::Vector3f La = ka.cwiseProduct(amb_light_intensity);
-
-        // Diffuse
-        Eigen::Vector3f v = (eye_pos - point).normalized();
-        Eigen::Vector3f l = (light.position - point).normalized();
-        float r_squared = (light.position - point).squaredNorm();
-        Eigen::Vector3f Ld = kd.cwiseProduct((light.intensity / r_squared)) * std::max(0.0f, normal.dot(l));
-
-        // Specular
-        Eigen::Vector3f h = (v + l).normalized();
-        Eigen::Vector3f Ls = ks.cwiseProduct((light.intensity / r_squared)) * std::pow(std::max(0.0f, normal.dot(h)), p); // if n and h are close, bright light!
-
-        result_color += La + Ld + Ls;
-        
+        blinn_phong(in.count, u, in.color, in.view_pos, in.normal, out);
     }
-    return result_color * 255.f;
-}
+};
 
-Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
+// Bump/displacement mapping: perturb the normal with the height map gradient in tangent space
+// Let n = normal = (x, y, z)
+// Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
+// Vector b = n cross product t
+// Matrix TBN = [t b n]
+// dU = kh * kn * (h(u+1/w,v)-h(u,v))
+// dV = kh * kn * (h(u,v+1/h)-h(u,v))
+// Vector ln = (-dU, -dV, 1)
+// Normal n = normalize(TBN * ln)
+// Displacement also moves the point: p = p + kn * n * h(u,v)
+static void perturb_normal(const fragment_batch& in, const shader_uniforms& uniforms, int i, Eigen::Vector3f& normal, float& height)
 {
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = payload.color; 
-    Eigen::Vector3f point = payload.view_pos;
-    Eigen::Vector3f normal = payload.normal;
-
-    float kh = 0.2, kn = 0.1;
-
-    // TODO: Implement displacement mapping here
-    // Let n = normal = (x, y, z)
-    // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
-    // Vector b = n cross product t
-    // Matrix TBN = [t b n]
-    // dU = kh * kn * (h(u+1/w,v)-h(u,v))
-    // dV = kh * kn * (h(u,v+1/h)-h(u,v))
-    // Vector ln = (-dU, -dV, 1)
-    // Position p = p + kn * n * h(u,v)
-    // Normal n = normalize(TBN * ln)
-    
-    // Virtually perturb view_pos and update the normal at that point using forward difference
     Eigen::Vector3f t(normal.x() * normal.y() / sqrt(normal.x() * normal.x() + normal.z() * normal.z()), sqrt(normal.x() * normal.x() + normal.z() * normal.z()),
         sqrt(normal.x() * normal.x() + normal.z() * normal.z()));
     Eigen::Vector3f b = normal.cross(t);
 
-    Eigen::Matrix3f TBN; 
+    Eigen::Matrix3f TBN;
     TBN.col(0) = t;
     TBN.col(1) = b;
     TBN.col(2) = normal;
 
-    float u = payload.tex_coords.x();
-    float v = payload.tex_coords.y();
+    float u = in.tex_coords[0][i];
+    float v = in.tex_coords[1][i];
 
-    int w = payload.texture->width;
-    int h = payload.texture->height;
+    int w = in.texture->width;
+    int h = in.texture->height;
 
-   float dU = kh * kn * (payload.texture->getColor(u + 1.0f / w, v).norm() - payload.texture->getColor(u, v).norm());
-   float dV = kh * kn * (payload.texture->getColor(u, v + 1.0f / h).norm() - payload.texture->getColor(u, v).norm());
+    height = in.texture->getColor(u, v).norm();
+    float dU = uniforms.kh * uniforms.kn * (in.texture->getColor(u + 1.0f / w, v).norm() - height);
+    float dV = uniforms.kh * uniforms.kn * (in.texture->getColor(u, v + 1.0f / h).norm() - height);
 
     Eigen::Vector3f ln(-dU, -dV, 1.0);
-    point = point + kn * normal * payload.texture->getColor(u, v).norm();
     normal = (TBN * ln).normalized();
+}
 
-    Eigen::Vector3f result_color = {0, 0, 0};
+struct displacement_shader
+{
+    void shade(const fragment_batch& in, const shader_uniforms& u, fragment_output& out) const
+    {
+        // Virtually perturb view_pos and update the normal at that point using forward difference
+        float point[3][FRAGMENT_BATCH], normal[3][FRAGMENT_BATCH];
+        for (int i = 0; i < in.count; ++i)
+        {
+            Eigen::Vector3f n(in.normal[0][i], in.normal[1][i], in.normal[2][i]);
+            Eigen::Vector3f displaced = n;
+            float height;
+            perturb_normal(in, u, i, displaced, height);
 
-    for (auto& light : lights)
+            for (int c = 0; c < 3; ++c)
+            {
+                point[c][i] = in.view_pos[c][i] + u.kn * n[c] * height;
+                normal[c][i] = displaced[c];
+            }
+        }
+
+        blinn_phong(in.count, u, in.color, point, normal, out);
+    }
+};
+
+struct bump_shader
+{
+    void shade(const fragment_batch& in, const shader_uniforms& u, fragment_output& out) const
     {
-        // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-        
-        // Ambient 
-        Eigen::Vector3f La = ka.cwiseProduct(amb_light_intensity);
-
-        // Diffuse
-        Eigen::Vector3f v = (eye_pos - point).normalized();
-        Eigen::Vector3f l = (light.position - point).normalized();
-        float r_squared = (light.position - point).squaredNorm();
-        Eigen::Vector3f Ld = kd.cwiseProduct((light.intensity / r_squared)) * std::max(0.0f, normal.dot(l));
-
-        // Specular
-        Eigen::Vector3f h = (v + l).normalized();
-        Eigen::Vector3f Ls = ks.cwiseProduct((light.intensity / r_squared)) * std::pow(std::max(0.0f, normal.dot(h)), p); // if n and h are close, bright light!
-
-        result_color += La + Ld + Ls;
+        for (int i = 0; i < in.count; ++i)
+        {
+            Eigen::Vector3f normal(in.normal[0][i], in.normal[1][i], in.normal[2][i]);
+            float height;
+            perturb_normal(in, u, i, normal, height);
+
+            for (int c = 0; c < 3; ++c)
+                out.color[c][i] = normal[c] * 255.f;
+        }
     }
+};
 
-    return result_color * 255.f;
-}
+// Buffers of an indexed mesh loaded into the rasterizer
+struct mesh_buffers
+{
+    rst::pos_buf_id positions;
+    rst::col_buf_id normals;
+    rst::tex_buf_id tex_coords;
+    rst::ind_buf_id indices;
+};
 
+// Names what load_mesh builds from the obj in the cache; change it with the welding or the triangle order
+static const uint32_t MESH_CACHE_KEY = 3;
 
-Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
+// Face corners with the same attributes share one vertex, so the rasterizer transforms it only once. Triangles
+// are ordered so neighbours follow each other and vertices are numbered in that order, so triangle setup reads
+// the transformed vertices nearly front to back.
+// Parsing and optimizing happen on the first run only, later runs map the optimized mesh from the cache file.
+static mesh_buffers load_mesh(rst::rasterizer& r, const std::string& path)
 {
-    
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = payload.color; 
-    Eigen::Vector3f point = payload.view_pos;
-    Eigen::Vector3f normal = payload.normal;
-
-    float kh = 0.2, kn = 0.1;
-    // TODO: Implement bump mapping here
-    // Let n = normal = (x, y, z)
-    // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
-    // Vector b = n cross product t
-    // Matrix TBN = [t b n]
-    // dU = kh * kn * (h(u+1/w,v)-h(u,v))
-    // dV = kh * kn * (h(u,v+1/h)-h(u,v))
-    // Vector ln = (-dU, -dV, 1)
-    // Normal n = normalize(TBN * ln)
-
-    // Virtually perturb view_pos and update the normal at that point using Forward Difference
-    Eigen::Vector3f t(normal.x() * normal.y() / sqrt(normal.x() * normal.x() + normal.z() * normal.z()), sqrt(normal.x() * normal.x() + normal.z() * normal.z()),
-        sqrt(normal.x() * normal.x() + normal.z() * normal.z()));
-    Eigen::Vector3f b = normal.cross(t);
+    rst::mesh_cache cache;
+    rst::obj_mesh obj;
+    rst::mesh_arrays arrays;
+    if (cache.open(path, MESH_CACHE_KEY))
+        arrays = cache.arrays();
+    else
+    {
+        if (!rst::load_obj(path, obj))
+            std::cout << "Could not load " << path << "\n";
+        rst::weld_vertices(obj);
+        rst::optimize_vertex_cache(obj);
+
+        arrays.positions = obj.positions.data();
+        arrays.normals = obj.normals.data();
+        arrays.tex_coords = obj.tex_coords.data();
+        arrays.vertex_count = obj.vertex_count();
+        arrays.indices = obj.indices.data();
+        arrays.triangle_count = obj.triangle_count();
+        if (arrays.triangle_count > 0 && !rst::mesh_cache::write(path, MESH_CACHE_KEY, arrays))
+            std::cout << "Could not write the mesh cache of " << path << "\n";
+    }
 
-    Eigen::Matrix3f TBN;
-    TBN.col(0) = t;
-    TBN.col(1) = b;
-    TBN.col(2) = normal;
+    auto positions = (const Eigen::Vector3f*)arrays.positions;
+    auto normals = (const Eigen::Vector3f*)arrays.normals;
+    auto tex_coords = (const Eigen::Vector2f*)arrays.tex_coords;
+    auto indices = (const Eigen::Vector3i*)arrays.indices;
+    return { r.load_positions(std::vector<Eigen::Vector3f>(positions, positions + arrays.vertex_count)),
+             r.load_normals(std::vector<Eigen::Vector3f>(normals, normals + arrays.vertex_count)),
+             r.load_tex_coords(std::vector<Eigen::Vector2f>(tex_coords, tex_coords + arrays.vertex_count)),
+             r.load_indices(std::vector<Eigen::Vector3i>(indices, indices + arrays.triangle_count)) };
+}
 
-    float u = payload.tex_coords.x();
-    float v = payload.tex_coords.y();
+// Shaders selectable from the command line. Each entry draws with its own instantiation of rasterizer::draw.
+template <typename Shader>
+void draw_with(rst::rasterizer& r, const mesh_buffers& mesh, const shader_uniforms& uniforms)
+{
+    r.draw(mesh.positions, mesh.normals, mesh.tex_coords, mesh.indices, Shader{}, uniforms);
+}
 
-    int w = payload.texture->width;
-    int h = payload.texture->height;
+struct shader_entry
+{
+    const char* name;
+    const char* texture;    // file in the model folder bound while drawing
+    void (*draw)(rst::rasterizer&, const mesh_buffers&, const shader_uniforms&);
+};
 
-    float dU = kh * kn * (payload.texture->getColor(u + 1.0f / w, v).norm() - payload.texture->getColor(u, v).norm());
-    float dV = kh * kn * (payload.texture->getColor(u, v + 1.0f / h).norm() - payload.texture->getColor(u, v).norm());
+static const shader_entry shader_registry[] = {
+    { "texture",      "spot_texture.png", draw_with<texture_shader> },
+    { "normal",       "hmap.jpg",         draw_with<normal_shader> },
+    { "phong",        "hmap.jpg",         draw_with<phong_shader> },
+    { "bump",         "hmap.jpg",         draw_with<bump_shader> },
+    { "displacement", "hmap.jpg",         draw_with<displacement_shader> },
+};
 
-    Eigen::Vector3f ln(-dU, -dV, 1.0);
-    normal = (TBN * ln).normalized();
+static const shader_entry* find_shader(const std::string& name)
+{
+    for (const auto& entry : shader_registry)
+    {
+        if (name == entry.name)
+            return &entry;
+    }
+    return nullptr;
+}
 
-    Eigen::Vector3f result_color = {0, 0, 0};
-    result_color = normal;
+// One frame of a batch: the model's rotation and the camera position
+struct batch_pose
+{
+    float angle;
+    Eigen::Vector3f eye_pos;
+};
 
-    return result_color * 255.f;
+// Reads one pose per line, "angle" or "angle eye_x eye_y eye_z" with the eye at (0, 0, 10) by default. Empty lines
+// and lines starting with # are skipped.
+static bool load_poses(const std::string& path, std::vector<batch_pose>& poses)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        batch_pose pose{ 0, { 0, 0, 10 } };
+        if (!(fields >> pose.angle))
+            continue;
+        fields >> pose.eye_pos.x() >> pose.eye_pos.y() >> pose.eye_pos.z();
+        poses.push_back(pose);
+    }
+    return true;
 }
 
 int main(int argc, const char** argv)
 {
-    std::vector<Triangle*> TriangleList;
-
     float angle = 140.0;
     bool command_line = false;
 
-    std::string filename = "output.png";
-    objl::Loader Loader;
-    std::string obj_path = "C:/Users/Xiang Gao/Desktop/GAMES101/GAMES101_Homework_S2021/GAMES101_Homework3_S2021/Homework3/Assignment3/models/spot/";
-
-    // Load .obj File
-    bool loadout = Loader.LoadFile("C:/Users/Xiang Gao/Desktop/GAMES101/GAMES101_Homework_S2021/GAMES101_Homework3_S2021/Homework3/Assignment3/models/spot/spot_triangulated_good.obj");
-    for (auto mesh : Loader.LoadedMeshes)
+    // "batch <poses> <prefix> ..." renders every pose of the file to <prefix>0000.png, <prefix>0001.png, ... without
+    // opening a window. The arguments after the prefix are those of a single image.
+    bool batch = argc >= 2 && std::string(argv[1]) == "batch";
+    std::string poses_path;
+    int first_arg = 1;
+    if (batch)
     {
-        for (int i = 0; i < mesh.Vertices.size(); i += 3)
+        if (argc < 4)
         {
-            Triangle* t = new Triangle();
-            for (int j = 0; j < 3; j++)
-            {
-                t->setVertex(j, Vector4f(mesh.Vertices[i + j].Position.X, mesh.Vertices[i + j].Position.Y, mesh.Vertices[i + j].Position.Z, 1.0));
-                t->setNormal(j, Vector3f(mesh.Vertices[i + j].Normal.X, mesh.Vertices[i + j].Normal.Y, mesh.Vertices[i + j].Normal.Z));
-                t->setTexCoord(j, Vector2f(mesh.Vertices[i + j].TextureCoordinate.X, mesh.Vertices[i + j].TextureCoordinate.Y));
-            }
-            TriangleList.push_back(t);
+            std::cout << "Usage: " << argv[0] << " batch <poses file> <output prefix> [shader] [options]\n";
+            return 1;
         }
+        poses_path = argv[2];
+        first_arg = 3;
     }
 
+    std::string filename = "output.png";
+    std::string obj_path = "C:/Users/Xiang Gao/Desktop/GAMES101/GAMES101_Homework_S2021/GAMES101_Homework3_S2021/Homework3/Assignment3/models/spot/";
+
     rst::rasterizer r(700, 700);
 
-    auto texture_path = "hmap.jpg";
-    r.set_texture(Texture(obj_path + texture_path));
+    // Load .obj File
+    mesh_buffers mesh = load_mesh(r, obj_path + "spot_triangulated_good.obj");
 
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    const shader_entry* active_shader = find_shader("phong");
 
-    if (argc >= 2)
+    if (argc > first_arg)
     {
         command_line = true;
-        filename = std::string(argv[1]);
+        filename = std::string(argv[first_arg]);
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
-        {
-            std::cout << "Rasterizing using the texture shader\n"; 
-            active_shader = texture_fragment_shader;
-            texture_path = "spot_texture.png";
-            r.set_texture(Texture(obj_path + texture_path));
-        }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        if (argc > first_arg + 1)
         {
-            std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            if (const shader_entry* entry = find_shader(argv[first_arg + 1]))
+                active_shader = entry;
+            else
+                std::cout << "Unknown shader " << argv[first_arg + 1] << ", using phong\n";
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
-        {
-            std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
-        }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
-        {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
-        }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        std::cout << "Rasterizing using the " << active_shader->name << " shader\n";
+
+        // Options after the shader name: deferred, depth16, depth24
+        for (int i = first_arg + 2; i < argc; ++i)
         {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            std::string option = argv[i];
+            if (option == "deferred")
+            {
+                std::cout << "Shading visible pixels only (deferred)\n";
+                r.set_shading(rst::Shading::Deferred);
+            }
+            else if (option == "depth16" || option == "depth24")
+            {
+                std::cout << "Storing depth in " << option.substr(5) << " bits\n";
+                r.set_depth_format(option == "depth16" ? rst::DepthFormat::Unorm16 : rst::DepthFormat::Unorm24);
+            }
+            else
+                std::cout << "Unknown option " << option << "\n";
         }
     }
 
+    // Spot is closed, its back faces are always hidden behind front faces
+    r.set_culling(rst::Culling::Back);
+
+    // Pixels are flushed as 8-bit bgr, which OpenCV shows and saves as is
+    r.set_color_format(rst::ColorFormat::BGR8);
+    r.set_texture(Texture(obj_path + active_shader->texture));
+
     Eigen::Vector3f eye_pos = { 0,0,10 };
 
+    shader_uniforms uniforms;
+    uniforms.add_light({{20, 20, 20}, {500, 500, 500}});
+    uniforms.add_light({{-20, 20, 0}, {500, 500, 500}});
+    uniforms.eye_pos = eye_pos;
+
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
 
     int key = 0;
     int frame_count = 0;
 
+    if (batch)
+    {
+        std::vector<batch_pose> poses;
+        if (!load_poses(poses_path, poses))
+        {
+            std::cout << "Could not read poses from " << poses_path << "\n";
+            return 1;
+        }
+
+        // Encoding a png takes several times longer than rendering the frame: a quarter of the cores encode
+        // while the rasterizer's pool renders the next frames
+        rst::image_writer writer(std::max(1, (int)std::thread::hardware_concurrency() / 4));
+
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        double render_ms = 0;
+        for (size_t i = 0; i < poses.size(); ++i)
+        {
+            auto frame_start = clock::now();
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            r.set_model(get_model_matrix(poses[i].angle));
+            r.set_view(get_view_matrix(poses[i].eye_pos));
+            r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+            uniforms.eye_pos = poses[i].eye_pos;
+
+            active_shader->draw(r, mesh, uniforms);
+            cv::Mat image = r.color_image();
+            render_ms += std::chrono::duration<double, std::milli>(clock::now() - frame_start).count();
+
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04zu.png", i);
+            writer.write(filename + number, image);
+        }
+        int failures = writer.finish();
+
+        double total_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        std::cout << poses.size() << " frames in " << total_ms << " ms, " << poses.size() * 1000.0 / total_ms
+                  << " frames/s; " << render_ms / std::max<size_t>(poses.size(), 1) << " ms rendering per frame\n";
+        if (failures)
+            std::cout << failures << " images could not be written\n";
+        return failures ? 1 : 0;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -417,13 +499,20 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        active_shader->draw(r, mesh, uniforms);
+        cv::Mat image = r.color_image();
 
         cv::imwrite(filename, image);
 
+        rst::frame_stats stats = r.stats();
+        std::cout << "Hi-Z culled " << stats.hiz_triangles_culled << " of " << stats.hiz_triangle_tests << " triangle/tile pairs, "
+                  << stats.hiz_blocks_culled << " of " << stats.hiz_block_tests << " blocks; "
+                  << stats.fragments_shaded << " fragments shaded\n";
+        std::cout << stats.triangles_in << " triangles in: " << stats.frustum_culled << " outside the view volume, "
+                  << stats.backface_culled << " back facing, " << stats.degenerate_culled << " degenerate, "
+                  << stats.small_culled << " between pixel centers culled; " << stats.triangles_clipped << " clipped\n";
+        std::cout << stats.depth_passes << " of " << stats.depth_tests << " depth tests passed\n";
+
         return 0;
     }
 
@@ -436,10 +525,8 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
         //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        active_shader->draw(r, mesh, uniforms);
+        cv::Mat image = r.color_image();
 
         cv::imshow("image", image);
         cv::imwrite(filename, image);
@@ -3,7 +3,11 @@
 //
 
 #include <algorithm>
+#include <bitset>
+#include <limits>
 #include "rasterizer.hpp"
+#include "EdgeFunction.hpp"
+#include "Simd.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
 
@@ -42,6 +46,20 @@ rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>
     return {id};
 }
 
+rst::tex_buf_id rst::rasterizer::load_tex_coords(const std::vector<Eigen::Vector2f>& tex_coords)
+{
+    auto id = get_next_id();
+    tex_buf.emplace(id, tex_coords);
+
+    return {id};
+}
+
+void rst::vertex_cache::resize(size_t count)
+{
+    for (auto* component : { &x, &y, &z, &w, &view_x, &view_y, &view_z, &normal_x, &normal_y, &normal_z })
+        component->resize(count);
+}
+
 
 // Bresenham's line drawing algorithm
 void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
@@ -149,95 +167,312 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(float x, float y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
-}
+// Vertex stage work is handed out in chunks of this many vertices or triangles
+static const int vertex_chunk = 1024;
+
+// The depth range the viewport transformation maps to, also the distances of the near and far clipping planes
+static const double z_near = 0.1, z_far = 50;
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+void rst::rasterizer::draw_triangles(std::vector<Triangle *> &TriangleList) {
+
+    // Vertex stage: every chunk of triangles is transformed and clipped independently
+    update_transforms();
+    int num_triangles = (int)TriangleList.size();
+    int chunks = (num_triangles + vertex_chunk - 1) / vertex_chunk;
+    chunk_tris.resize(chunks);
+    pool->parallel_for(chunks, [&](int task, int worker) {
+        transform_triangles(TriangleList, task * vertex_chunk, std::min(num_triangles, (task + 1) * vertex_chunk),
+                            chunk_tris[task], local_tiles[worker].stats);
+    });
+    gather_triangles(chunks);
+
+    draw_screen_triangles();
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+void rst::rasterizer::draw_indexed(pos_buf_id pos_buffer, col_buf_id nor_buffer, tex_buf_id tex_buffer, ind_buf_id ind_buffer)
+{
+    const auto& positions = pos_buf[pos_buffer.pos_id];
+    const auto& normals = nor_buf[nor_buffer.col_id];
+    const auto& tex_coords = tex_buf[tex_buffer.tex_id];
+    const auto& indices = ind_buf[ind_buffer.ind_id];
+
+    // Vertex stage: every unique vertex is transformed once, then triangles are put together from the results
+    update_transforms();
+    int num_vertices = (int)positions.size();
+    vertices.resize(num_vertices);
+    pool->parallel_for((num_vertices + vertex_chunk - 1) / vertex_chunk, [&](int task, int) {
+        transform_vertices(positions, normals, task * vertex_chunk, std::min(num_vertices, (task + 1) * vertex_chunk));
+    });
+
+    int num_triangles = (int)indices.size();
+    int chunks = (num_triangles + vertex_chunk - 1) / vertex_chunk;
+    chunk_tris.resize(chunks);
+    pool->parallel_for(chunks, [&](int task, int worker) {
+        assemble_triangles(indices, tex_coords, task * vertex_chunk, std::min(num_triangles, (task + 1) * vertex_chunk),
+                           chunk_tris[task], local_tiles[worker].stats);
+    });
+    gather_triangles(chunks);
+
+    draw_screen_triangles();
+}
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+// Concatenates the triangles of the vertex stage chunks in order, so screen_tris keeps the submission order
+void rst::rasterizer::gather_triangles(int chunks)
+{
+    screen_tris.clear();
+    for (int chunk = 0; chunk < chunks; ++chunk)
+        screen_tris.insert(screen_tris.end(), chunk_tris[chunk].begin(), chunk_tris[chunk].end());
+}
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
-    {
-        Triangle newtri = *t;
+void rst::rasterizer::draw_screen_triangles()
+{
+    int num_triangles = (int)screen_tris.size();
+    if (!depth_range_set)
+        update_depth_range();
 
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
+    // Front-end: sort triangles into the tiles they overlap
+    bin_triangles();
 
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
+    // Back-end: every tile with work is rasterized into its worker's local buffer, then flushed
+    pool->parallel_for((int)active_tiles.size(), [&](int task, int worker) {
+        rasterize_tile(active_tiles[task], local_tiles[worker]);
+    });
 
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
+    // Deferred: visibility is final, shade the pixels this draw call ended up owning
+    if (shading == Shading::Deferred)
+    {
+        int first_id = frame_triangles;
+        pool->parallel_for(height, [&](int y, int worker) {
+            shade_row(y, first_id, local_tiles[worker]);
         });
+    }
+    frame_triangles += num_triangles;
+}
+
+void rst::rasterizer::shade_row(int y, int first_id, tile_buffer& scratch)
+{
+    for (int tile_x = 0; tile_x < width; tile_x += TILE_SIZE)
+    {
+        if (tile_cleared[y / TILE_SIZE * tiles_x + tile_x / TILE_SIZE] & TILE_DEPTH_CLEARED)
+            continue; // nothing drawn to this tile since the last depth clear
+
+        int index = get_index(tile_x, y);
+        for (int x = tile_x; x < std::min(tile_x + TILE_SIZE, width); ++x, ++index)
+        {
+            if (gbuf.triangle_id[index] < first_id)
+                continue; // empty, or drawn by an earlier draw call and shaded then
 
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
+            scratch.batch_pixel[scratch.batch.count] = index;
+            scratch.batch.push(gbuf.view_pos[index], gbuf.normal[index], gbuf.color[index], gbuf.tex_coords[index], gbuf.tex_dx[index], gbuf.tex_dy[index]);
+            if (scratch.batch.full())
+                shade_batch(scratch, nullptr);
         }
+    }
+    shade_batch(scratch, nullptr);
+}
+
+// Runs the fragment shader on the pending batch and scatters the colors to target[batch_pixel[i]], a tile's colors,
+// or to the frame's color buffer if target is null. Fragments are written in the order they were queued, so a
+// pixel covered twice in one batch keeps the later color.
+void rst::rasterizer::shade_batch(tile_buffer& scratch, Eigen::Vector3f* target)
+{
+    fragment_batch& batch = scratch.batch;
+    if (batch.count == 0)
+        return;
+
+    batch.texture = texture ? &*texture : nullptr;
+    shade_fn(shader_state, batch, uniforms, scratch.shaded);
+
+    for (int i = 0; i < batch.count; ++i)
+    {
+        Eigen::Vector3f color(scratch.shaded.color[0][i], scratch.shaded.color[1][i], scratch.shaded.color[2][i]);
+        if (target)
+            target[scratch.batch_pixel[i]] = color;
+        else
+            color_buf.store(scratch.batch_pixel[i], 1, &color);
+    }
+    scratch.stats.fragments_shaded += batch.count;
+    batch.count = 0;
+}
+
+void rst::rasterizer::update_transforms()
+{
+    model_view = view * model;
+    mvp = projection * view * model;
+    normal_matrix = model_view.inverse().transpose();
+}
+
+// Perspective division and viewport transformation of a clip space position
+Eigen::Vector4f rst::rasterizer::to_screen(const Eigen::Vector4f& clip) const
+{
+    float f1 = (z_far - z_near) / 2.0;
+    float f2 = (z_far + z_near) / 2.0;
+
+    Eigen::Vector4f vert(clip.x() / clip.w(), clip.y() / clip.w(), clip.z() / clip.w(), clip.w());
+    vert.x() = 0.5*width*(vert.x()+1.0);
+    vert.y() = 0.5*height*(vert.y()+1.0);
+    vert.z() = vert.z() * f1 + f2;
+    return vert;
+}
+
+enum class cull_result
+{
+    Keep,
+    Degenerate,
+    Backface,
+    Small
+};
+
+// Why a screen space triangle is dropped before rasterization, if it is
+static cull_result cull_reason(const Eigen::Vector4f* v, rst::Culling culling)
+{
+    float area2 = rst::signed_area2(v);
+    if (area2 == 0 || !std::isfinite(area2))
+        return cull_result::Degenerate;
+    if ((culling == rst::Culling::Back && area2 < 0) || (culling == rst::Culling::Front && area2 > 0))
+        return cull_result::Backface;
+    if (rst::misses_samples(v))
+        return cull_result::Small;
+    return cull_result::Keep;
+}
+
+// Drops the triangle if it is outside the view volume, clips it if it crosses the near or far plane or the
+// guard band, and appends what is left of it to out
+void rst::rasterizer::clip_triangle(const clip_vertex* triangle, std::vector<screen_triangle>& out, frame_stats& stats) const
+{
+    clip_volume volume{ (float)z_near, (float)z_far };
+    int codes[3];
+    for (int j = 0; j < 3; ++j)
+        codes[j] = volume.outcode(triangle[j].position);
+
+    if (codes[0] & codes[1] & codes[2])
+    {
+        ++stats.frustum_culled; // all three vertices outside the same plane
+        return;
+    }
+
+    int crossed = (codes[0] | codes[1] | codes[2]) & CLIP_PLANE_MASK;
+    if (!crossed)
+    {
+        emit_triangle(triangle[0], triangle[1], triangle[2], out, stats);
+        return;
+    }
+
+    // The clipped polygon is convex, fan it out from its first vertex
+    ++stats.triangles_clipped;
+    clip_vertex polygon[MAX_CLIP_VERTICES];
+    int count = volume.clip_triangle(triangle, crossed, polygon);
+    for (int k = 1; k + 1 < count; ++k)
+        emit_triangle(polygon[0], polygon[k], polygon[k + 1], out, stats);
+}
+
+// Divides by w and maps to the screen, keeping the view space positions for shading. Triangles that can not
+// cover a pixel, or face the culled side, are dropped here.
+void rst::rasterizer::emit_triangle(const clip_vertex& a, const clip_vertex& b, const clip_vertex& c, std::vector<screen_triangle>& out, frame_stats& stats) const
+{
+    const clip_vertex* corners[] = { &a, &b, &c };
+    Eigen::Vector4f v[3];
+    for (int j = 0; j < 3; ++j)
+        v[j] = to_screen(corners[j]->position);
+
+    switch (cull_reason(v, culling))
+    {
+        case cull_result::Degenerate: ++stats.degenerate_culled; return;
+        case cull_result::Backface:   ++stats.backface_culled; return;
+        case cull_result::Small:      ++stats.small_culled; return;
+        default: break;
+    }
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+    Triangle newtri;
+    std::array<Eigen::Vector3f, 3> viewspace_pos;
+    for (int j = 0; j < 3; ++j)
+    {
+        newtri.setVertex(j, v[j]);
+        newtri.setNormal(j, corners[j]->normal);
+        newtri.setTexCoord(j, corners[j]->tex_coords);
+        viewspace_pos[j] = corners[j]->view_pos;
+    }
 
-        //Viewport transformation
-        for (auto & vert : v)
+    newtri.setColor(0, 148,121.0,92.0);
+    newtri.setColor(1, 148,121.0,92.0);
+    newtri.setColor(2, 148,121.0,92.0);
+
+    // Texture coordinate derivatives from the barycentric gradients of the screen space triangle
+    Eigen::Vector2f tex_dx = Eigen::Vector2f::Zero(), tex_dy = Eigen::Vector2f::Zero();
+    triangle_setup setup;
+    if (setup.init(newtri.v))
+    {
+        for (int j = 0; j < 3; ++j)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            tex_dx += setup.A[j] * newtri.tex_coords[j];
+            tex_dy += setup.B[j] * newtri.tex_coords[j];
         }
+    }
 
-        for (int i = 0; i < 3; ++i)
+    out.push_back({newtri, viewspace_pos, tex_dx, tex_dy});
+}
+
+void rst::rasterizer::transform_triangles(std::vector<Triangle *> &TriangleList, int begin, int end, std::vector<screen_triangle>& out, frame_stats& stats)
+{
+    out.clear();
+    stats.triangles_in += end - begin;
+    for (int i = begin; i < end; ++i)
+    {
+        const auto& t = TriangleList[i];
+
+        clip_vertex triangle[3];
+        for (int j = 0; j < 3; ++j)
         {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            triangle[j].position = mvp * t->v[j];
+            triangle[j].view_pos = (model_view * t->v[j]).head<3>();
+            triangle[j].normal = (normal_matrix * to_vec4(t->normal[j], 0.0f)).head<3>();
+            triangle[j].tex_coords = t->tex_coords[j];
         }
 
-        for (int i = 0; i < 3; ++i)
-        {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+        clip_triangle(triangle, out, stats);
+    }
+}
 
-        }
+void rst::rasterizer::transform_vertices(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3f>& normals, int begin, int end)
+{
+    for (int i = begin; i < end; ++i)
+    {
+        Eigen::Vector4f p = to_vec4(positions[i]);
+        Eigen::Vector4f clip = mvp * p;
+        Eigen::Vector4f view_pos = model_view * p;
+        Eigen::Vector4f n = normal_matrix * to_vec4(normals[i], 0.0f);
+
+        vertices.x[i] = clip.x();
+        vertices.y[i] = clip.y();
+        vertices.z[i] = clip.z();
+        vertices.w[i] = clip.w();
+        vertices.view_x[i] = view_pos.x();
+        vertices.view_y[i] = view_pos.y();
+        vertices.view_z[i] = view_pos.z();
+        vertices.normal_x[i] = n.x();
+        vertices.normal_y[i] = n.y();
+        vertices.normal_z[i] = n.z();
+    }
+}
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+void rst::rasterizer::assemble_triangles(const std::vector<Eigen::Vector3i>& indices, const std::vector<Eigen::Vector2f>& tex_coords, int begin, int end,
+                                         std::vector<screen_triangle>& out, frame_stats& stats)
+{
+    out.clear();
+    stats.triangles_in += end - begin;
+    for (int i = begin; i < end; ++i)
+    {
+        clip_vertex triangle[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            int k = indices[i][j];
+            triangle[j].position = { vertices.x[k], vertices.y[k], vertices.z[k], vertices.w[k] };
+            triangle[j].view_pos = { vertices.view_x[k], vertices.view_y[k], vertices.view_z[k] };
+            triangle[j].normal = { vertices.normal_x[k], vertices.normal_y[k], vertices.normal_z[k] };
+            triangle[j].tex_coords = tex_coords[k];
+        }
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+        clip_triangle(triangle, out, stats);
     }
 }
 
@@ -257,30 +492,219 @@ static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const E
     return Eigen::Vector2f(u, v);
 }
 
-//Screen space rasterization: All input arguments must be under screen coordinate!
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) // view_pos: 3 view vectors
+// Attributes of the fragment of st with barycentric weights (alpha, beta, gamma)
+static fragment_shader_payload interpolate_fragment(const rst::screen_triangle& st, float alpha, float beta, float gamma, Texture* texture)
 {
-    // TODO: From your HW3, get the triangle rasterization code.
-    // TODO: Inside your rasterization loop:
-    //    * v[i].w() is the vertex view space depth value z.
-    //    * Z is interpolated view space depth for the current pixel
-    //    * zp is depth between zNear and zFar, used for z-buffer
+    const Triangle& t = st.tri;
+
+    Eigen::Vector3f interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1.0);
+    Eigen::Vector3f interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1.0);
+    Eigen::Vector2f interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1.0);
+    Eigen::Vector3f interpolated_shadingcoords = interpolate(alpha, beta, gamma, st.view_pos[0], st.view_pos[1], st.view_pos[2], 1.0);
+
+    fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture);
+    payload.view_pos = interpolated_shadingcoords;
+    return payload;
+}
+
+// Lower bound of the depth of every fragment of t: the perspective correct depth is a convex combination
+// of the vertex depths. The margin keeps the bound conservative against rounding in the interpolation.
+static float nearest_depth(const Triangle& t)
+{
+    float z = std::min({ t.v[0].z(), t.v[1].z(), t.v[2].z() });
+    return z - 1e-5f * std::abs(z);
+}
 
-    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    // zp *= Z;
+void rst::rasterizer::bin_triangles()
+{
+    for (auto& bin : tile_bins)
+        bin.clear();
 
-    // TODO: Interpolate the attributes:
-    // auto interpolated_color
-    // auto interpolated_normal
-    // auto interpolated_texcoords
-    // auto interpolated_shadingcoords
+    for (int i = 0; i < (int)screen_tris.size(); ++i)
+    {
+        const auto& v = screen_tris[i].tri.v;
+
+        float xmin = std::min({ v[0].x(), v[1].x(), v[2].x() });
+        float xmax = std::max({ v[0].x(), v[1].x(), v[2].x() });
+        float ymin = std::min({ v[0].y(), v[1].y(), v[2].y() });
+        float ymax = std::max({ v[0].y(), v[1].y(), v[2].y() });
+
+        // Pixels touched by the bounding box, clamped to the screen
+        int x0 = std::max(0, (int)std::floor(xmin));
+        int x1 = std::min(width - 1, (int)std::ceil(xmax));
+        int y0 = std::max(0, (int)std::floor(ymin));
+        int y1 = std::min(height - 1, (int)std::ceil(ymax));
+        if (x0 > x1 || y0 > y1)
+            continue; // completely off screen
+
+        // Tiles already filled by earlier draw calls with geometry in front of the whole triangle are skipped
+        float z_near = nearest_depth(screen_tris[i].tri);
+
+        for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ++ty)
+            for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; ++tx)
+            {
+                int tile_index = ty * tiles_x + tx;
+                ++bin_stats.hiz_triangle_tests;
+                if (z_near >= hiz_tile[tile_index])
+                {
+                    ++bin_stats.hiz_triangles_culled;
+                    continue;
+                }
+                tile_bins[tile_index].push_back(i);
+            }
+    }
 
-    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-    // Use: payload.view_pos = interpolated_shadingcoords;
-    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-    // Use: auto pixel_color = fragment_shader(payload);
+    active_tiles.clear();
+    for (int tile_index = 0; tile_index < tiles_x * tiles_y; ++tile_index)
+    {
+        if (!tile_bins[tile_index].empty())
+            active_tiles.push_back(tile_index);
+    }
+}
 
+void rst::rasterizer::rasterize_tile(int tile_index, tile_buffer& tile)
+{
+    int tile_x = (tile_index % tiles_x) * TILE_SIZE;
+    int tile_y = (tile_index / tiles_x) * TILE_SIZE;
+    int w = std::min(TILE_SIZE, width - tile_x);
+    int h = std::min(TILE_SIZE, height - tile_y);
+
+    // Load the tile so that several draw calls per frame still depth test against each other, or start from
+    // the clear values if it was cleared since it was last drawn to.
+    // Deferred shading leaves colors to the shading pass and only tracks visible triangles here.
+    bool deferred = shading == Shading::Deferred;
+    bool color_cleared = tile_cleared[tile_index] & TILE_COLOR_CLEARED;
+    bool depth_cleared = tile_cleared[tile_index] & TILE_DEPTH_CLEARED;
+    if (deferred && color_cleared)
+        clear_tile_color(tile_index); // the shading pass writes visible pixels only
+    if (depth_cleared)
+        clear_tile_triangle_ids(tile_index);
+    tile_cleared[tile_index] = 0;
+
+    for (int y = 0; y < h; ++y)
+    {
+        int index = get_index(tile_x, tile_y + y);
+        if (!deferred && color_cleared)
+            std::fill_n(&tile.color[y * TILE_SIZE], w, Eigen::Vector3f{0, 0, 0});
+        else if (!deferred)
+            color_buf.load(index, w, &tile.color[y * TILE_SIZE]);
+        if (depth_cleared)
+            std::fill_n(&tile.depth[y * TILE_SIZE], w, std::numeric_limits<float>::infinity());
+        else
+            depth_buf.load(index, w, &tile.depth[y * TILE_SIZE]);
+    }
+    if (deferred)
+        tile.triangle.fill(-1);
+    for (int by = 0; by < TILE_BLOCKS; ++by)
+    {
+        int index = (tile_y / BLOCK + by) * blocks_x + tile_x / BLOCK;
+        std::copy_n(&hiz_block[index], TILE_BLOCKS, &tile.block_max[by * TILE_BLOCKS]);
+    }
+
+    float tile_max = hiz_tile[tile_index];
+    for (int i : tile_bins[tile_index])
+    {
+        // Triangles entirely behind everything drawn so far in the tile are dropped before setup
+        ++tile.stats.hiz_triangle_tests;
+        if (nearest_depth(screen_tris[i].tri) >= tile_max)
+        {
+            ++tile.stats.hiz_triangles_culled;
+            continue;
+        }
+
+        rasterize_triangle(i, tile_x, tile_y, tile);
+        tile_max = *std::max_element(tile.block_max.begin(), tile.block_max.end());
+    }
+
+    shade_batch(tile, tile.color.data());
+
+    // Flush. Deferred: the attributes of the visible fragments are interpolated once, here.
+    for (int y = 0; y < h; ++y)
+    {
+        int index = get_index(tile_x, tile_y + y);
+        if (!deferred)
+            color_buf.store(index, w, &tile.color[y * TILE_SIZE]);
+        depth_buf.store(index, w, &tile.depth[y * TILE_SIZE]);
+
+        if (!deferred)
+            continue;
+        for (int x = 0; x < w; ++x)
+        {
+            int i = tile.triangle[y * TILE_SIZE + x];
+            if (i < 0)
+                continue;
+
+            const Eigen::Vector3f& b = tile.bary[y * TILE_SIZE + x];
+            fragment_shader_payload fragment = interpolate_fragment(screen_tris[i], b[0], b[1], b[2], nullptr);
+            gbuf.normal[index + x] = fragment.normal;
+            gbuf.view_pos[index + x] = fragment.view_pos;
+            gbuf.tex_coords[index + x] = fragment.tex_coords;
+            gbuf.tex_dx[index + x] = screen_tris[i].tex_dx;
+            gbuf.tex_dy[index + x] = screen_tris[i].tex_dy;
+            gbuf.color[index + x] = fragment.color;
+            gbuf.triangle_id[index + x] = frame_triangles + i;
+        }
+    }
+    for (int by = 0; by < TILE_BLOCKS; ++by)
+    {
+        int index = (tile_y / BLOCK + by) * blocks_x + tile_x / BLOCK;
+        std::copy_n(&tile.block_max[by * TILE_BLOCKS], TILE_BLOCKS, &hiz_block[index]);
+    }
+    hiz_tile[tile_index] = tile_max;
+}
+
+// Carries out a pending color clear: blacks out the tile's pixels in the color buffer
+void rst::rasterizer::clear_tile_color(int tile_index)
+{
+    int tile_x = (tile_index % tiles_x) * TILE_SIZE;
+    int tile_y = (tile_index / tiles_x) * TILE_SIZE;
+    for (int y = tile_y; y < std::min(tile_y + TILE_SIZE, height); ++y)
+        color_buf.fill(get_index(tile_x, y), std::min(TILE_SIZE, width - tile_x), Eigen::Vector3f{0, 0, 0});
+}
+
+void rst::rasterizer::clear_tile_triangle_ids(int tile_index)
+{
+    int tile_x = (tile_index % tiles_x) * TILE_SIZE;
+    int tile_y = (tile_index / tiles_x) * TILE_SIZE;
+    for (int y = tile_y; y < std::min(tile_y + TILE_SIZE, height); ++y)
+        std::fill_n(&gbuf.triangle_id[get_index(tile_x, y)], std::min(TILE_SIZE, width - tile_x), -1);
+}
+
+// Recomputes the farthest depth of one block of the tile after the depth test wrote into it
+void rst::rasterizer::update_block_max(tile_buffer& tile, int block, int tile_x, int tile_y)
+{
+    int bx = block % TILE_BLOCKS * BLOCK, by = block / TILE_BLOCKS * BLOCK;
+    int w = std::min(BLOCK, width - tile_x - bx);
+    int h = std::min(BLOCK, height - tile_y - by);
+
+    float z_max = -std::numeric_limits<float>::infinity();
+    if (w == BLOCK)
+    {
+        simd::vfloat m = z_max;
+        for (int y = 0; y < h; ++y)
+            for (int lx = 0; lx < BLOCK; lx += simd::WIDTH)
+                m = simd::max(m, simd::vfloat::load(&tile.depth[(by + y) * TILE_SIZE + bx + lx]));
+        z_max = simd::reduce_max(m);
+    }
+    else
+    {
+        // Block cut by the right screen edge: the pixels past it hold no depth
+        for (int y = 0; y < h; ++y)
+        {
+            const float* depth = &tile.depth[(by + y) * TILE_SIZE + bx];
+            z_max = std::max(z_max, *std::max_element(depth, depth + w));
+        }
+    }
+    tile.block_max[block] = z_max;
+}
+
+//Screen space rasterization: All input arguments must be under screen coordinate!
+void rst::rasterizer::rasterize_triangle(int triangle, int tile_x, int tile_y, tile_buffer& tile)
+{
+    // Classifies BLOCK x BLOCK blocks of the tile against the edges, z-tests the covered pixels a SIMD row at a
+    // time, then queues the survivors in a fragment_batch for the shader, or only records them in the G-buffer
+    // when shading is deferred.
+    const Triangle& t = screen_tris[triangle].tri;
     auto v = t.toVector4();
 
     float xmin = std::min({ v[0].x(), v[1].x(), v[2].x() });
@@ -288,46 +712,127 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eig
     float ymin = std::min({ v[0].y(), v[1].y(), v[2].y() });
     float ymax = std::max({ v[0].y(), v[1].y(), v[2].y() });
 
-    for (int x = std::floor(xmin); x <= std::ceil(xmax); ++x) {
-        for (int y = std::floor(ymin); y <= std::ceil(ymax); ++y) {
+    // Only walk the part of the bounding box that falls inside this tile (and the screen)
+    int x0 = std::max({ (int)std::floor(xmin), tile_x, 0 });
+    int x1 = std::min({ (int)std::ceil(xmax), tile_x + TILE_SIZE - 1, width - 1 });
+    int y0 = std::max({ (int)std::floor(ymin), tile_y, 0 });
+    int y1 = std::min({ (int)std::ceil(ymax), tile_y + TILE_SIZE - 1, height - 1 });
 
-            if (x < 0 || x > width - 1 || y < 0 || y > height - 1) {
-                continue;
-            }
+    // Edge equations and 1/area are set up once; the loops below only step them
+    triangle_setup setup;
+    if (!setup.init(t.v))
+        return;
 
-            Eigen::Vector3f interpolated_color; interpolated_color.setZero();
-            Eigen::Vector3f interpolated_normal; interpolated_normal.setZero();
-            Eigen::Vector2f interpolated_texcoords; interpolated_texcoords.setZero();
-            Eigen::Vector3f interpolated_shadingcoords; interpolated_shadingcoords.setZero();
+    float z_near = nearest_depth(t);
 
-            float sx = x + 0.5f;
-            float sy = y + 0.5f;
+    using namespace simd;
 
-            if (insideTriangle(sx, sy, t.v)) { // Use center of pixel to compute barycentric coordinate and point in triangle test
-                auto [alpha, beta, gamma] = computeBarycentric2D(sx, sy, t.v);
-                float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                zp *= Z;
+    // Per vertex terms of the perspective correct depth: Z = 1 / sum(b_i / w_i), zp = Z * sum(b_i * z_i / w_i)
+    float inv_w[3], z_over_w[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        inv_w[i] = 1.0f / v[i].w();
+        z_over_w[i] = v[i].z() / v[i].w();
+    }
 
-                interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1.0);
-                interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1.0);
-                interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1.0);
-                interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1.0);
+    // A pixel on an edge is covered only if that edge is top-left, so compare with >= there and > elsewhere
+    auto covered = [&](const vfloat* e) {
+        vmask m = all_lanes(true);
+        for (int i = 0; i < 3; ++i)
+            m = m & (setup.top_left[i] ? e[i] >= 0.0f : e[i] > 0.0f);
+        return m;
+    };
+
+    const vfloat lane = vfloat::ramp();
 
-                // Initialize fragment shader to store pixelwise information
-                fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-                payload.view_pos = interpolated_shadingcoords;
+    // Walk the part of the tile under the bounding box in BLOCK x BLOCK blocks. Blocks entirely outside an
+    // edge are skipped, blocks entirely inside all edges skip the per pixel coverage test.
+    for (int by = tile_y + (y0 - tile_y) / BLOCK * BLOCK; by <= y1; by += BLOCK) {
+        for (int bx = tile_x + (x0 - tile_x) / BLOCK * BLOCK; bx <= x1; bx += BLOCK) {
 
-                // We can access the interpolated color from payload
-                Eigen::Vector3f pixel_color = fragment_shader(payload);
+            int px0 = std::max(bx, x0), px1 = std::min(bx + BLOCK - 1, x1);
+            int py0 = std::max(by, y0), py1 = std::min(by + BLOCK - 1, y1);
 
-                int index = get_index(x, y); // index of current pixel 
+            block_coverage block = setup.classify(px0 + 0.5f, py0 + 0.5f, px1 + 0.5f, py1 + 0.5f);
+            if (block == block_coverage::None)
+                continue;
 
-                if (zp < depth_buf[index]) {
-                    depth_buf[index] = zp;
-                    set_pixel(Vector2i(x, y), pixel_color);
-                } 
+            // Hierarchical z: skip the block if everything stored in it is nearer than the whole triangle
+            int block_index = (by - tile_y) / BLOCK * TILE_BLOCKS + (bx - tile_x) / BLOCK;
+            ++tile.stats.hiz_block_tests;
+            if (z_near >= tile.block_max[block_index]) {
+                ++tile.stats.hiz_blocks_culled;
+                continue;
+            }
+            bool depth_written = false;
+
+            // Edge values at the center of the first pixel of the block row, stepped by B[i] per row
+            float e_row[3];
+            for (int i = 0; i < 3; ++i)
+                e_row[i] = setup.eval(i, bx + 0.5f, py0 + 0.5f);
+
+            for (int y = py0; y <= py1; ++y, e_row[0] += setup.B[0], e_row[1] += setup.B[1], e_row[2] += setup.B[2]) {
+                for (int lx = 0; lx < BLOCK; lx += WIDTH) {
+
+                    int x = bx + lx;
+                    vfloat px = lane + (float)x;
+                    vmask m = (px >= (float)px0) & (px <= (float)px1);
+
+                    vfloat e[3];
+                    for (int i = 0; i < 3; ++i)
+                        e[i] = vfloat(e_row[i]) + vfloat(setup.A[i]) * (lane + (float)lx);
+
+                    if (block == block_coverage::Partial)
+                        m = m & covered(e);
+                    if (!m.bits())
+                        continue;
+                    tile.stats.depth_tests += std::bitset<WIDTH>(m.bits()).count();
+
+                    // Perspective correct depth and z-test for all lanes at once
+                    vfloat Z = vfloat(1.0f) / (e[0] * inv_w[0] + e[1] * inv_w[1] + e[2] * inv_w[2]);
+                    vfloat zp = (e[0] * z_over_w[0] + e[1] * z_over_w[1] + e[2] * z_over_w[2]) * Z;
+
+                    float* depth = &tile.depth[(y - tile_y) * TILE_SIZE + (x - tile_x)];
+                    vfloat old_depth = vfloat::load(depth);
+                    m = m & (zp < old_depth);
+
+                    int bits = m.bits();
+                    if (!bits)
+                        continue;
+                    tile.stats.depth_passes += std::bitset<WIDTH>(bits).count();
+                    select(m, zp, old_depth).store(depth);
+                    depth_written = true;
+
+                    // Only fragments that survived the depth test are interpolated and queued for shading
+                    float alpha_lanes[WIDTH], beta_lanes[WIDTH], gamma_lanes[WIDTH];
+                    e[0].store(alpha_lanes);
+                    e[1].store(beta_lanes);
+                    e[2].store(gamma_lanes);
+
+                    for (int l = 0; l < WIDTH; ++l) {
+                        if (!(bits & (1 << l)))
+                            continue;
+
+                        int index = (y - tile_y) * TILE_SIZE + (x + l - tile_x);
+                        if (shading == Shading::Deferred) {
+                            // Visibility only, shading waits until the tile is resolved
+                            tile.triangle[index] = triangle;
+                            tile.bary[index] = { alpha_lanes[l], beta_lanes[l], gamma_lanes[l] };
+                            continue;
+                        }
+
+                        fragment_shader_payload fragment = interpolate_fragment(screen_tris[triangle], alpha_lanes[l], beta_lanes[l], gamma_lanes[l], nullptr);
+                        tile.batch_pixel[tile.batch.count] = index;
+                        tile.batch.push(fragment.view_pos, fragment.normal, fragment.color, fragment.tex_coords,
+                                        screen_tris[triangle].tex_dx, screen_tris[triangle].tex_dy);
+                        if (tile.batch.full())
+                            shade_batch(tile, tile.color.data());
+                    }
+                }
             }
+
+            if (depth_written)
+                update_block_max(tile, block_index, tile_x, tile_y);
         }
     }
 
@@ -353,33 +858,180 @@ void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
-       
+        for (auto& flags : tile_cleared)
+            flags |= TILE_COLOR_CLEARED;
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        for (auto& flags : tile_cleared)
+            flags |= TILE_DEPTH_CLEARED;
+        depth_range_set = false;
+
+        // Blocks with at least one pixel on screen start out infinitely far, the rest never take part
+        for (int by = 0; by < blocks_y; ++by)
+            for (int bx = 0; bx < blocks_x; ++bx)
+            {
+                bool on_screen = bx * BLOCK < width && by * BLOCK < height;
+                hiz_block[by * blocks_x + bx] = on_screen ? std::numeric_limits<float>::infinity()
+                                                          : -std::numeric_limits<float>::infinity();
+            }
+        std::fill(hiz_tile.begin(), hiz_tile.end(), std::numeric_limits<float>::infinity());
+
+        // A depth clear starts a new frame
+        frame_triangles = 0;
+        bin_stats = {};
+        for (auto& tile : local_tiles)
+            tile.stats = {};
+    }
+}
+
+void rst::rasterizer::resolve_color_clears()
+{
+    for (int tile_index = 0; tile_index < tiles_x * tiles_y; ++tile_index)
+    {
+        if (tile_cleared[tile_index] & TILE_COLOR_CLEARED)
+        {
+            clear_tile_color(tile_index);
+            tile_cleared[tile_index] &= ~TILE_COLOR_CLEARED;
+        }
+    }
+}
+
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
+{
+    resolve_color_clears();
+    return color_buf.rgb32f();
+}
+
+cv::Mat rst::rasterizer::color_image()
+{
+    resolve_color_clears();
+    int type = CV_32FC3;
+    switch (color_buf.get_format())
+    {
+        case ColorFormat::RGB32F: type = CV_32FC3; break;
+        case ColorFormat::BGR8:   type = CV_8UC3; break;
+        case ColorFormat::RGBA8:  type = CV_8UC4; break;
+        case ColorFormat::RGB16F: type = CV_16FC3; break;
+    }
+    return cv::Mat(height, width, type, color_buf.data());
+}
+
+void rst::rasterizer::set_color_format(ColorFormat format)
+{
+    color_buf.set_format(format);
+    clear(Buffers::Color);
+}
+
+// Tiles still flagged keep their depth clear pending, but must not show stale triangles
+const rst::g_buffer& rst::rasterizer::gbuffer()
+{
+    for (int tile_index = 0; tile_index < tiles_x * tiles_y; ++tile_index)
+    {
+        if (tile_cleared[tile_index] & TILE_DEPTH_CLEARED)
+            clear_tile_triangle_ids(tile_index);
+    }
+    return gbuf;
+}
+
+void rst::rasterizer::set_depth_format(DepthFormat format)
+{
+    depth_buf.set_format(format);
+    clear(Buffers::Depth);
+}
+
+// The integer depth formats store [depth at the near plane, depth at the far plane]. The depth of a point on
+// the view axis at clip space w follows from the projection; an orthographic projection maps ndc [-1, 1].
+void rst::rasterizer::update_depth_range()
+{
+    float range[2] = { (float)z_near, (float)z_far };
+    if (projection(3, 2) != 0)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            float w = i == 0 ? z_near : z_far;
+            float z = (w - projection(3, 3)) / projection(3, 2);
+            range[i] = to_screen({ 0, 0, projection(2, 2) * z + projection(2, 3), w }).z();
+        }
     }
+    depth_buf.set_range(std::min(range[0], range[1]), std::max(range[0], range[1]));
+    depth_range_set = true;
+}
+
+rst::frame_stats& rst::frame_stats::operator+=(const frame_stats& o)
+{
+    triangles_in += o.triangles_in;
+    frustum_culled += o.frustum_culled;
+    triangles_clipped += o.triangles_clipped;
+    backface_culled += o.backface_culled;
+    degenerate_culled += o.degenerate_culled;
+    small_culled += o.small_culled;
+    hiz_triangle_tests += o.hiz_triangle_tests;
+    hiz_triangles_culled += o.hiz_triangles_culled;
+    hiz_block_tests += o.hiz_block_tests;
+    hiz_blocks_culled += o.hiz_blocks_culled;
+    depth_tests += o.depth_tests;
+    depth_passes += o.depth_passes;
+    fragments_shaded += o.fragments_shaded;
+    return *this;
+}
+
+rst::frame_stats rst::rasterizer::stats() const
+{
+    frame_stats total = bin_stats;
+    for (const auto& tile : local_tiles)
+        total += tile.stats;
+    return total;
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+rst::rasterizer::rasterizer(int w, int h, int num_threads) : width(w), height(h)
 {
-    frame_buf.resize(w * h);
+    color_buf.resize(w * h);
     depth_buf.resize(w * h);
 
+    gbuf.normal.resize(w * h);
+    gbuf.view_pos.resize(w * h);
+    gbuf.tex_coords.resize(w * h);
+    gbuf.tex_dx.resize(w * h);
+    gbuf.tex_dy.resize(w * h);
+    gbuf.color.resize(w * h);
+    gbuf.triangle_id.resize(w * h);
+
+    tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+    tile_bins.resize(tiles_x * tiles_y);
+    tile_cleared.resize(tiles_x * tiles_y);
+
+    blocks_x = tiles_x * TILE_BLOCKS;
+    blocks_y = tiles_y * TILE_BLOCKS;
+    hiz_block.resize(blocks_x * blocks_y);
+    hiz_tile.resize(tiles_x * tiles_y);
+
+    pool = std::make_unique<thread_pool>(num_threads);
+    local_tiles.resize(pool->size());
+
+    clear(Buffers::Depth);
+
     texture = std::nullopt;
 }
 
 int rst::rasterizer::get_index(int x, int y)
 {
-    return (height-y)*width + x;
+    return (height-1-y)*width + x;
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
+    int tile_index = point.y() / TILE_SIZE * tiles_x + point.x() / TILE_SIZE;
+    if (tile_cleared[tile_index] & TILE_COLOR_CLEARED)
+    {
+        clear_tile_color(tile_index);
+        tile_cleared[tile_index] &= ~TILE_COLOR_CLEARED;
+    }
+
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    int ind = (height-1-point.y())*width + point.x();
+    color_buf.store(ind, 1, &color);
 }
 
 void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
@@ -387,8 +1039,3 @@ void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_sha
     vertex_shader = vert_shader;
 }
 
-void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader)
-{
-    fragment_shader = frag_shader;
-}
-
@@ -5,11 +5,19 @@
 #pragma once
 
 #include <eigen3/Eigen/Eigen>
+#include <opencv2/opencv.hpp>
 #include <optional>
 #include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
+#include "ThreadPool.hpp"
+#include "Clipping.hpp"
+#include "DepthBuffer.hpp"
+#include "ColorBuffer.hpp"
 
 using namespace Eigen;
 
@@ -37,6 +45,20 @@ namespace rst
         Triangle
     };
 
+    enum class Shading
+    {
+        Forward,    // shade every fragment that passes the depth test while rasterizing
+        Deferred    // rasterize visibility into the G-buffer first, then shade every visible pixel once
+    };
+
+    // Faces dropped before rasterization. Front faces wind counter clockwise on screen (y up).
+    enum class Culling
+    {
+        None,
+        Back,
+        Front
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -57,37 +79,183 @@ namespace rst
         int col_id = 0;
     };
 
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+    };
+
+    // Screen is split into TILE_SIZE x TILE_SIZE tiles. Triangles are binned into every tile their
+    // bounding box touches, then each tile is rasterized against a small local color/depth buffer
+    // that stays in cache, and flushed back to the frame once all of its triangles are done.
+    constexpr int TILE_SIZE = 32;
+
+    // Tiles are walked in BLOCK x BLOCK pixel blocks which are rejected or accepted as a whole when
+    // possible; the remaining coverage and depth work is done for a whole row of a block with SIMD lanes.
+    constexpr int BLOCK = 8;
+    constexpr int TILE_BLOCKS = TILE_SIZE / BLOCK; // blocks per tile row
+
+    // Counters of the current frame, reset by clear(Buffers::Depth)
+    struct frame_stats
+    {
+        long long triangles_in = 0;         // triangles submitted to draw
+        long long frustum_culled = 0;       // triangles entirely outside the view volume
+        long long triangles_clipped = 0;    // triangles cut by the near/far plane or the guard band
+        long long backface_culled = 0;      // triangles facing the culled side
+        long long degenerate_culled = 0;    // zero area on screen
+        long long small_culled = 0;         // bounding box without a pixel center inside
+        long long hiz_triangle_tests = 0;   // triangle/tile pairs tested against the tile's farthest depth
+        long long hiz_triangles_culled = 0;
+        long long hiz_block_tests = 0;      // covered blocks tested against the block's farthest depth
+        long long hiz_blocks_culled = 0;
+        long long depth_tests = 0;          // covered pixels tested against the depth buffer
+        long long depth_passes = 0;
+        long long fragments_shaded = 0;     // fragment shader invocations
+
+        frame_stats& operator+=(const frame_stats& o);
+    };
+
+    struct screen_triangle
+    {
+        Triangle tri;                               // vertices after viewport transform, view space normals
+        std::array<Eigen::Vector3f, 3> view_pos;    // view space positions used for shading
+
+        // Change of the texture coordinates per pixel step in x and y. Attributes are interpolated linearly in
+        // screen space, so these are the differences across any 2x2 pixel quad of the triangle.
+        Eigen::Vector2f tex_dx, tex_dy;
+    };
+
+    // Vertices of the current indexed draw call after the vertex stage, one entry per unique vertex, each
+    // component in its own array. Triangles are assembled from these, so a vertex shared by several triangles
+    // is transformed once.
+    struct vertex_cache
+    {
+        std::vector<float> x, y, z, w;                      // clip space
+        std::vector<float> view_x, view_y, view_z;          // view space
+        std::vector<float> normal_x, normal_y, normal_z;    // view space
+
+        void resize(size_t count);
+    };
+
+    struct tile_buffer
+    {
+        std::array<Eigen::Vector3f, TILE_SIZE * TILE_SIZE> color;
+        std::array<float, TILE_SIZE * TILE_SIZE> depth;
+        std::array<float, TILE_BLOCKS * TILE_BLOCKS> block_max;   // farthest depth of every block in the tile
+        frame_stats stats;                                          // counters of the worker owning this buffer
+
+        // Deferred shading: the triangle visible at each pixel (index into screen_tris, -1 if the current
+        // draw call did not draw it) and its barycentric weights there
+        std::array<int, TILE_SIZE * TILE_SIZE> triangle;
+        std::array<Eigen::Vector3f, TILE_SIZE * TILE_SIZE> bary;
+
+        // Fragments waiting to be shaded and the pixel (tile or frame buffer index) each one goes to
+        fragment_batch batch;
+        fragment_output shaded;
+        std::array<int, FRAGMENT_BATCH> batch_pixel;
+    };
+
+    // Per pixel attributes of the visible fragment, laid out like the frame buffer
+    struct g_buffer
+    {
+        std::vector<Eigen::Vector3f> normal;        // view space, normalized
+        std::vector<Eigen::Vector3f> view_pos;
+        std::vector<Eigen::Vector2f> tex_coords;
+        std::vector<Eigen::Vector2f> tex_dx;
+        std::vector<Eigen::Vector2f> tex_dy;
+        std::vector<Eigen::Vector3f> color;
+        std::vector<int> triangle_id;               // counts triangles drawn since the last depth clear, -1: empty
+    };
+
     class rasterizer
     {
     public:
-        rasterizer(int w, int h);
+        rasterizer(int w, int h, int num_threads = 0); // num_threads = 0: use every hardware core
         pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
         col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        tex_buf_id load_tex_coords(const std::vector<Eigen::Vector2f>& tex_coords);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
         void set_texture(Texture tex) { texture = tex; }
+        void set_shading(Shading mode) { shading = mode; }
+        void set_culling(Culling mode) { culling = mode; }
+        void set_depth_format(DepthFormat format);
+        void set_color_format(ColorFormat format);
 
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
-        void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
-        void draw(std::vector<Triangle *> &TriangleList);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        template <typename Shader>
+        void draw(std::vector<Triangle *> &TriangleList, const Shader& shader, const shader_uniforms& u)
+        {
+            bind_shader(shader, u);
+            draw_triangles(TriangleList);
+        }
+
+        // Indexed mesh: every index triple is a triangle of the vertices with these positions, normals and
+        // texture coordinates
+        template <typename Shader>
+        void draw(pos_buf_id pos_buffer, col_buf_id nor_buffer, tex_buf_id tex_buffer, ind_buf_id ind_buffer,
+                  const Shader& shader, const shader_uniforms& u)
+        {
+            bind_shader(shader, u);
+            draw_indexed(pos_buffer, nor_buffer, tex_buffer, ind_buffer);
+        }
+
+        // These finish the clears still pending in tiles nothing was drawn to.
+        // frame_buffer() holds the pixels in the RGB32F format only; color_image() wraps them in any format,
+        // without copying: CV_32FC3, CV_8UC3, CV_8UC4 or CV_16FC3. It stays valid until the format changes.
+        std::vector<Eigen::Vector3f>& frame_buffer();
+        cv::Mat color_image();
+        const g_buffer& gbuffer();
+
+        frame_stats stats() const;
 
     private:
+        template <typename Shader>
+        void bind_shader(const Shader& shader, const shader_uniforms& u)
+        {
+            shader_state = &shader;
+            shade_fn = [](const void* s, const fragment_batch& in, const shader_uniforms& uniforms, fragment_output& out) {
+                static_cast<const Shader*>(s)->shade(in, uniforms, out);
+            };
+            uniforms = u;
+        }
+
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        void rasterize_triangle(int triangle, int tile_x, int tile_y, tile_buffer& tile);
+
+        void draw_triangles(std::vector<Triangle *> &TriangleList);
+        void draw_indexed(pos_buf_id pos_buffer, col_buf_id nor_buffer, tex_buf_id tex_buffer, ind_buf_id ind_buffer);
+        void draw_screen_triangles();
+        void update_transforms();
+        void update_depth_range();
+        Eigen::Vector4f to_screen(const Eigen::Vector4f& clip) const;
+        void transform_triangles(std::vector<Triangle *> &TriangleList, int begin, int end, std::vector<screen_triangle>& out, frame_stats& stats);
+        void transform_vertices(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3f>& normals, int begin, int end);
+        void assemble_triangles(const std::vector<Eigen::Vector3i>& indices, const std::vector<Eigen::Vector2f>& tex_coords, int begin, int end,
+                                std::vector<screen_triangle>& out, frame_stats& stats);
+        void clip_triangle(const clip_vertex* triangle, std::vector<screen_triangle>& out, frame_stats& stats) const;
+        void emit_triangle(const clip_vertex& a, const clip_vertex& b, const clip_vertex& c, std::vector<screen_triangle>& out, frame_stats& stats) const;
+        void gather_triangles(int chunks);
+        void bin_triangles();
+        void rasterize_tile(int tile_index, tile_buffer& tile);
+        void update_block_max(tile_buffer& tile, int block, int tile_x, int tile_y);
+        void clear_tile_color(int tile_index);
+        void resolve_color_clears();
+        void clear_tile_triangle_ids(int tile_index);
+        void shade_row(int y, int first_id, tile_buffer& scratch);
+        void shade_batch(tile_buffer& scratch, Eigen::Vector3f* target);
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -96,24 +264,68 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
+        // Derived once per draw call from the three above
+        Eigen::Matrix4f model_view;
+        Eigen::Matrix4f mvp;
+        Eigen::Matrix4f normal_matrix;  // inverse transpose of model_view
+
         int normal_id = -1;
 
         std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
         std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
         std::map<int, std::vector<Eigen::Vector3f>> col_buf;
         std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        std::map<int, std::vector<Eigen::Vector2f>> tex_buf;
 
         std::optional<Texture> texture;
 
-        std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
+        // Shader of the current draw call
+        batch_shader shade_fn = nullptr;
+        const void* shader_state = nullptr;
+        shader_uniforms uniforms;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
 
-        std::vector<Eigen::Vector3f> frame_buf;
-        std::vector<float> depth_buf;
+        color_buffer color_buf;
+        depth_buffer depth_buf;
+        bool depth_range_set = false;   // the integer depth formats' range, fixed by the first draw of a frame
+
+        // Clears only flag the tiles; a flagged tile is cleared when it is loaded for rasterization, or when the
+        // buffer is read, so tiles nothing is drawn to cost nothing until then
+        enum tile_clear_flags
+        {
+            TILE_COLOR_CLEARED = 1,
+            TILE_DEPTH_CLEARED = 2
+        };
+        std::vector<uint8_t> tile_cleared;
+
+        Shading shading = Shading::Forward;
+        Culling culling = Culling::None;
+        g_buffer gbuf;
+        int frame_triangles = 0;    // triangles drawn since the last depth clear, the next draw's first triangle id
         int get_index(int x, int y);
 
+        // Hierarchical z: the farthest depth stored in every BLOCK x BLOCK block and in every tile. A triangle
+        // whose nearest depth is not in front of that can not pass the depth test anywhere in the block/tile.
+        // Blocks are indexed in screen coordinates (y up); blocks lying completely off screen hold -inf.
+        int blocks_x, blocks_y;
+        std::vector<float> hiz_block;
+        std::vector<float> hiz_tile;
+        frame_stats bin_stats;
+
         int width, height;
 
+        int tiles_x, tiles_y;
+        vertex_cache vertices;                      // vertices of the current indexed draw call
+        std::vector<screen_triangle> screen_tris;   // all triangles of the current draw call
+        std::vector<std::vector<screen_triangle>> chunk_tris;  // output of each vertex stage chunk, after clipping
+        std::vector<std::vector<int>> tile_bins;    // per tile: indices into screen_tris, in submission order
+        std::vector<int> active_tiles;              // tiles with at least one triangle binned
+
+        // Tiles are handed to the workers of the pool; a tile is only ever touched by the thread that
+        // picked it up, so color_buf/depth_buf need no locking. Each worker has its own tile buffer.
+        std::unique_ptr<thread_pool> pool;
+        std::vector<tile_buffer> local_tiles;
+
         int next_id = 0;
         int get_next_id() { return next_id++; }
     };
@@ -1,7 +1,27 @@
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
 #include "BVH.hpp"
 
+// The axis along which the centers of two sibling boxes lie furthest apart
+static int childAxis(const Bounds3& first, const Bounds3& second)
+{
+    Vector3f d = (second.pMin + second.pMax) - (first.pMin + first.pMax);
+    return Bounds3(Vector3f(0, 0, 0), Vector3f(std::abs(d.x), std::abs(d.y), std::abs(d.z))).maxExtent();
+}
+
+static void deleteBuildTree(BVHBuildNode* node)
+{
+    if (!node)
+        return;
+    deleteBuildTree(node->left);
+    deleteBuildTree(node->right);
+    delete node;
+}
+
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
@@ -12,14 +32,25 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
     if (primitives.empty())
         return;
 
+    BVHBuildNode* root = nullptr;
     if (splitMethod == SplitMethod::NAIVE) {
         root = recursiveBuild(primitives);  
     }
 
     if (splitMethod == BVHAccel::SplitMethod::SAH) {
-            root = recursiveSVHBuild(primitives); 
+        root = buildSAH();
     }
 
+    if (splitMethod == BVHAccel::SplitMethod::LBVH) {
+        root = buildLBVH();
+    }
+
+    // Traversal walks a flat depth first array instead of the pointer tree the build produced
+    nodes.reserve(2 * primitives.size() - 1);
+    orderedPrimitives.reserve(primitives.size());
+    flattenBVHTree(root);
+    deleteBuildTree(root);
+
     time(&stop);
     double diff = difftime(stop, start);
     int hrs = (int)diff / 3600;
@@ -31,146 +62,436 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
         hrs, mins, secs);
 }
 
+int BVHAccel::flattenBVHTree(const BVHBuildNode* node)
+{
+    int offset = (int)nodes.size();
+    nodes.emplace_back();
+    nodes[offset].bounds = node->bounds;
+    if (node->left == nullptr && node->right == nullptr) {
+        if (node->nPrimitives > 0) {
+            // An SAH leaf, whose primitives buildSAH() already put in order
+            nodes[offset].primitivesOffset = node->firstPrimOffset;
+            nodes[offset].nPrimitives = (uint16_t)node->nPrimitives;
+        }
+        else {
+            nodes[offset].primitivesOffset = (int)orderedPrimitives.size();
+            nodes[offset].nPrimitives = 1;
+            orderedPrimitives.push_back(node->object);
+        }
+        return offset;
+    }
+
+    // Store the child lower along the axis first, so traversal can pick the near child from the ray's direction
+    const BVHBuildNode* first = node->left;
+    const BVHBuildNode* second = node->right;
+    int axis = childAxis(first->bounds, second->bounds);
+    if (second->bounds.pMin[axis] + second->bounds.pMax[axis] < first->bounds.pMin[axis] + first->bounds.pMax[axis])
+        std::swap(first, second);
+    nodes[offset].axis = (uint8_t)axis;
+    nodes[offset].nPrimitives = 0;
+    flattenBVHTree(first);
+    int secondOffset = flattenBVHTree(second);
+    nodes[offset].secondChildOffset = secondOffset;
+    return offset;
+}
+
+BVHAccel::BVHAccel(std::vector<Object*> p, const MeshCacheNode* cached, size_t nodeCount)
+    : maxPrimsInNode(1), splitMethod(SplitMethod::NAIVE), primitives(std::move(p))
+{
+    // The cached nodes are already depth first, only the leaves' primitives are put into leaf order
+    nodes.resize(nodeCount);
+    orderedPrimitives.reserve(primitives.size());
+    for (size_t i = 0; i < nodeCount; ++i) {
+        LinearBVHNode& node = nodes[i];
+        node.bounds = Bounds3(Vector3f(cached[i].boundsMin[0], cached[i].boundsMin[1], cached[i].boundsMin[2]),
+                              Vector3f(cached[i].boundsMax[0], cached[i].boundsMax[1], cached[i].boundsMax[2]));
+        if (cached[i].right == 0) {
+            node.primitivesOffset = (int)orderedPrimitives.size();
+            node.nPrimitives = 1;
+            orderedPrimitives.push_back(primitives[cached[i].primitive]);
+        }
+        else {
+            node.secondChildOffset = (int)cached[i].right;
+            node.nPrimitives = 0;
+        }
+    }
+    for (size_t i = 0; i < nodeCount; ++i) {
+        if (nodes[i].nPrimitives == 0)
+            nodes[i].axis = (uint8_t)childAxis(nodes[i + 1].bounds, nodes[nodes[i].secondChildOffset].bounds);
+    }
+}
 
-// *** Implementation of SAH follows pseudo code strictly from: http://15362.courses.cs.cmu.edu/fall2024/lecture/lecture-09 ********
-// The SAH is much faster than BVH when triangles are more spread out! Tested example with a sorter.
-// My implementation is neither optimized nor necessarily correct, however already much better than BVH => SAH is doing something.
-class CBin {
-public:
-    // Constructor to initialize the bin
-    CBin() : bounds(Bounds3()), count(0) {}
+// The build tree is freed once it is flattened, and the primitives belong to the caller, so only the arrays are
+// left to free
+BVHAccel::~BVHAccel() = default;
 
-    void addObject(Object* obj) {
-        bounds = Union(bounds, obj->getBounds()); 
-        count++; 
+bool BVHAccel::save(std::vector<MeshCacheNode>& saved) const
+{
+    saved.clear();
+    // A cached leaf holds a single primitive, so a tree built with larger leaves cannot be saved
+    for (const LinearBVHNode& node : nodes) {
+        if (node.nPrimitives > 1)
+            return false;
     }
+    std::unordered_map<const Object*, uint32_t> primitiveIndex;
+    for (uint32_t i = 0; i < primitives.size(); ++i)
+        primitiveIndex[primitives[i]] = i;
+    saved.reserve(nodes.size());
+    for (const LinearBVHNode& node : nodes) {
+        MeshCacheNode n = { { node.bounds.pMin.x, node.bounds.pMin.y, node.bounds.pMin.z },
+                            { node.bounds.pMax.x, node.bounds.pMax.y, node.bounds.pMax.z }, 0, 0 };
+        if (node.nPrimitives > 0)
+            n.primitive = primitiveIndex.at(orderedPrimitives[node.primitivesOffset]);
+        else
+            n.right = (uint32_t)node.secondChildOffset;
+        saved.push_back(n);
+    }
+    return true;
+}
 
-    void clear() {
-        bounds = Bounds3(); 
-        count = 0;          
+bool BVHAccel::validNodes(const MeshCacheNode* nodes, size_t nodeCount, size_t primitiveCount)
+{
+    // In preorder an interior node's left child follows it and its right child comes after the left subtree
+    for (size_t i = 0; i < nodeCount; ++i) {
+        if (nodes[i].right == 0 ? nodes[i].primitive >= primitiveCount
+                                : nodes[i].right <= i + 1 || nodes[i].right >= nodeCount)
+            return false;
     }
+    return true;
+}
 
-    Bounds3 bounds; 
-    int count;      
+// What the SAH build needs to know of a primitive, gathered once instead of calling getBounds() at every node
+struct BVHPrimitiveInfo {
+    size_t primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
 };
 
-BVHBuildNode* BVHAccel::recursiveSVHBuild(std::vector<Object*> objects) {
-    BVHBuildNode* node = new BVHBuildNode();
+// A subtree split off the top of the tree, built later on one of the worker threads
+struct BVHBuildTask {
+    BVHBuildNode* node;
+    int start, end;
+};
 
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
+// Centroids are binned along each axis and only the splits between bins are evaluated
+static const int SAH_BINS = 32;
+// Subtrees smaller than this are built on the thread that split them off; a handful of spheres is not worth a thread
+static const int MIN_PARALLEL_PRIMITIVES = 1 << 12;
 
-    if (objects.size() == 1) {
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        return node;
-    }
-    else if (objects.size() == 2) {
-        node->left = recursiveSVHBuild(std::vector{ objects[0] });
-        node->right = recursiveSVHBuild(std::vector{ objects[1] });
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        return node;
-    }
-    else {
-        int bin_n = 32;
-        float best_cost = std::numeric_limits<float>::infinity();
-        int best_partition = -1;
-        int best_axis = -1;
-
-        // Repeat for each of the three axes: Sort objects based on their centroid along axis
-        for (int axis = 0; axis < 3; ++axis) {
-            std::vector<CBin> bins(bin_n); // Reset bins for each axis
-
-            // Compute bounds along the current axis
-            Bounds3 centroidBounds;
-            for (const auto& obj : objects)
-                centroidBounds = Union(centroidBounds, obj->getBounds().Centroid());
-
-            float boundsMin = (axis == 0) ? centroidBounds.pMin.x : (axis == 1) ? centroidBounds.pMin.y : centroidBounds.pMin.z;
-            float boundsMax = (axis == 0) ? centroidBounds.pMax.x : (axis == 1) ? centroidBounds.pMax.y : centroidBounds.pMax.z;
-            float binSize = (boundsMax - boundsMin) / bin_n;
-
-            std::vector<Object*> sortedObjects = objects; 
-            std::sort(sortedObjects.begin(), sortedObjects.end(), [axis](auto f1, auto f2) {
-                if (axis == 0)
-                    return f1->getBounds().Centroid().x < f2->getBounds().Centroid().x;
-                else if (axis == 1)
-                    return f1->getBounds().Centroid().y < f2->getBounds().Centroid().y;
-                else
-                    return f1->getBounds().Centroid().z < f2->getBounds().Centroid().z;
-                });
-
-            // Assign sorted objects to bins
-            for (int i = 0; i < sortedObjects.size(); ++i) {
-                float centroid = (axis == 0) ? sortedObjects[i]->getBounds().Centroid().x
-                    : (axis == 1) ? sortedObjects[i]->getBounds().Centroid().y
-                    : sortedObjects[i]->getBounds().Centroid().z;
-                int binIndex = std::clamp(int((centroid - boundsMin) / binSize), 0, bin_n - 1);
-                bins[binIndex].addObject(sortedObjects[i]);
-            }
+static int buildThreads(size_t count)
+{
+    return count < (size_t)MIN_PARALLEL_PRIMITIVES ? 1 : std::max(1, (int)std::thread::hardware_concurrency());
+}
 
-            // Compute SAH for this axis
-            int totalCount = 0;
-            for (int i = 0; i < bin_n; ++i)
-                totalCount += bins[i].count;
+// Calls job(block, begin, end) for each of blocks even ranges of [0, count), on a thread per block
+template <typename Job>
+static void forEachBlock(size_t count, int blocks, const Job& job)
+{
+    auto run = [&](int b) { job(b, count * b / blocks, count * (b + 1) / blocks); };
+    std::vector<std::thread> threads;
+    for (int b = 1; b < blocks; ++b)
+        threads.emplace_back(run, b);
+    run(0);
+    for (auto& t : threads)
+        t.join();
+}
 
-            int leftCount = 0;
-            int rightCount = totalCount;
+static std::vector<BVHPrimitiveInfo> gatherPrimitiveInfo(const std::vector<Object*>& primitives)
+{
+    std::vector<BVHPrimitiveInfo> info(primitives.size());
+    forEachBlock(info.size(), buildThreads(info.size()), [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            info[i].primitiveNumber = i;
+            info[i].bounds = primitives[i]->getBounds();
+            info[i].centroid = 0.5f * info[i].bounds.pMin + 0.5f * info[i].bounds.pMax;
+        }
+    });
+    return info;
+}
 
-            for (int j = 1; j < bin_n; ++j) {
-                leftCount += bins[j - 1].count;
-                rightCount -= bins[j - 1].count;
+BVHBuildNode* BVHAccel::buildSAH()
+{
+    std::vector<BVHPrimitiveInfo> info = gatherPrimitiveInfo(primitives);
+
+    // The top of the tree is split on this thread until there are a few subtrees per thread, then the threads take
+    // the subtrees, largest first. The tree does not depend on the thread count.
+    int numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    int deferBelow = std::max(MIN_PARALLEL_PRIMITIVES, (int)info.size() / (4 * numThreads));
+    std::vector<BVHBuildTask> tasks;
+    BVHBuildNode* root = new BVHBuildNode();
+    recursiveSAHBuild(root, info, 0, (int)info.size(), numThreads > 1 ? &tasks : nullptr, deferBelow);
+
+    std::sort(tasks.begin(), tasks.end(), [](const BVHBuildTask& a, const BVHBuildTask& b) {
+        return a.end - a.start > b.end - b.start;
+    });
+    std::atomic<size_t> nextTask(0);
+    auto work = [&] {
+        for (size_t t = nextTask++; t < tasks.size(); t = nextTask++)
+            recursiveSAHBuild(tasks[t].node, info, tasks[t].start, tasks[t].end, nullptr, 0);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min(numThreads, (int)tasks.size()); ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto& t : threads)
+        t.join();
+
+    // Partitioning left the primitives of every leaf next to each other
+    orderedPrimitives.resize(info.size());
+    for (size_t i = 0; i < info.size(); ++i)
+        orderedPrimitives[i] = primitives[info[i].primitiveNumber];
+    return root;
+}
 
-                Bounds3 a, b;
-                for (int i = 0; i < j; ++i)
-                    a = Union(a, bins[i].bounds);
-                for (int i = j; i < bin_n; ++i)
-                    b = Union(b, bins[i].bounds);
+// Builds the subtree over info[start, end) into node, partitioning that range in place so every leaf ends up with a
+// contiguous run of it. With deferred set, subtrees of at most deferBelow primitives are left to the caller.
+void BVHAccel::recursiveSAHBuild(BVHBuildNode* node, std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                                 std::vector<BVHBuildTask>* deferred, int deferBelow)
+{
+    if (deferred && end - start <= deferBelow) {
+        deferred->push_back({ node, start, end });
+        return;
+    }
+
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, info[i].bounds);
+        centroidBounds = Union(centroidBounds, info[i].centroid);
+    }
+    node->bounds = bounds;
+
+    int count = end - start;
+    auto makeLeaf = [&] {
+        node->firstPrimOffset = start;
+        node->nPrimitives = count;
+    };
+    if (count == 1) {
+        makeLeaf();
+        return;
+    }
 
-                // C' = SA * NA + SB * NB
-                float cost = a.SurfaceArea() * leftCount + b.SurfaceArea() * rightCount;
+    const Vector3f& centroidMin = centroidBounds.pMin;
+    const Vector3f& centroidMax = centroidBounds.pMax;
+    auto binOf = [&](const BVHPrimitiveInfo& p, int axis) {
+        int b = (int)(SAH_BINS * ((p.centroid[axis] - centroidMin[axis]) / (centroidMax[axis] - centroidMin[axis])));
+        return std::min(b, SAH_BINS - 1);
+    };
+
+    // Bin the centroids along each axis and evaluate the splits between the bins
+    double minCost = std::numeric_limits<double>::infinity();
+    int minAxis = -1, minBin = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroidMax[axis] == centroidMin[axis])
+            continue;
+        Bounds3 binBounds[SAH_BINS];
+        int binCount[SAH_BINS] = {};
+        for (int i = start; i < end; ++i) {
+            int b = binOf(info[i], axis);
+            binBounds[b] = Union(binBounds[b], info[i].bounds);
+            ++binCount[b];
+        }
 
-                // Update min cost parameters
-                if (cost < best_cost) {
-                    best_cost = cost;
-                    best_partition = leftCount; // Stands for the (leftCount)th object to parition along best_axis
-                    best_axis = axis;
-                }
+        // Sweep down from the top bin for the area and count above every split, then up from the bottom one for
+        // those below it. The first and last bins hold the extreme centroids, so no side is ever empty.
+        double areaAbove[SAH_BINS - 1];
+        int countAbove[SAH_BINS - 1];
+        Bounds3 above;
+        int n = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            above = Union(above, binBounds[b]);
+            n += binCount[b];
+            areaAbove[b - 1] = above.SurfaceArea();
+            countAbove[b - 1] = n;
+        }
+        Bounds3 below;
+        n = 0;
+        for (int b = 0; b < SAH_BINS - 1; ++b) {
+            below = Union(below, binBounds[b]);
+            n += binCount[b];
+            double cost = n * below.SurfaceArea() + countAbove[b] * areaAbove[b];
+            if (cost < minCost) {
+                minCost = cost;
+                minAxis = axis;
+                minBin = b;
             }
         }
+    }
 
-        // Sort on the real objects according to the best_axis to be compatible with best_partition later
-        std::sort(objects.begin(), objects.end(), [best_axis](auto f1, auto f2) {
-            if (best_axis == 0)
-                return f1->getBounds().Centroid().x < f2->getBounds().Centroid().x;
-            else if (best_axis == 1)
-                return f1->getBounds().Centroid().y < f2->getBounds().Centroid().y;
-            else
-                return f1->getBounds().Centroid().z < f2->getBounds().Centroid().z;
-            });
+    int mid;
+    if (minAxis < 0) {
+        // All centroids coincide and no plane separates them: halve the range unless it fits into a leaf
+        if (count <= maxPrimsInNode) {
+            makeLeaf();
+            return;
+        }
+        mid = start + count / 2;
+    }
+    else {
+        // In units of one primitive intersection, with a step down the tree costing an eighth of that
+        double splitCost = 0.125 + minCost / bounds.SurfaceArea();
+        if (count <= maxPrimsInNode && count <= splitCost) {
+            makeLeaf();
+            return;
+        }
+        mid = (int)(std::partition(info.begin() + start, info.begin() + end,
+                                   [&](const BVHPrimitiveInfo& p) { return binOf(p, minAxis) <= minBin; }) - info.begin());
+    }
 
+    node->left = new BVHBuildNode();
+    node->right = new BVHBuildNode();
+    recursiveSAHBuild(node->left, info, start, mid, deferred, deferBelow);
+    recursiveSAHBuild(node->right, info, mid, end, deferred, deferBelow);
+}
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + best_partition; // best_partition corresponding to the minimum sort considering all three axes x, y, and z
+// A primitive's place along the Morton curve through the centroid bounds
+struct MortonPrimitive {
+    uint32_t code;
+    uint32_t primitiveNumber;
+};
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, objects.end());
+// Spreads the low 10 bits of x out to every third bit
+static uint32_t leftShift3(uint32_t x)
+{
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+// Interleaves 10 bits of each coordinate of a point in the unit cube into a 30-bit code
+static uint32_t encodeMorton3(const Vector3f& v)
+{
+    uint32_t x = (uint32_t)std::clamp(v.x * 1024.0f, 0.0f, 1023.0f);
+    uint32_t y = (uint32_t)std::clamp(v.y * 1024.0f, 0.0f, 1023.0f);
+    uint32_t z = (uint32_t)std::clamp(v.z * 1024.0f, 0.0f, 1023.0f);
+    return (leftShift3(z) << 2) | (leftShift3(y) << 1) | leftShift3(x);
+}
 
-        node->left = recursiveSVHBuild(leftshapes);
-        node->right = recursiveSVHBuild(rightshapes);
+static int countLeadingZeros(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse(&index, x) ? 31 - (int)index : 32;
+#else
+    return x ? __builtin_clz(x) : 32;
+#endif
+}
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+// Stable least significant digit radix sort by code, 8 bits a pass. Each thread counts the digits of its block,
+// then moves its block to where those digits go after the smaller digits and the same digit of earlier blocks.
+static void radixSort(std::vector<MortonPrimitive>& v)
+{
+    std::vector<MortonPrimitive> sorted(v.size());
+    int blocks = buildThreads(v.size());
+    std::vector<std::array<size_t, 256>> offsets(blocks);
+    for (int shift = 0; shift < 30; shift += 8) {
+        forEachBlock(v.size(), blocks, [&](int b, size_t begin, size_t end) {
+            offsets[b].fill(0);
+            for (size_t i = begin; i < end; ++i)
+                ++offsets[b][(v[i].code >> shift) & 0xff];
+        });
+        size_t next = 0;
+        for (int digit = 0; digit < 256; ++digit) {
+            for (int b = 0; b < blocks; ++b) {
+                size_t count = offsets[b][digit];
+                offsets[b][digit] = next;
+                next += count;
+            }
+        }
+        forEachBlock(v.size(), blocks, [&](int b, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                sorted[offsets[b][(v[i].code >> shift) & 0xff]++] = v[i];
+        });
+        v.swap(sorted);
     }
+}
 
-    return node;
-} // ********************Done Implementing SAH *********************************
+static void unionChildBounds(BVHBuildNode* node)
+{
+    if (node->left == nullptr && node->right == nullptr)
+        return;
+    unionChildBounds(node->left);
+    unionChildBounds(node->right);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+}
 
+// Sorts the primitives along a Morton curve and emits the tree with Karras, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees": internal node i covers a range of the sorted primitives with i at
+// one end, and finds that range and where it splits from the codes alone, so all nodes are linked at once.
+// Splits fall on Morton bits, midway through the centroid bounds, and are not weighed by SAH.
+BVHBuildNode* BVHAccel::buildLBVH()
+{
+    std::vector<BVHPrimitiveInfo> info = gatherPrimitiveInfo(primitives);
+    Bounds3 centroidBounds;
+    for (const BVHPrimitiveInfo& p : info)
+        centroidBounds = Union(centroidBounds, p.centroid);
+
+    int n = (int)info.size();
+    int threads = buildThreads(n);
+    std::vector<MortonPrimitive> morton(n);
+    forEachBlock(n, threads, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            morton[i] = { encodeMorton3(centroidBounds.Offset(info[i].centroid)), (uint32_t)i };
+    });
+    radixSort(morton);
+
+    std::vector<BVHBuildNode*> leaves(n), internal(n - 1);
+    forEachBlock(n, threads, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            leaves[i] = new BVHBuildNode();
+            leaves[i]->object = primitives[morton[i].primitiveNumber];
+            leaves[i]->bounds = info[morton[i].primitiveNumber].bounds;
+            if (i + 1 < (size_t)n)
+                internal[i] = new BVHBuildNode();
+        }
+    });
+    if (n == 1)
+        return leaves[0];
+
+    // The length of the common prefix of the keys at i and j, -1 if j is out of range. Equal codes are told apart
+    // by their position, so every key is unique and the tree stays binary.
+    auto delta = [&](int i, int j) {
+        if (j < 0 || j >= n)
+            return -1;
+        if (morton[i].code == morton[j].code)
+            return 32 + countLeadingZeros((uint32_t)i ^ (uint32_t)j);
+        return countLeadingZeros(morton[i].code ^ morton[j].code);
+    };
+    forEachBlock(n - 1, threads, [&](int, size_t begin, size_t end) {
+        for (int i = (int)begin; i < (int)end; ++i) {
+            // The range extends towards the neighbour sharing the longer prefix, as far as keys share more than
+            // the prefix with the other neighbour
+            int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int deltaMin = delta(i, i - d);
+            int lengthMax = 2;
+            while (delta(i, i + lengthMax * d) > deltaMin)
+                lengthMax *= 2;
+            int length = 0;
+            for (int t = lengthMax / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (length + t) * d) > deltaMin)
+                    length += t;
+            }
+            int j = i + length * d;
+
+            // The split is the last key sharing more than the range's common prefix with i
+            int deltaNode = delta(i, j);
+            int split = 0;
+            for (int divisor = 2, t = length; t > 1; divisor *= 2) {
+                t = (length + divisor - 1) / divisor;
+                if (delta(i, i + (split + t) * d) > deltaNode)
+                    split += t;
+            }
+            int gamma = i + split * d + std::min(d, 0);
 
+            internal[i]->left = std::min(i, j) == gamma ? leaves[gamma] : internal[gamma];
+            internal[i]->right = std::max(i, j) == gamma + 1 ? leaves[gamma + 1] : internal[gamma + 1];
+        }
+    });
+
+    unionChildBounds(internal[0]);
+    return internal[0];
+}
 
 // Refer to Games101 Slides 14 for Building BVHs
 // 1. Find the centroid bounding box for all the objects in the node
@@ -256,34 +577,45 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     return node;
 }
 
+// Traverses the flattened tree with an explicit stack, visiting the child nearer to the ray origin first and
+// skipping every node the ray enters only beyond the closest hit found so far.
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
     Intersection isect;
-    if (!root)
+    if (nodes.empty())
         return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
-}
 
-// Assuming that BVH has been built based on the scene objects.
-// Now, follow exactly the pseudo code in games101 Lec14 - Slide 37 for BVH traversal to search for the closet hit triangle.
-// 1. Every node has a bounding box defined
-// 2. Only leaf node can store objects
-// 3. Want triangle with the closest hit stored as and returned as "Intersection"
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const // For each ray, ...
-{
-    // TODO Traverse the BVH to find intersection
-    Intersection intersection;
-    if (node == nullptr || !node->bounds.IntersectP(ray, ray.direction_inv, { ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0 })) {
-        return intersection; // NULL intersection
-    }
-
-    if (node->left == nullptr && node->right == nullptr) {
-       return node->object->getIntersection(ray);
+    std::array<int, 3> dirIsNeg = { ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0 };
+    // Second children still to visit; 64 levels are far more than a tree over any mesh that fits in memory
+    int toVisit[64];
+    int toVisitCount = 0;
+    int current = 0;
+    while (true) {
+        const LinearBVHNode& node = nodes[current];
+        float tEnter;
+        if (node.bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, tEnter) && tEnter < isect.distance) {
+            if (node.nPrimitives > 0) {
+                for (int i = 0; i < node.nPrimitives; ++i) {
+                    Intersection hit = orderedPrimitives[node.primitivesOffset + i]->getIntersection(ray);
+                    if (hit.happened && hit.distance < isect.distance)
+                        isect = hit;
+                }
+            }
+            else if (dirIsNeg[node.axis]) {
+                // The ray goes up the axis, so the first (lower) child is the near one
+                toVisit[toVisitCount++] = node.secondChildOffset;
+                current = current + 1;
+                continue;
+            }
+            else {
+                toVisit[toVisitCount++] = current + 1;
+                current = node.secondChildOffset;
+                continue;
+            }
+        }
+        if (toVisitCount == 0)
+            break;
+        current = toVisit[--toVisitCount];
     }
-
-    Intersection hit1 = getIntersection(node->left, ray);  // closest hit from the left subtree
-    Intersection hit2 = getIntersection(node->right, ray); // closest hit from the right subtree
-
-    return hit1.distance < hit2.distance ? hit1 : hit2; // Return minimum distance hit triangle
-}
\ No newline at end of file
+    return isect;
+}
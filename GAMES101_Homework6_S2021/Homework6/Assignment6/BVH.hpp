@@ -6,6 +6,7 @@
 #define RAYTRACING_BVH_H
 
 #include <atomic>
+#include <cstdint>
 #include <vector>
 #include <memory>
 #include <ctime>
@@ -14,10 +15,26 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "MeshCache.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct BVHBuildTask;
+
+// A node of the flattened tree. Nodes are stored depth first, so an interior node's first child follows it and
+// only the second child's offset is kept; the first child is the one lower along axis.
+struct LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;       // 0 for interior nodes
+    uint8_t axis;               // interior node
+    uint8_t pad[1];             // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -25,26 +42,38 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    enum class SplitMethod { NAIVE, SAH, LBVH };
 
     // BVHAccel Public Methods
     BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // Restores the tree save() wrote for the same primitives, in the same order, without building it again
+    BVHAccel(std::vector<Object*> p, const MeshCacheNode* nodes, size_t nodeCount);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+
+    // The tree in preorder, leaves referring to primitives by their index in p. False, with nodes left empty, if a
+    // leaf holds more than one primitive.
+    bool save(std::vector<MeshCacheNode>& nodes) const;
+    // True if the nodes form a tree over nodeCount nodes whose leaves refer to primitives below primitiveCount
+    static bool validNodes(const MeshCacheNode* nodes, size_t nodeCount, size_t primitiveCount);
 
     // BVHAccel Private Methods
     BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
-    BVHBuildNode* recursiveSVHBuild(std::vector<Object*>objects); // For SAH
+    BVHBuildNode* buildSAH();
+    BVHBuildNode* buildLBVH();
+    void recursiveSAHBuild(BVHBuildNode* node, std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                           std::vector<BVHBuildTask>* deferred, int deferBelow);
+    int flattenBVHTree(const BVHBuildNode* node);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
+    std::vector<Object*> orderedPrimitives; // in the order the leaves refer to them
+    std::vector<LinearBVHNode> nodes;
 };
 
 struct BVHBuildNode {
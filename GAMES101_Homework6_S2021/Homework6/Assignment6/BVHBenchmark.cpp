@@ -0,0 +1,82 @@
+//
+// Build time and trace throughput of the BVH split methods on one mesh.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include "BVHBenchmark.hpp"
+#include "Triangle.hpp"
+
+int runBVHBenchmark(const std::string& path, int rayCount)
+{
+    ObjMesh obj;
+    if (!loadObj(path, obj) || obj.triangleCount() == 0) {
+        std::cout << "Could not load " << path << "\n";
+        return 1;
+    }
+
+    std::vector<Triangle> triangles;
+    triangles.reserve(obj.triangleCount());
+    Bounds3 bounds;
+    for (size_t i = 0; i < obj.triangleCount(); ++i) {
+        Vector3f v[3];
+        for (int j = 0; j < 3; ++j) {
+            const float* p = &obj.positions[3 * obj.indices[3 * i + j]];
+            v[j] = Vector3f(p[0], p[1], p[2]);
+        }
+        triangles.emplace_back(v[0], v[1], v[2]);
+        bounds = Union(bounds, triangles.back().getBounds());
+    }
+    std::vector<Object*> ptrs;
+    for (auto& tri : triangles)
+        ptrs.push_back(&tri);
+
+    // Rays from random points on a sphere around the mesh towards random points of its bounds, the same for every
+    // method, so about as many hit the mesh as miss it
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    Vector3f center = 0.5f * bounds.pMin + 0.5f * bounds.pMax;
+    float radius = std::sqrt(dotProduct(bounds.Diagonal(), bounds.Diagonal()));
+    std::vector<Ray> rays;
+    rays.reserve(rayCount);
+    for (int i = 0; i < rayCount; ++i) {
+        float z = 1.f - 2.f * uniform(rng);
+        float r = std::sqrt(std::max(0.f, 1.f - z * z));
+        float phi = 2.f * M_PI * uniform(rng);
+        Vector3f origin = center + radius * Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+        Vector3f target = bounds.pMin + bounds.Diagonal() * Vector3f(uniform(rng), uniform(rng), uniform(rng));
+        rays.emplace_back(origin, normalize(target - origin));
+    }
+
+    struct Method {
+        const char* name;
+        BVHAccel::SplitMethod splitMethod;
+    };
+    const Method methods[] = { { "NAIVE", BVHAccel::SplitMethod::NAIVE },
+                               { "SAH", BVHAccel::SplitMethod::SAH },
+                               { "LBVH", BVHAccel::SplitMethod::LBVH } };
+    std::vector<std::string> results;
+    for (const Method& method : methods) {
+        auto start = std::chrono::steady_clock::now();
+        auto bvh = std::make_unique<BVHAccel>(ptrs, 1, method.splitMethod);
+        auto built = std::chrono::steady_clock::now();
+        size_t hits = 0;
+        for (const Ray& ray : rays)
+            hits += bvh->Intersect(ray).happened;
+        auto traced = std::chrono::steady_clock::now();
+
+        double buildMs = std::chrono::duration<double, std::milli>(built - start).count();
+        double traceS = std::chrono::duration<double>(traced - built).count();
+        char line[160];
+        snprintf(line, sizeof(line), "%-6s %10.1f ms %10zu nodes %10.2f Mrays/s %10zu hits", method.name, buildMs,
+                 bvh->nodes.size(), rays.size() / traceS * 1e-6, hits);
+        results.push_back(line);
+    }
+
+    printf("%s: %zu triangles, %zu rays\n", path.c_str(), triangles.size(), rays.size());
+    for (const std::string& line : results)
+        printf("%s\n", line.c_str());
+    return 0;
+}
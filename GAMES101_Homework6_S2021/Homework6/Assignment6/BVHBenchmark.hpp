@@ -0,0 +1,15 @@
+//
+// Build time and trace throughput of the BVH split methods on one mesh.
+//
+
+#ifndef RAYTRACING_BVHBENCHMARK_H
+#define RAYTRACING_BVHBENCHMARK_H
+
+#include <string>
+
+// Builds a BVH over the triangles of the obj with each split method and traces the same rays through every one,
+// printing the build time, the node count and the rays traced per second on one thread. Returns 1 if the obj
+// cannot be loaded, else 0.
+int runBVHBenchmark(const std::string& path, int rayCount);
+
+#endif //RAYTRACING_BVHBENCHMARK_H
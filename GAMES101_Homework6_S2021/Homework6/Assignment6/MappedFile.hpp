@@ -0,0 +1,36 @@
+//
+// Read-only memory mapping of a whole file.
+//
+
+#ifndef RAYTRACING_MAPPEDFILE_H
+#define RAYTRACING_MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // False if the file does not exist, is empty or cannot be mapped
+    bool open(const std::string& path);
+    void close();
+
+    const char* data() const { return (const char*)view; }
+    size_t size() const { return viewSize; }
+
+private:
+    void* view = nullptr;
+    size_t viewSize = 0;
+#if defined(_WIN32)
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+#endif //RAYTRACING_MAPPEDFILE_H
@@ -0,0 +1,70 @@
+//
+// Binary cache of parsed meshes, memory mapped on later runs.
+//
+
+#ifndef RAYTRACING_MESHCACHE_H
+#define RAYTRACING_MESHCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "MappedFile.hpp"
+
+/*
+ * The cache of a mesh file is written next to it as <source>.meshcache, holding the arrays the program built
+ * from the source: a header, then each array starting at a multiple of 16 bytes,
+ *   positions   float[3 * vertexCount]
+ *   normals     float[3 * vertexCount]
+ *   texCoords   float[2 * vertexCount]
+ *   indices     uint32[3 * triangleCount]
+ *   bvh nodes   MeshCacheNode[nodeCount], optional
+ * in the byte order of the machine that wrote it.
+ *
+ * A cache is only used if it was written for the same key, which names what the caller did to the source
+ * (the vertex welding, a transform, the BVH build...), and for a source of the same size with the same
+ * modification time. If only the time differs, as after a fresh checkout, the content hash decides.
+ * Anything else is a miss: the caller parses the source and writes a new cache.
+ * */
+struct MeshCacheNode
+{
+    float boundsMin[3], boundsMax[3];
+    uint32_t right;     // interior nodes: index of the right child, the left child follows the node; 0 for leaves
+    uint32_t primitive; // leaves: index of the triangle
+};
+
+struct MeshArrays
+{
+    const float* positions = nullptr;
+    const float* normals = nullptr;
+    const float* texCoords = nullptr;
+    size_t vertexCount = 0;
+    const uint32_t* indices = nullptr;
+    size_t triangleCount = 0;
+    const MeshCacheNode* nodes = nullptr;
+    size_t nodeCount = 0;
+};
+
+class MeshCache
+{
+public:
+    MeshCache() = default;
+    ~MeshCache() { close(); }
+
+    MeshCache(const MeshCache&) = delete;
+    MeshCache& operator=(const MeshCache&) = delete;
+
+    // Maps the cache of source if it is valid for it and key. The arrays point into the mapping until close().
+    bool open(const std::string& source, uint32_t key);
+    void close();
+
+    const MeshArrays& arrays() const { return mapped; }
+
+    // Writes the cache of source, replacing an old one. Returns false if it could not be written.
+    static bool write(const std::string& source, uint32_t key, const MeshArrays& arrays);
+
+private:
+    MeshArrays mapped;
+    MappedFile file;
+};
+
+#endif //RAYTRACING_MESHCACHE_H
@@ -3,13 +3,15 @@
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "ObjParser.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 #include <cassert>
 #include <array>
+#include <iostream>
+#include <vector>
 
-bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
+inline bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
     const Vector3f& v2, const Vector3f& orig,
     const Vector3f& dir, float& tnear, float& u, float& v)
 {
@@ -76,27 +78,82 @@ public:
 class MeshTriangle : public Object
 {
 public:
+    // Names what the constructor builds from the obj in the cache: bump it with changes to the scale or the BVH build
+    static const uint32_t MESH_CACHE_KEY = 3;
+
+    // The parsed positions and the BVH are cached next to the obj; later runs map them instead of parsing and
+    // building again
     MeshTriangle(const std::string& filename)
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
+        MeshCache cache;
+        if (cache.open(filename, MESH_CACHE_KEY) && loadCached(cache.arrays()))
+            return;
+
+        ObjMesh obj;
+        if (!loadObj(filename, obj))
+            std::cout << "Could not load " << filename << "\n";
+        buildTriangles(obj.positions.data(), obj.indices.data(), obj.triangleCount());
+
+        std::vector<Object*> ptrs;
+        for (auto& tri : triangles)
+            ptrs.push_back(&tri);
+
+        bvh = new BVHAccel(ptrs, 1, BVHAccel::SplitMethod::SAH);
+
+        if (triangles.empty())
+            return;
+
+        MeshArrays arrays;
+        arrays.positions = obj.positions.data();
+        arrays.normals = obj.normals.data();
+        arrays.texCoords = obj.texCoords.data();
+        arrays.vertexCount = obj.vertexCount();
+        arrays.indices = obj.indices.data();
+        arrays.triangleCount = obj.triangleCount();
+        std::vector<MeshCacheNode> nodes;
+        if (!bvh->save(nodes))
+            return; // leaves of several triangles do not fit the cache, so the mesh is built again next time
+        arrays.nodes = nodes.data();
+        arrays.nodeCount = nodes.size();
+        if (!MeshCache::write(filename, MESH_CACHE_KEY, arrays))
+            std::cout << "Could not write the mesh cache of " << filename << "\n";
+    }
+
+    // Triangles from the cached positions, and the cached BVH over them. False if the cache does not fit together.
+    bool loadCached(const MeshArrays& arrays)
+    {
+        for (size_t i = 0; i < arrays.triangleCount * 3; ++i) {
+            if (arrays.indices[i] >= arrays.vertexCount)
+                return false;
+        }
+        if (arrays.triangleCount == 0 || !BVHAccel::validNodes(arrays.nodes, arrays.nodeCount, arrays.triangleCount))
+            return false;
 
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
+        buildTriangles(arrays.positions, arrays.indices, arrays.triangleCount);
 
+        std::vector<Object*> ptrs;
+        for (auto& tri : triangles)
+            ptrs.push_back(&tri);
+
+        bvh = new BVHAccel(ptrs, arrays.nodes, arrays.nodeCount);
+        return true;
+    }
+
+    void buildTriangles(const float* positions, const uint32_t* indices, size_t triangleCount)
+    {
         Vector3f min_vert = Vector3f{ std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity() };
         Vector3f max_vert = Vector3f{ -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity() };
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+        triangles.clear();
+        triangles.reserve(triangleCount);
+        for (size_t i = 0; i < triangleCount; ++i) {
             std::array<Vector3f, 3> face_vertices;
             for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                    mesh.Vertices[i + j].Position.Y,
-                    mesh.Vertices[i + j].Position.Z) *
-                    60.f;
+                const float* p = positions + 3 * indices[i * 3 + j];
+                auto vert = Vector3f(p[0], p[1], p[2]) * 60.f;
                 face_vertices[j] = vert;
 
                 min_vert = Vector3f(std::min(min_vert.x, vert.x),
@@ -119,12 +176,6 @@ public:
         }
 
         bounding_box = Bounds3(min_vert, max_vert);
-
-        std::vector<Object*> ptrs;
-        for (auto& tri : triangles)
-            ptrs.push_back(&tri);
-
-        bvh = new BVHAccel(ptrs);
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -257,6 +308,6 @@ inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 }
 
 
-double distance;
+inline double distance;
 
-Material* m;
\ No newline at end of file
+inline Material* m;
\ No newline at end of file
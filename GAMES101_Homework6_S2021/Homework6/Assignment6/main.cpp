@@ -1,3 +1,4 @@
+#include "BVHBenchmark.hpp"
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include "Triangle.hpp"
@@ -11,6 +12,10 @@
 // function().
 int main(int argc, char** argv)
 {
+    // "RayTracing bvhbench [obj] [rays]" compares the BVH split methods on a mesh instead of rendering
+    if (argc > 1 && std::string(argv[1]) == "bvhbench")
+        return runBVHBenchmark(argc > 2 ? argv[2] : "../models/bunny/bunny.obj", argc > 3 ? std::atoi(argv[3]) : 1000000);
+
     Scene scene(1280, 960);
 
     MeshTriangle bunny("../models/bunny/bunny.obj");
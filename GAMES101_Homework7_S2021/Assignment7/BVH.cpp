@@ -1,6 +1,30 @@
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
 #include "BVH.hpp"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_USE_SSE
+#include <immintrin.h>
+#endif
+
+// The axis along which the centers of two sibling boxes lie furthest apart
+static int childAxis(const Bounds3& first, const Bounds3& second)
+{
+    Vector3f d = (second.pMin + second.pMax) - (first.pMin + first.pMax);
+    return Bounds3(Vector3f(0, 0, 0), Vector3f(std::abs(d.x), std::abs(d.y), std::abs(d.z))).maxExtent();
+}
+
+static void deleteBuildTree(BVHBuildNode* node)
+{
+    if (!node)
+        return;
+    deleteBuildTree(node->left);
+    deleteBuildTree(node->right);
+    delete node;
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
@@ -12,7 +36,20 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    BVHBuildNode* root = nullptr;
+    if (splitMethod == SplitMethod::NAIVE)
+        root = recursiveBuild(primitives);
+    else if (splitMethod == SplitMethod::SAH)
+        root = buildSAH();
+    else
+        root = buildLBVH();
+
+    // Traversal walks a flat depth first array instead of the pointer tree the build produced
+    nodes.reserve(2 * primitives.size() - 1);
+    areas.reserve(2 * primitives.size() - 1);
+    orderedPrimitives.reserve(primitives.size());
+    flattenBVHTree(root);
+    deleteBuildTree(root);
 
     time(&stop);
     double diff = difftime(stop, start);
@@ -25,6 +62,450 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
         hrs, mins, secs);
 }
 
+int BVHAccel::flattenBVHTree(const BVHBuildNode* node)
+{
+    int offset = (int)nodes.size();
+    nodes.emplace_back();
+    areas.push_back(0);
+    nodes[offset].bounds = node->bounds;
+    if (node->left == nullptr && node->right == nullptr) {
+        if (node->nPrimitives > 0) {
+            // An SAH leaf, whose primitives buildSAH() already put in order
+            nodes[offset].primitivesOffset = node->firstPrimOffset;
+            nodes[offset].nPrimitives = (uint16_t)node->nPrimitives;
+        }
+        else {
+            nodes[offset].primitivesOffset = (int)orderedPrimitives.size();
+            nodes[offset].nPrimitives = 1;
+            orderedPrimitives.push_back(node->object);
+        }
+        for (int i = 0; i < nodes[offset].nPrimitives; ++i)
+            areas[offset] += orderedPrimitives[nodes[offset].primitivesOffset + i]->getArea();
+        return offset;
+    }
+
+    // Store the child lower along the axis first, so traversal can pick the near child from the ray's direction
+    const BVHBuildNode* first = node->left;
+    const BVHBuildNode* second = node->right;
+    int axis = childAxis(first->bounds, second->bounds);
+    if (second->bounds.pMin[axis] + second->bounds.pMax[axis] < first->bounds.pMin[axis] + first->bounds.pMax[axis])
+        std::swap(first, second);
+    nodes[offset].axis = (uint8_t)axis;
+    nodes[offset].nPrimitives = 0;
+    flattenBVHTree(first);
+    int secondOffset = flattenBVHTree(second);
+    nodes[offset].secondChildOffset = secondOffset;
+    areas[offset] = areas[offset + 1] + areas[secondOffset];
+    return offset;
+}
+
+BVHAccel::BVHAccel(std::vector<Object*> p, const MeshCacheNode* cached, size_t nodeCount)
+    : maxPrimsInNode(1), splitMethod(SplitMethod::NAIVE), primitives(std::move(p))
+{
+    // The cached nodes are already depth first, only the leaves' primitives are put into leaf order
+    nodes.resize(nodeCount);
+    orderedPrimitives.reserve(primitives.size());
+    for (size_t i = 0; i < nodeCount; ++i) {
+        LinearBVHNode& node = nodes[i];
+        node.bounds = Bounds3(Vector3f(cached[i].boundsMin[0], cached[i].boundsMin[1], cached[i].boundsMin[2]),
+                              Vector3f(cached[i].boundsMax[0], cached[i].boundsMax[1], cached[i].boundsMax[2]));
+        if (cached[i].right == 0) {
+            node.primitivesOffset = (int)orderedPrimitives.size();
+            node.nPrimitives = 1;
+            orderedPrimitives.push_back(primitives[cached[i].primitive]);
+        }
+        else {
+            node.secondChildOffset = (int)cached[i].right;
+            node.nPrimitives = 0;
+        }
+    }
+
+    // Children come after their parent, so going backwards sums up the areas from the leaves
+    areas.resize(nodeCount);
+    for (size_t i = nodeCount; i-- > 0;) {
+        LinearBVHNode& node = nodes[i];
+        if (node.nPrimitives > 0) {
+            areas[i] = orderedPrimitives[node.primitivesOffset]->getArea();
+        }
+        else {
+            node.axis = (uint8_t)childAxis(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds);
+            areas[i] = areas[i + 1] + areas[node.secondChildOffset];
+        }
+    }
+}
+
+// The build tree is freed once it is flattened, and the primitives belong to the caller, so only the arrays are
+// left to free
+BVHAccel::~BVHAccel() = default;
+
+bool BVHAccel::save(std::vector<MeshCacheNode>& saved) const
+{
+    saved.clear();
+    // A cached leaf holds a single primitive, so a tree built with larger leaves cannot be saved
+    for (const LinearBVHNode& node : nodes) {
+        if (node.nPrimitives > 1)
+            return false;
+    }
+    std::unordered_map<const Object*, uint32_t> primitiveIndex;
+    for (uint32_t i = 0; i < primitives.size(); ++i)
+        primitiveIndex[primitives[i]] = i;
+    saved.reserve(nodes.size());
+    for (const LinearBVHNode& node : nodes) {
+        MeshCacheNode n = { { node.bounds.pMin.x, node.bounds.pMin.y, node.bounds.pMin.z },
+                            { node.bounds.pMax.x, node.bounds.pMax.y, node.bounds.pMax.z }, 0, 0 };
+        if (node.nPrimitives > 0)
+            n.primitive = primitiveIndex.at(orderedPrimitives[node.primitivesOffset]);
+        else
+            n.right = (uint32_t)node.secondChildOffset;
+        saved.push_back(n);
+    }
+    return true;
+}
+
+bool BVHAccel::validNodes(const MeshCacheNode* nodes, size_t nodeCount, size_t primitiveCount)
+{
+    // In preorder an interior node's left child follows it and its right child comes after the left subtree
+    for (size_t i = 0; i < nodeCount; ++i) {
+        if (nodes[i].right == 0 ? nodes[i].primitive >= primitiveCount
+                                : nodes[i].right <= i + 1 || nodes[i].right >= nodeCount)
+            return false;
+    }
+    return true;
+}
+
+// What the SAH build needs to know of a primitive, gathered once instead of calling getBounds() at every node
+struct BVHPrimitiveInfo {
+    size_t primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
+// A subtree split off the top of the tree, built later on one of the worker threads
+struct BVHBuildTask {
+    BVHBuildNode* node;
+    int start, end;
+};
+
+// Centroids are binned along each axis and only the splits between bins are evaluated
+static const int SAH_BINS = 32;
+// Subtrees smaller than this are built on the thread that split them off; a handful of spheres is not worth a thread
+static const int MIN_PARALLEL_PRIMITIVES = 1 << 12;
+
+static int buildThreads(size_t count)
+{
+    return count < (size_t)MIN_PARALLEL_PRIMITIVES ? 1 : std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+// Calls job(block, begin, end) for each of blocks even ranges of [0, count), on a thread per block
+template <typename Job>
+static void forEachBlock(size_t count, int blocks, const Job& job)
+{
+    auto run = [&](int b) { job(b, count * b / blocks, count * (b + 1) / blocks); };
+    std::vector<std::thread> threads;
+    for (int b = 1; b < blocks; ++b)
+        threads.emplace_back(run, b);
+    run(0);
+    for (auto& t : threads)
+        t.join();
+}
+
+static std::vector<BVHPrimitiveInfo> gatherPrimitiveInfo(const std::vector<Object*>& primitives)
+{
+    std::vector<BVHPrimitiveInfo> info(primitives.size());
+    forEachBlock(info.size(), buildThreads(info.size()), [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            info[i].primitiveNumber = i;
+            info[i].bounds = primitives[i]->getBounds();
+            info[i].centroid = 0.5f * info[i].bounds.pMin + 0.5f * info[i].bounds.pMax;
+        }
+    });
+    return info;
+}
+
+BVHBuildNode* BVHAccel::buildSAH()
+{
+    std::vector<BVHPrimitiveInfo> info = gatherPrimitiveInfo(primitives);
+
+    // The top of the tree is split on this thread until there are a few subtrees per thread, then the threads take
+    // the subtrees, largest first. The tree does not depend on the thread count.
+    int numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    int deferBelow = std::max(MIN_PARALLEL_PRIMITIVES, (int)info.size() / (4 * numThreads));
+    std::vector<BVHBuildTask> tasks;
+    BVHBuildNode* root = new BVHBuildNode();
+    recursiveSAHBuild(root, info, 0, (int)info.size(), numThreads > 1 ? &tasks : nullptr, deferBelow);
+
+    std::sort(tasks.begin(), tasks.end(), [](const BVHBuildTask& a, const BVHBuildTask& b) {
+        return a.end - a.start > b.end - b.start;
+    });
+    std::atomic<size_t> nextTask(0);
+    auto work = [&] {
+        for (size_t t = nextTask++; t < tasks.size(); t = nextTask++)
+            recursiveSAHBuild(tasks[t].node, info, tasks[t].start, tasks[t].end, nullptr, 0);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min(numThreads, (int)tasks.size()); ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto& t : threads)
+        t.join();
+
+    // Partitioning left the primitives of every leaf next to each other
+    orderedPrimitives.resize(info.size());
+    for (size_t i = 0; i < info.size(); ++i)
+        orderedPrimitives[i] = primitives[info[i].primitiveNumber];
+    return root;
+}
+
+// Builds the subtree over info[start, end) into node, partitioning that range in place so every leaf ends up with a
+// contiguous run of it. With deferred set, subtrees of at most deferBelow primitives are left to the caller.
+void BVHAccel::recursiveSAHBuild(BVHBuildNode* node, std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                                 std::vector<BVHBuildTask>* deferred, int deferBelow)
+{
+    if (deferred && end - start <= deferBelow) {
+        deferred->push_back({ node, start, end });
+        return;
+    }
+
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, info[i].bounds);
+        centroidBounds = Union(centroidBounds, info[i].centroid);
+    }
+    node->bounds = bounds;
+
+    int count = end - start;
+    auto makeLeaf = [&] {
+        node->firstPrimOffset = start;
+        node->nPrimitives = count;
+    };
+    if (count == 1) {
+        makeLeaf();
+        return;
+    }
+
+    const Vector3f& centroidMin = centroidBounds.pMin;
+    const Vector3f& centroidMax = centroidBounds.pMax;
+    auto binOf = [&](const BVHPrimitiveInfo& p, int axis) {
+        int b = (int)(SAH_BINS * ((p.centroid[axis] - centroidMin[axis]) / (centroidMax[axis] - centroidMin[axis])));
+        return std::min(b, SAH_BINS - 1);
+    };
+
+    // Bin the centroids along each axis and evaluate the splits between the bins
+    double minCost = std::numeric_limits<double>::infinity();
+    int minAxis = -1, minBin = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroidMax[axis] == centroidMin[axis])
+            continue;
+        Bounds3 binBounds[SAH_BINS];
+        int binCount[SAH_BINS] = {};
+        for (int i = start; i < end; ++i) {
+            int b = binOf(info[i], axis);
+            binBounds[b] = Union(binBounds[b], info[i].bounds);
+            ++binCount[b];
+        }
+
+        // Sweep down from the top bin for the area and count above every split, then up from the bottom one for
+        // those below it. The first and last bins hold the extreme centroids, so no side is ever empty.
+        double areaAbove[SAH_BINS - 1];
+        int countAbove[SAH_BINS - 1];
+        Bounds3 above;
+        int n = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            above = Union(above, binBounds[b]);
+            n += binCount[b];
+            areaAbove[b - 1] = above.SurfaceArea();
+            countAbove[b - 1] = n;
+        }
+        Bounds3 below;
+        n = 0;
+        for (int b = 0; b < SAH_BINS - 1; ++b) {
+            below = Union(below, binBounds[b]);
+            n += binCount[b];
+            double cost = n * below.SurfaceArea() + countAbove[b] * areaAbove[b];
+            if (cost < minCost) {
+                minCost = cost;
+                minAxis = axis;
+                minBin = b;
+            }
+        }
+    }
+
+    int mid;
+    if (minAxis < 0) {
+        // All centroids coincide and no plane separates them: halve the range unless it fits into a leaf
+        if (count <= maxPrimsInNode) {
+            makeLeaf();
+            return;
+        }
+        mid = start + count / 2;
+    }
+    else {
+        // In units of one primitive intersection, with a step down the tree costing an eighth of that
+        double splitCost = 0.125 + minCost / bounds.SurfaceArea();
+        if (count <= maxPrimsInNode && count <= splitCost) {
+            makeLeaf();
+            return;
+        }
+        mid = (int)(std::partition(info.begin() + start, info.begin() + end,
+                                   [&](const BVHPrimitiveInfo& p) { return binOf(p, minAxis) <= minBin; }) - info.begin());
+    }
+
+    node->left = new BVHBuildNode();
+    node->right = new BVHBuildNode();
+    recursiveSAHBuild(node->left, info, start, mid, deferred, deferBelow);
+    recursiveSAHBuild(node->right, info, mid, end, deferred, deferBelow);
+}
+
+// A primitive's place along the Morton curve through the centroid bounds
+struct MortonPrimitive {
+    uint32_t code;
+    uint32_t primitiveNumber;
+};
+
+// Spreads the low 10 bits of x out to every third bit
+static uint32_t leftShift3(uint32_t x)
+{
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// Interleaves 10 bits of each coordinate of a point in the unit cube into a 30-bit code
+static uint32_t encodeMorton3(const Vector3f& v)
+{
+    uint32_t x = (uint32_t)std::clamp(v.x * 1024.0f, 0.0f, 1023.0f);
+    uint32_t y = (uint32_t)std::clamp(v.y * 1024.0f, 0.0f, 1023.0f);
+    uint32_t z = (uint32_t)std::clamp(v.z * 1024.0f, 0.0f, 1023.0f);
+    return (leftShift3(z) << 2) | (leftShift3(y) << 1) | leftShift3(x);
+}
+
+static int countLeadingZeros(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse(&index, x) ? 31 - (int)index : 32;
+#else
+    return x ? __builtin_clz(x) : 32;
+#endif
+}
+
+// Stable least significant digit radix sort by code, 8 bits a pass. Each thread counts the digits of its block,
+// then moves its block to where those digits go after the smaller digits and the same digit of earlier blocks.
+static void radixSort(std::vector<MortonPrimitive>& v)
+{
+    std::vector<MortonPrimitive> sorted(v.size());
+    int blocks = buildThreads(v.size());
+    std::vector<std::array<size_t, 256>> offsets(blocks);
+    for (int shift = 0; shift < 30; shift += 8) {
+        forEachBlock(v.size(), blocks, [&](int b, size_t begin, size_t end) {
+            offsets[b].fill(0);
+            for (size_t i = begin; i < end; ++i)
+                ++offsets[b][(v[i].code >> shift) & 0xff];
+        });
+        size_t next = 0;
+        for (int digit = 0; digit < 256; ++digit) {
+            for (int b = 0; b < blocks; ++b) {
+                size_t count = offsets[b][digit];
+                offsets[b][digit] = next;
+                next += count;
+            }
+        }
+        forEachBlock(v.size(), blocks, [&](int b, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                sorted[offsets[b][(v[i].code >> shift) & 0xff]++] = v[i];
+        });
+        v.swap(sorted);
+    }
+}
+
+static void unionChildBounds(BVHBuildNode* node)
+{
+    if (node->left == nullptr && node->right == nullptr)
+        return;
+    unionChildBounds(node->left);
+    unionChildBounds(node->right);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+}
+
+// Sorts the primitives along a Morton curve and emits the tree with Karras, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees": internal node i covers a range of the sorted primitives with i at
+// one end, and finds that range and where it splits from the codes alone, so all nodes are linked at once.
+// Splits fall on Morton bits, midway through the centroid bounds, and are not weighed by SAH.
+BVHBuildNode* BVHAccel::buildLBVH()
+{
+    std::vector<BVHPrimitiveInfo> info = gatherPrimitiveInfo(primitives);
+    Bounds3 centroidBounds;
+    for (const BVHPrimitiveInfo& p : info)
+        centroidBounds = Union(centroidBounds, p.centroid);
+
+    int n = (int)info.size();
+    int threads = buildThreads(n);
+    std::vector<MortonPrimitive> morton(n);
+    forEachBlock(n, threads, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            morton[i] = { encodeMorton3(centroidBounds.Offset(info[i].centroid)), (uint32_t)i };
+    });
+    radixSort(morton);
+
+    std::vector<BVHBuildNode*> leaves(n), internal(n - 1);
+    forEachBlock(n, threads, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            leaves[i] = new BVHBuildNode();
+            leaves[i]->object = primitives[morton[i].primitiveNumber];
+            leaves[i]->bounds = info[morton[i].primitiveNumber].bounds;
+            if (i + 1 < (size_t)n)
+                internal[i] = new BVHBuildNode();
+        }
+    });
+    if (n == 1)
+        return leaves[0];
+
+    // The length of the common prefix of the keys at i and j, -1 if j is out of range. Equal codes are told apart
+    // by their position, so every key is unique and the tree stays binary.
+    auto delta = [&](int i, int j) {
+        if (j < 0 || j >= n)
+            return -1;
+        if (morton[i].code == morton[j].code)
+            return 32 + countLeadingZeros((uint32_t)i ^ (uint32_t)j);
+        return countLeadingZeros(morton[i].code ^ morton[j].code);
+    };
+    forEachBlock(n - 1, threads, [&](int, size_t begin, size_t end) {
+        for (int i = (int)begin; i < (int)end; ++i) {
+            // The range extends towards the neighbour sharing the longer prefix, as far as keys share more than
+            // the prefix with the other neighbour
+            int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int deltaMin = delta(i, i - d);
+            int lengthMax = 2;
+            while (delta(i, i + lengthMax * d) > deltaMin)
+                lengthMax *= 2;
+            int length = 0;
+            for (int t = lengthMax / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (length + t) * d) > deltaMin)
+                    length += t;
+            }
+            int j = i + length * d;
+
+            // The split is the last key sharing more than the range's common prefix with i
+            int deltaNode = delta(i, j);
+            int split = 0;
+            for (int divisor = 2, t = length; t > 1; divisor *= 2) {
+                t = (length + divisor - 1) / divisor;
+                if (delta(i, i + (split + t) * d) > deltaNode)
+                    split += t;
+            }
+            int gamma = i + split * d + std::min(d, 0);
+
+            internal[i]->left = std::min(i, j) == gamma ? leaves[gamma] : internal[gamma];
+            internal[i]->right = std::max(i, j) == gamma + 1 ? leaves[gamma + 1] : internal[gamma + 1];
+        }
+    });
+
+    unionChildBounds(internal[0]);
+    return internal[0];
+}
+
 BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
 {
     BVHBuildNode* node = new BVHBuildNode();
@@ -39,7 +520,6 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
         node->object = objects[0];
         node->left = nullptr;
         node->right = nullptr;
-        node->area = objects[0]->getArea();
         return node;
     }
     else if (objects.size() == 2) {
@@ -47,7 +527,6 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
         node->right = recursiveBuild(std::vector{objects[1]});
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
         return node;
     }
     else {
@@ -90,52 +569,332 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
         node->right = recursiveBuild(rightshapes);
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
     }
 
     return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
+// The wide node for the binary nodes first[0, count), opening the largest interior one until there are Width
+template <int Width>
+static int collapseNode(const std::vector<LinearBVHNode>& nodes, const int* first, int count,
+                        std::vector<WideBVHNode<Width>>& wideNodes)
 {
-    Intersection isect;
-    if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+    int children[Width];
+    std::copy(first, first + count, children);
+    while (count < Width) {
+        int largest = -1;
+        double largestArea = -1;
+        for (int i = 0; i < count; ++i) {
+            const LinearBVHNode& child = nodes[children[i]];
+            if (child.nPrimitives == 0 && child.bounds.SurfaceArea() > largestArea) {
+                largest = i;
+                largestArea = child.bounds.SurfaceArea();
+            }
+        }
+        if (largest < 0)
+            break;
+        int opened = children[largest];
+        children[largest] = opened + 1;
+        children[count++] = nodes[opened].secondChildOffset;
+    }
+
+    int index = (int)wideNodes.size();
+    wideNodes.emplace_back();
+    for (int i = 0; i < Width; ++i) {
+        const LinearBVHNode* child = i < count ? &nodes[children[i]] : nullptr;
+        for (int axis = 0; axis < 3; ++axis) {
+            wideNodes[index].bounds[0][axis][i] = child ? child->bounds.pMin[axis] : std::numeric_limits<float>::infinity();
+            wideNodes[index].bounds[1][axis][i] = child ? child->bounds.pMax[axis] : -std::numeric_limits<float>::infinity();
+        }
+        wideNodes[index].children[i] = -1;
+        wideNodes[index].nPrimitives[i] = 0;
+        if (child && child->nPrimitives > 0) {
+            wideNodes[index].children[i] = ~child->primitivesOffset;
+            wideNodes[index].nPrimitives[i] = child->nPrimitives;
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        const LinearBVHNode& child = nodes[children[i]];
+        if (child.nPrimitives == 0) {
+            int grandchildren[2] = { children[i] + 1, child.secondChildOffset };
+            int wideChild = collapseNode(nodes, grandchildren, 2, wideNodes);
+            wideNodes[index].children[i] = wideChild;
+        }
+    }
+    return index;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+void BVHAccel::collapseToWide(int width)
 {
-    // TODO Traverse the BVH to find intersection
-    Intersection intersection;
-    if (node == nullptr || !node->bounds.IntersectP(ray, ray.direction_inv, { ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0 })) {
-        return intersection;
+    wide4Nodes.clear();
+    wide8Nodes.clear();
+    if (nodes.empty() || (width != 4 && width != 8))
+        return;
+
+    // A root that is a leaf becomes the only child of the wide root
+    int first[2] = { 1, nodes[0].secondChildOffset };
+    int count = 2;
+    if (nodes[0].nPrimitives > 0) {
+        first[0] = 0;
+        count = 1;
+    }
+    if (width == 4) {
+        wide4Nodes.reserve(nodes.size() / 3 + 1);
+        collapseNode(nodes, first, count, wide4Nodes);
+    }
+    else {
+        wide8Nodes.reserve(nodes.size() / 7 + 1);
+        collapseNode(nodes, first, count, wide8Nodes);
     }
+}
 
-    if (node->left == nullptr && node->right == nullptr) {
-        return node->object->getIntersection(ray);
+// A ray prepared for testing against many boxes: per axis, which side of a box it enters through
+struct WideRay {
+    float origin[3];
+    float invDir[3];
+    int nearSide[3];    // 0 if it enters through the min slab, 1 through the max one
+
+    explicit WideRay(const Ray& ray)
+    {
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis] = ray.origin[axis];
+            invDir[axis] = ray.direction_inv[axis];
+            nearSide[axis] = ray.direction[axis] > 0 ? 0 : 1;
+        }
     }
+};
 
-    Intersection hit1 = getIntersection(node->left, ray);
-    Intersection hit2 = getIntersection(node->right, ray);
+// Sets tEnter to where the ray enters each child box and returns a bit per child box it hits, with the same
+// arithmetic as Bounds3::IntersectP
+template <int Width>
+static int intersectChildren(const WideBVHNode<Width>& node, const WideRay& ray, float* tEnter)
+{
+    const float* nearX = node.bounds[ray.nearSide[0]][0];
+    const float* nearY = node.bounds[ray.nearSide[1]][1];
+    const float* nearZ = node.bounds[ray.nearSide[2]][2];
+    const float* farX = node.bounds[1 - ray.nearSide[0]][0];
+    const float* farY = node.bounds[1 - ray.nearSide[1]][1];
+    const float* farZ = node.bounds[1 - ray.nearSide[2]][2];
+    int mask = 0;
+#if defined(__AVX__)
+    if constexpr (Width == 8) {
+        __m256 ox = _mm256_set1_ps(ray.origin[0]), oy = _mm256_set1_ps(ray.origin[1]), oz = _mm256_set1_ps(ray.origin[2]);
+        __m256 ix = _mm256_set1_ps(ray.invDir[0]), iy = _mm256_set1_ps(ray.invDir[1]), iz = _mm256_set1_ps(ray.invDir[2]);
+        __m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearX), ox), ix),
+                                                   _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearY), oy), iy)),
+                                     _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearZ), oz), iz));
+        __m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farX), ox), ix),
+                                                  _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farY), oy), iy)),
+                                    _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farZ), oz), iz));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+        _mm256_storeu_ps(tEnter, tNear);
+        return _mm256_movemask_ps(hit);
+    }
+#endif
+#if defined(BVH_USE_SSE)
+    __m128 ox = _mm_set1_ps(ray.origin[0]), oy = _mm_set1_ps(ray.origin[1]), oz = _mm_set1_ps(ray.origin[2]);
+    __m128 ix = _mm_set1_ps(ray.invDir[0]), iy = _mm_set1_ps(ray.invDir[1]), iz = _mm_set1_ps(ray.invDir[2]);
+    for (int i = 0; i < Width; i += 4) {
+        __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX + i), ox), ix),
+                                             _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY + i), oy), iy)),
+                                  _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ + i), oz), iz));
+        __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX + i), ox), ix),
+                                            _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY + i), oy), iy)),
+                                 _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ + i), oz), iz));
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(tFar, _mm_setzero_ps()), _mm_cmple_ps(tNear, tFar));
+        _mm_storeu_ps(tEnter + i, tNear);
+        mask |= _mm_movemask_ps(hit) << i;
+    }
+#else
+    for (int i = 0; i < Width; ++i) {
+        float tNear = std::max({ (nearX[i] - ray.origin[0]) * ray.invDir[0], (nearY[i] - ray.origin[1]) * ray.invDir[1],
+                                 (nearZ[i] - ray.origin[2]) * ray.invDir[2] });
+        float tFar = std::min({ (farX[i] - ray.origin[0]) * ray.invDir[0], (farY[i] - ray.origin[1]) * ray.invDir[1],
+                                (farZ[i] - ray.origin[2]) * ray.invDir[2] });
+        tEnter[i] = tNear;
+        mask |= (tFar >= 0 && tNear <= tFar) << i;
+    }
+#endif
+    return mask;
+}
 
-    return hit1.distance < hit2.distance ? hit1 : hit2;
+// Like Intersect on the binary tree, but each step tests all children of a node at once and pushes the ones hit
+// from far to near, so the nearest is visited next
+template <int Width>
+Intersection BVHAccel::intersectWide(const std::vector<WideBVHNode<Width>>& wideNodes, const Ray& ray) const
+{
+    struct Entry {
+        int32_t child;
+        uint16_t nPrimitives;
+        float tEnter;
+    };
+
+    Intersection isect;
+    WideRay wideRay(ray);
+    // Every wide level leaves at most Width - 1 children behind, and there are at most as many levels as binary ones
+    Entry toVisit[64 * (Width - 1) + 1];
+    int toVisitCount = 0;
+    toVisit[toVisitCount++] = { 0, 0, -std::numeric_limits<float>::infinity() };
+    while (toVisitCount > 0) {
+        Entry entry = toVisit[--toVisitCount];
+        if (entry.tEnter >= isect.distance)
+            continue;
+        if (entry.nPrimitives > 0) {
+            for (int i = 0; i < entry.nPrimitives; ++i) {
+                Intersection hit = orderedPrimitives[~entry.child + i]->getIntersection(ray);
+                if (hit.happened && hit.distance < isect.distance)
+                    isect = hit;
+            }
+            continue;
+        }
+
+        const WideBVHNode<Width>& node = wideNodes[entry.child];
+        float tEnter[Width];
+        int mask = intersectChildren(node, wideRay, tEnter);
+        Entry hits[Width];
+        int hitCount = 0;
+        for (int i = 0; i < Width; ++i) {
+            if (!(mask & (1 << i)) || tEnter[i] >= isect.distance)
+                continue;
+            // Insertion sort by decreasing entry distance
+            int j = hitCount++;
+            for (; j > 0 && hits[j - 1].tEnter < tEnter[i]; --j)
+                hits[j] = hits[j - 1];
+            hits[j] = { node.children[i], node.nPrimitives[i], tEnter[i] };
+        }
+        for (int i = 0; i < hitCount; ++i)
+            toVisit[toVisitCount++] = hits[i];
+    }
+    return isect;
 }
 
+// Traverses the flattened tree with an explicit stack, visiting the child nearer to the ray origin first and
+// skipping every node the ray enters only beyond the closest hit found so far.
+Intersection BVHAccel::Intersect(const Ray& ray) const
+{
+    if (!wide8Nodes.empty())
+        return intersectWide(wide8Nodes, ray);
+    if (!wide4Nodes.empty())
+        return intersectWide(wide4Nodes, ray);
+
+    Intersection isect;
+    if (nodes.empty())
+        return isect;
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
+    std::array<int, 3> dirIsNeg = { ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0 };
+    // Second children still to visit; 64 levels are far more than a tree over any mesh that fits in memory
+    int toVisit[64];
+    int toVisitCount = 0;
+    int current = 0;
+    while (true) {
+        const LinearBVHNode& node = nodes[current];
+        float tEnter;
+        if (node.bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, tEnter) && tEnter < isect.distance) {
+            if (node.nPrimitives > 0) {
+                for (int i = 0; i < node.nPrimitives; ++i) {
+                    Intersection hit = orderedPrimitives[node.primitivesOffset + i]->getIntersection(ray);
+                    if (hit.happened && hit.distance < isect.distance)
+                        isect = hit;
+                }
+            }
+            else if (dirIsNeg[node.axis]) {
+                // The ray goes up the axis, so the first (lower) child is the near one
+                toVisit[toVisitCount++] = node.secondChildOffset;
+                current = current + 1;
+                continue;
+            }
+            else {
+                toVisit[toVisitCount++] = current + 1;
+                current = node.secondChildOffset;
+                continue;
+            }
+        }
+        if (toVisitCount == 0)
+            break;
+        current = toVisit[--toVisitCount];
+    }
+    return isect;
+}
+
+// Like Intersect on the binary tree, with a mask of the rays still in the node on the stack. A node is opened while
+// any of them enters it before its closest hit so far, and the first of them picks which child comes first.
+void BVHAccel::IntersectPacket(const RayPacket& packet, int active, Intersection* hits) const
+{
+    if (nodes.empty() || active == 0)
         return;
+
+    float tFar[PACKET_SIZE];
+    auto updateFar = [&](int mask) {
+        for (int i = 0; i < PACKET_SIZE; ++i) {
+            if (mask & (1 << i))
+                tFar[i] = hits[i].happened ? (float)hits[i].distance : std::numeric_limits<float>::infinity();
+        }
+    };
+    updateFar(active);
+
+    struct Entry {
+        int node;
+        int active;
+    };
+    Entry toVisit[64];
+    int toVisitCount = 0;
+    Entry current = { 0, active };
+    while (true) {
+        const LinearBVHNode& node = nodes[current.node];
+        int mask = packet.intersectBox(node.bounds, current.active, tFar);
+        if (mask) {
+            if (node.nPrimitives > 0) {
+                for (int i = 0; i < node.nPrimitives; ++i)
+                    orderedPrimitives[node.primitivesOffset + i]->getIntersections(packet, mask, hits);
+                updateFar(mask);
+            }
+            else {
+                int first = 0;
+                while (!(mask & (1 << first)))
+                    ++first;
+                if (packet.direction[node.axis][first] > 0) {
+                    toVisit[toVisitCount++] = { node.secondChildOffset, mask };
+                    current = { current.node + 1, mask };
+                }
+                else {
+                    toVisit[toVisitCount++] = { current.node + 1, mask };
+                    current = { node.secondChildOffset, mask };
+                }
+                continue;
+            }
+        }
+        if (toVisitCount == 0)
+            break;
+        current = toVisit[--toVisitCount];
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
 }
 
+// Picks a primitive with probability proportional to its area, descending by the areas below each child
 void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+    float p = std::sqrt(get_random_float()) * areas[0];
+    int current = 0;
+    while (nodes[current].nPrimitives == 0) {
+        if (p < areas[current + 1]) {
+            current = current + 1;
+        }
+        else {
+            p -= areas[current + 1];
+            current = nodes[current].secondChildOffset;
+        }
+    }
+    // A leaf can hold several primitives: pick one of them by area too. The last one also takes what rounding
+    // leaves of p.
+    const LinearBVHNode& leaf = nodes[current];
+    Object* primitive = orderedPrimitives[leaf.primitivesOffset + leaf.nPrimitives - 1];
+    for (int i = 0; i + 1 < leaf.nPrimitives; ++i) {
+        Object* candidate = orderedPrimitives[leaf.primitivesOffset + i];
+        if (p < candidate->getArea()) {
+            primitive = candidate;
+            break;
+        }
+        p -= candidate->getArea();
+    }
+    primitive->Sample(pos, pdf);
+    pdf *= primitive->getArea();
+    pdf /= areas[0];
+}
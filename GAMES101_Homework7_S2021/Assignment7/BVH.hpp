@@ -6,6 +6,7 @@
 #define RAYTRACING_BVH_H
 
 #include <atomic>
+#include <cstdint>
 #include <vector>
 #include <memory>
 #include <ctime>
@@ -14,10 +15,37 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "MeshCache.hpp"
+#include "RayPacket.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct BVHBuildTask;
+
+// A node of the flattened tree. Nodes are stored depth first, so an interior node's first child follows it and
+// only the second child's offset is kept; the first child is the one lower along axis.
+struct LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;       // 0 for interior nodes
+    uint8_t axis;               // interior node
+    uint8_t pad[1];             // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+// A node of the wide tree, with up to Width children. Their bounds are stored side by side, one array per slab, so a
+// ray is tested against all of them at once with SIMD. Unused slots have empty bounds, which no ray hits.
+template <int Width>
+struct alignas(32) WideBVHNode {
+    float bounds[2][3][Width];      // [min, max][axis][child]
+    int32_t children[Width];        // interior child: index of its node; leaf: ~offset of its first primitive
+    uint16_t nPrimitives[Width];    // 0 for interior children
+};
+static_assert(sizeof(WideBVHNode<4>) == 128 && sizeof(WideBVHNode<8>) == 256, "WideBVHNode should fill cache lines");
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -25,26 +53,50 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    enum class SplitMethod { NAIVE, SAH, LBVH };
 
     // BVHAccel Public Methods
     BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // Restores the tree save() wrote for the same primitives, in the same order, without building it again
+    BVHAccel(std::vector<Object*> p, const MeshCacheNode* nodes, size_t nodeCount);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    // Replaces hits[i] with the nearest hit of ray i if it is nearer, for the rays of the packet set in active. The
+    // rays walk the binary tree together, each node's box tested against all of them at once.
+    void IntersectPacket(const RayPacket& packet, int active, Intersection* hits) const;
+
+    // Collapses the binary tree into nodes of width 4 or 8 children, which Intersect traverses from then on. The
+    // binary tree stays for save() and Sample(). 0 goes back to traversing the binary tree.
+    void collapseToWide(int width);
+
+    // The tree in preorder, leaves referring to primitives by their index in p. False, with nodes left empty, if a
+    // leaf holds more than one primitive.
+    bool save(std::vector<MeshCacheNode>& nodes) const;
+    // True if the nodes form a tree over nodeCount nodes whose leaves refer to primitives below primitiveCount
+    static bool validNodes(const MeshCacheNode* nodes, size_t nodeCount, size_t primitiveCount);
 
     // BVHAccel Private Methods
     BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    BVHBuildNode* buildSAH();
+    BVHBuildNode* buildLBVH();
+    void recursiveSAHBuild(BVHBuildNode* node, std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                           std::vector<BVHBuildTask>* deferred, int deferBelow);
+    int flattenBVHTree(const BVHBuildNode* node);
+    template <int Width>
+    Intersection intersectWide(const std::vector<WideBVHNode<Width>>& wideNodes, const Ray& ray) const;
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
+    std::vector<Object*> orderedPrimitives; // in the order the leaves refer to them
+    std::vector<LinearBVHNode> nodes;
+    std::vector<float> areas;   // of the primitives below each node, for sampling by area
+    std::vector<WideBVHNode<4>> wide4Nodes;
+    std::vector<WideBVHNode<8>> wide8Nodes;
 
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
 };
 
@@ -53,7 +105,6 @@ struct BVHBuildNode {
     BVHBuildNode *left;
     BVHBuildNode *right;
     Object* object;
-    float area;
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
@@ -86,12 +86,22 @@ class Bounds3
 
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
                            const std::array<int, 3>& dirisNeg) const;
+    // Also returns the distance along the ray at which it enters the box, negative if the origin is inside
+    inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
+                           const std::array<int, 3>& dirIsNeg, float& tEnter) const;
 };
 
 
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
                                 const std::array<int, 3>& dirIsNeg) const
+{
+    float tEnter;
+    return IntersectP(ray, invDir, dirIsNeg, tEnter);
+}
+
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
+                                const std::array<int, 3>& dirIsNeg, float& tEnter) const
 {
     // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
     // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
@@ -116,6 +126,7 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
     // The condition for ray AABB box intersection is independent of the ray's directions(Positive or Negative)
     float t_enter = std::max({ tmin_x, tmin_y, tmin_z });
     float t_exit = std::min({ tmax_x, tmax_y, tmax_z });
+    tEnter = t_enter;
 
     return t_exit >= 0 && t_enter <= t_exit;
 }
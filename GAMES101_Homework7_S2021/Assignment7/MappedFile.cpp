@@ -0,0 +1,69 @@
+//
+// Read-only memory mapping of a whole file.
+//
+
+#include "MappedFile.hpp"
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+#if defined(_WIN32)
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    HANDLE m = GetFileSizeEx(f, &size) && size.QuadPart > 0 ? CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    void* p = m ? MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!p)
+    {
+        if (m)
+            CloseHandle(m);
+        CloseHandle(f);
+        return false;
+    }
+    file = f;
+    mapping = m;
+    view = p;
+    viewSize = (size_t)size.QuadPart;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* p = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd); // the mapping stays valid
+    if (p == MAP_FAILED)
+        return false;
+    view = p;
+    viewSize = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+#if defined(_WIN32)
+    if (view)
+        UnmapViewOfFile(view);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+    file = mapping = nullptr;
+#else
+    if (view)
+        munmap(view, viewSize);
+#endif
+    view = nullptr;
+    viewSize = 0;
+}
@@ -0,0 +1,318 @@
+//
+// Vertex welding and triangle reordering for indexed meshes.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include "MeshOptimizer.hpp"
+
+namespace
+{
+    constexpr uint32_t NONE = 0xffffffffu;
+
+    // Smaller meshes are welded on the calling thread
+    constexpr size_t MIN_PARALLEL_VERTICES = 1 << 16;
+
+    // Entries of the simulated post-transform cache; Forsyth's scores are tuned for 32
+    constexpr int CACHE_SIZE = 32;
+
+    // The attributes of a vertex as raw bits, so -0 and 0 or two NaNs compare like memcmp
+    struct VertexBits
+    {
+        uint32_t words[8];
+
+        bool operator==(const VertexBits& other) const { return std::memcmp(words, other.words, sizeof(words)) == 0; }
+    };
+
+    VertexBits loadBits(const ObjMesh& mesh, size_t i)
+    {
+        VertexBits bits;
+        std::memcpy(&bits.words[0], &mesh.positions[3 * i], 3 * sizeof(float));
+        std::memcpy(&bits.words[3], &mesh.normals[3 * i], 3 * sizeof(float));
+        std::memcpy(&bits.words[6], &mesh.texCoords[2 * i], 2 * sizeof(float));
+        return bits;
+    }
+
+    uint64_t hashBits(const VertexBits& bits)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (uint32_t word : bits.words)
+            hash = (hash ^ word) * 1099511628211ull;
+        return hash ^ (hash >> 32);
+    }
+
+    // The top bits of a hash pick the partition, the low bits the slot within the partition's table
+    size_t partitionOf(uint64_t hash, size_t partitions) { return (size_t)(hash >> 48) % partitions; }
+
+    // Sets first[i] to the lowest index of a vertex with the same attributes as i, for the vertices of one partition.
+    // Vertices are visited in order, so the first copy of a vertex is the one that ends up in the table.
+    void matchPartition(const ObjMesh& mesh, const std::vector<uint64_t>& hashes, size_t partition,
+                         size_t partitions, std::vector<uint32_t>& first)
+    {
+        size_t count = 0;
+        for (uint64_t hash : hashes)
+            count += partitionOf(hash, partitions) == partition;
+        size_t size = 16;
+        while (size < 2 * count)
+            size *= 2;
+
+        std::vector<uint32_t> slots(size, NONE);
+        for (size_t i = 0; i < hashes.size(); ++i)
+        {
+            if (partitionOf(hashes[i], partitions) != partition)
+                continue;
+            VertexBits bits = loadBits(mesh, i);
+            for (size_t s = hashes[i] & (size - 1);; s = (s + 1) & (size - 1))
+            {
+                uint32_t other = slots[s];
+                if (other == NONE)
+                {
+                    slots[s] = (uint32_t)i;
+                    first[i] = (uint32_t)i;
+                    break;
+                }
+                if (hashes[other] == hashes[i] && loadBits(mesh, other) == bits)
+                {
+                    first[i] = other;
+                    break;
+                }
+            }
+        }
+    }
+
+    float vertexScore(int cachePosition, uint32_t remainingTriangles)
+    {
+        if (remainingTriangles == 0)
+            return -1.0f;
+
+        float score = 0;
+        if (cachePosition >= 0)
+        {
+            // The last triangle's vertices score a little lower, so the next triangle does not reuse the same edge
+            // and strips run across the mesh instead of fanning around one vertex
+            if (cachePosition < 3)
+                score = 0.75f;
+            else
+                score = std::pow(1.0f - (cachePosition - 3) / (float)(CACHE_SIZE - 3), 1.5f);
+        }
+        // Vertices with few triangles left are finished first, so they do not stay behind as isolated triangles
+        return score + 2.0f / std::sqrt((float)remainingTriangles);
+    }
+
+    // Numbers the vertices in the order the index buffer first uses them and moves their attributes to match
+    void reorderVertices(ObjMesh& mesh)
+    {
+        std::vector<uint32_t> remap(mesh.vertexCount(), NONE);
+        uint32_t next = 0;
+        for (uint32_t& index : mesh.indices)
+        {
+            if (remap[index] == NONE)
+                remap[index] = next++;
+            index = remap[index];
+        }
+
+        ObjMesh reordered;
+        reordered.positions.resize(3 * (size_t)next);
+        reordered.normals.resize(3 * (size_t)next);
+        reordered.texCoords.resize(2 * (size_t)next);
+        for (size_t v = 0; v < remap.size(); ++v)
+        {
+            if (remap[v] == NONE)
+                continue;
+            std::copy_n(&mesh.positions[3 * v], 3, &reordered.positions[3 * (size_t)remap[v]]);
+            std::copy_n(&mesh.normals[3 * v], 3, &reordered.normals[3 * (size_t)remap[v]]);
+            std::copy_n(&mesh.texCoords[2 * v], 2, &reordered.texCoords[2 * (size_t)remap[v]]);
+        }
+        mesh.positions.swap(reordered.positions);
+        mesh.normals.swap(reordered.normals);
+        mesh.texCoords.swap(reordered.texCoords);
+    }
+}
+
+void weldVertices(ObjMesh& mesh, int numThreads)
+{
+    size_t vertexCount = mesh.vertexCount();
+    if (vertexCount == 0)
+        return;
+
+    if (numThreads <= 0)
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    size_t partitions = vertexCount < MIN_PARALLEL_VERTICES ? 1 : (size_t)numThreads;
+    auto forEachPartition = [&](const std::function<void(size_t)>& job)
+    {
+        if (partitions == 1)
+        {
+            job(0);
+            return;
+        }
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < partitions; ++p)
+            threads.emplace_back(job, p);
+        for (auto& t : threads)
+            t.join();
+    };
+
+    // Each thread hashes a range of vertices, then matches the vertices whose hash falls into its partition
+    std::vector<uint64_t> hashes(vertexCount);
+    forEachPartition([&](size_t p)
+    {
+        size_t end = vertexCount * (p + 1) / partitions;
+        for (size_t i = vertexCount * p / partitions; i < end; ++i)
+            hashes[i] = hashBits(loadBits(mesh, i));
+    });
+    std::vector<uint32_t> first(vertexCount);
+    forEachPartition([&](size_t p) { matchPartition(mesh, hashes, p, partitions, first); });
+
+    std::vector<uint32_t> remap(vertexCount);
+    size_t welded = 0;
+    for (size_t i = 0; i < vertexCount; ++i)
+    {
+        if (first[i] != i)
+        {
+            remap[i] = remap[first[i]];
+            continue;
+        }
+        remap[i] = (uint32_t)welded;
+        std::copy_n(&mesh.positions[3 * i], 3, &mesh.positions[3 * welded]);
+        std::copy_n(&mesh.normals[3 * i], 3, &mesh.normals[3 * welded]);
+        std::copy_n(&mesh.texCoords[2 * i], 2, &mesh.texCoords[2 * welded]);
+        ++welded;
+    }
+    if (welded == vertexCount)
+        return;
+
+    mesh.positions.resize(3 * welded);
+    mesh.normals.resize(3 * welded);
+    mesh.texCoords.resize(2 * welded);
+    for (uint32_t& index : mesh.indices)
+        index = remap[index];
+}
+
+void optimizeVertexCache(ObjMesh& mesh)
+{
+    size_t triangleCount = mesh.triangleCount();
+    size_t vertexCount = mesh.vertexCount();
+    if (triangleCount == 0)
+        return;
+    const std::vector<uint32_t>& indices = mesh.indices;
+
+    // The triangles of every vertex, in one array. The triangles not emitted yet are kept at the front of each
+    // vertex's range, remaining[v] of them.
+    std::vector<uint32_t> firstTriangle(vertexCount + 1, 0);
+    for (uint32_t index : indices)
+        ++firstTriangle[index + 1];
+    for (size_t v = 0; v < vertexCount; ++v)
+        firstTriangle[v + 1] += firstTriangle[v];
+    std::vector<uint32_t> remaining(vertexCount, 0);
+    std::vector<uint32_t> vertexTriangles(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+    {
+        uint32_t v = indices[i];
+        vertexTriangles[firstTriangle[v] + remaining[v]++] = (uint32_t)(i / 3);
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScores(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v)
+        vertexScores[v] = vertexScore(-1, remaining[v]);
+    std::vector<float> triangleScores(triangleCount);
+    uint32_t best = 0;
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        triangleScores[t] = vertexScores[indices[3 * t]] + vertexScores[indices[3 * t + 1]] + vertexScores[indices[3 * t + 2]];
+        if (triangleScores[t] > triangleScores[best])
+            best = (uint32_t)t;
+    }
+
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> order;
+    order.reserve(triangleCount);
+    std::vector<uint32_t> cache, nextCache;
+    cache.reserve(CACHE_SIZE + 3);
+    nextCache.reserve(CACHE_SIZE + 3);
+    size_t nextUnemitted = 0;
+
+    for (size_t k = 0; k < triangleCount; ++k)
+    {
+        // No triangle touches the cache: continue with the next one in the old order rather than searching
+        // every triangle for the best score, which keeps the whole pass linear
+        if (best == NONE)
+        {
+            while (emitted[nextUnemitted])
+                ++nextUnemitted;
+            best = (uint32_t)nextUnemitted;
+        }
+
+        order.push_back(best);
+        emitted[best] = true;
+        const uint32_t* corners = &indices[3 * (size_t)best];
+
+        // The triangle's vertices move to the front of the cache, the others move back
+        nextCache.clear();
+        for (int j = 0; j < 3; ++j)
+        {
+            if (std::find(nextCache.begin(), nextCache.end(), corners[j]) == nextCache.end())
+                nextCache.push_back(corners[j]);
+        }
+        size_t cornerCount = nextCache.size();
+        for (uint32_t v : cache)
+        {
+            if (std::find(nextCache.begin(), nextCache.begin() + cornerCount, v) == nextCache.begin() + cornerCount)
+                nextCache.push_back(v);
+        }
+
+        // Take the triangle out of its vertices' lists of remaining triangles
+        for (int j = 0; j < 3; ++j)
+        {
+            uint32_t v = corners[j];
+            uint32_t* list = &vertexTriangles[firstTriangle[v]];
+            uint32_t* end = list + remaining[v];
+            uint32_t* found = std::find(list, end, best);
+            if (found != end)
+            {
+                std::swap(*found, end[-1]);
+                --remaining[v];
+            }
+        }
+
+        // Rescore the vertices that were or are in the cache and pass the change on to their triangles, then
+        // continue with the best triangle among those
+        for (size_t i = 0; i < nextCache.size(); ++i)
+        {
+            uint32_t v = nextCache[i];
+            cachePosition[v] = i < CACHE_SIZE ? (int)i : -1;
+            float score = vertexScore(cachePosition[v], remaining[v]);
+            float delta = score - vertexScores[v];
+            vertexScores[v] = score;
+            for (uint32_t j = 0; j < remaining[v]; ++j)
+                triangleScores[vertexTriangles[firstTriangle[v] + j]] += delta;
+        }
+        best = NONE;
+        float bestScore = -1e30f;
+        if (nextCache.size() > CACHE_SIZE)
+            nextCache.resize(CACHE_SIZE);
+        for (uint32_t v : nextCache)
+        {
+            for (uint32_t j = 0; j < remaining[v]; ++j)
+            {
+                uint32_t t = vertexTriangles[firstTriangle[v] + j];
+                if (triangleScores[t] > bestScore)
+                {
+                    best = t;
+                    bestScore = triangleScores[t];
+                }
+            }
+        }
+        cache.swap(nextCache);
+    }
+
+    std::vector<uint32_t> reordered(indices.size());
+    for (size_t k = 0; k < triangleCount; ++k)
+        std::copy_n(&indices[3 * (size_t)order[k]], 3, &reordered[3 * k]);
+    mesh.indices.swap(reordered);
+
+    reorderVertices(mesh);
+}
@@ -0,0 +1,21 @@
+//
+// Vertex welding and triangle reordering for indexed meshes.
+//
+
+#ifndef RAYTRACING_MESHOPTIMIZER_H
+#define RAYTRACING_MESHOPTIMIZER_H
+
+#include "ObjParser.hpp"
+
+// Merges vertices whose position, normal and texture coordinates are bit for bit the same, as the corners of
+// an obj that repeats its v lines per face. Vertices keep the order of their first copy. Large meshes are
+// hashed and matched on numThreads threads (0: one per hardware core); the result does not depend on it.
+void weldVertices(ObjMesh& mesh, int numThreads = 0);
+
+// Reorders the triangles so consecutive ones share vertices (Forsyth, "Linear-Speed Vertex Cache
+// Optimisation"), then numbers the vertices in the order the triangles first use them. Triangles that touch
+// end up close together in memory, and walking the index buffer reads the vertex arrays front to back.
+// Vertices no triangle uses are dropped.
+void optimizeVertexCache(ObjMesh& mesh);
+
+#endif //RAYTRACING_MESHOPTIMIZER_H
@@ -0,0 +1,384 @@
+//
+// Streaming Wavefront obj parser producing indexed vertex arrays.
+//
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include "ObjParser.hpp"
+#include "MappedFile.hpp"
+
+namespace
+{
+    // Files are split into chunks of at least this size, smaller ones are not worth starting threads for
+    constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+    constexpr uint32_t EMPTY_SLOT = 0xffffffffu;
+
+    // A face corner: indices into the v, vt and vn lines of the file, -1 for a missing vt or vn
+    struct Corner
+    {
+        int32_t v, vt, vn;
+
+        bool operator==(const Corner& other) const { return v == other.v && vt == other.vt && vn == other.vn; }
+    };
+
+    // Open addressing hash map from corners to their vertex index, kept at most half full
+    class CornerTable
+    {
+    public:
+        // The index of c, or next if c was not in the table yet, which sets inserted
+        uint32_t insert(const Corner& c, uint32_t next, bool& inserted)
+        {
+            if ((count + 1) * 2 > slots.size())
+                grow();
+
+            size_t mask = slots.size() - 1;
+            for (size_t i = hash(c) & mask;; i = (i + 1) & mask)
+            {
+                Slot& s = slots[i];
+                if (s.value == EMPTY_SLOT)
+                {
+                    s = { c, next };
+                    ++count;
+                    inserted = true;
+                    return next;
+                }
+                if (s.key == c)
+                {
+                    inserted = false;
+                    return s.value;
+                }
+            }
+        }
+
+    private:
+        struct Slot
+        {
+            Corner key;
+            uint32_t value = EMPTY_SLOT;
+        };
+
+        static size_t hash(const Corner& c)
+        {
+            uint64_t h = (uint32_t)c.v * 0x9e3779b97f4a7c15ull;
+            h ^= ((uint64_t)(uint32_t)c.vt << 32 | (uint32_t)c.vn) * 0xc2b2ae3d27d4eb4full;
+            return (size_t)(h ^ (h >> 29));
+        }
+
+        void grow()
+        {
+            std::vector<Slot> old(std::max<size_t>(slots.size() * 2, 1024));
+            old.swap(slots);
+            size_t mask = slots.size() - 1;
+            for (const Slot& s : old)
+            {
+                if (s.value == EMPTY_SLOT)
+                    continue;
+                size_t i = hash(s.key) & mask;
+                while (slots[i].value != EMPTY_SLOT)
+                    i = (i + 1) & mask;
+                slots[i] = s;
+            }
+        }
+
+        std::vector<Slot> slots;
+        size_t count = 0;
+    };
+
+    // A range of whole lines of the file, parsed on its own
+    struct Chunk
+    {
+        const char* begin;
+        const char* end;
+        size_t vCount = 0, vtCount = 0, vnCount = 0;     // lines of each kind in the chunk
+        size_t vFirst = 0, vtFirst = 0, vnFirst = 0;     // and in the chunks before it
+
+        CornerTable table;
+        std::vector<Corner> corners;    // distinct corners of the chunk's faces, in order of first use
+        std::vector<uint32_t> indices;  // into corners, 3 per triangle
+        bool valid = true;
+    };
+
+    // Arrays of the v, vt and vn lines of the whole file; the chunks fill in their part
+    struct RawAttributes
+    {
+        std::vector<float> positions, texCoords, normals;
+    };
+
+    const char* skipBlanks(const char* p, const char* end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        return p;
+    }
+
+    const char* lineEnd(const char* p, const char* end)
+    {
+        const char* newline = (const char*)std::memchr(p, '\n', end - p);
+        return newline ? newline : end;
+    }
+
+    // The kind of the line: 'v', 't' for vt, 'n' for vn, 'f', or 0 for lines that are skipped.
+    // args is set to the first character after the keyword.
+    char lineKind(const char* p, const char* end, const char*& args)
+    {
+        p = skipBlanks(p, end);
+        char kind = 0;
+        if (p < end && *p == 'f')
+        {
+            kind = 'f';
+            ++p;
+        }
+        else if (p < end && *p == 'v')
+        {
+            ++p;
+            kind = p < end && (*p == 't' || *p == 'n') ? *p++ : 'v';
+        }
+        if (p >= end || (*p != ' ' && *p != '\t'))
+            return 0;
+        args = p;
+        return kind;
+    }
+
+    // Missing or unreadable numbers are read as 0, like the components a vt line leaves out
+    const char* parseFloat(const char* p, const char* end, float& value)
+    {
+        value = 0;
+        p = skipBlanks(p, end);
+        if (p < end && *p == '+')
+            ++p;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec == std::errc::result_out_of_range)
+            value = 0;
+        return result.ec == std::errc::invalid_argument ? p : result.ptr;
+    }
+
+    // Reads an index of a face corner: 1-based, or negative counting back from the last of count lines.
+    // An empty index, as the vt of v//vn, is -1. Returns false for 0 or an index before the first line.
+    bool parseIndex(const char*& p, const char* end, size_t count, int32_t& index)
+    {
+        int64_t value;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc())
+        {
+            index = -1;
+            return result.ec == std::errc::invalid_argument;
+        }
+        p = result.ptr;
+        int64_t resolved = value > 0 ? value - 1 : (int64_t)count + value;
+        if (value == 0 || resolved < 0 || resolved > INT32_MAX)
+            return false;
+        index = (int32_t)resolved;
+        return true;
+    }
+
+    void countLines(Chunk& c)
+    {
+        const char* args;
+        for (const char* p = c.begin; p < c.end;)
+        {
+            const char* e = lineEnd(p, c.end);
+            switch (lineKind(p, e, args))
+            {
+                case 'v': ++c.vCount; break;
+                case 't': ++c.vtCount; break;
+                case 'n': ++c.vnCount; break;
+            }
+            p = e == c.end ? e : e + 1;
+        }
+    }
+
+    void parseFace(Chunk& c, const char* p, const char* end, size_t vSeen, size_t vtSeen, size_t vnSeen,
+                    std::vector<uint32_t>& face)
+    {
+        face.clear();
+        while (true)
+        {
+            p = skipBlanks(p, end);
+            if (p >= end || *p == '\r' || *p == '#')
+                break;
+
+            Corner k = { -1, -1, -1 };
+            bool valid = parseIndex(p, end, vSeen, k.v) && k.v >= 0;
+            if (valid && p < end && *p == '/')
+            {
+                valid = parseIndex(++p, end, vtSeen, k.vt);
+                if (valid && p < end && *p == '/')
+                    valid = parseIndex(++p, end, vnSeen, k.vn);
+            }
+            if (!valid || (p < end && *p != ' ' && *p != '\t' && *p != '\r'))
+            {
+                c.valid = false;
+                return;
+            }
+
+            bool inserted;
+            face.push_back(c.table.insert(k, (uint32_t)c.corners.size(), inserted));
+            if (inserted)
+                c.corners.push_back(k);
+        }
+
+        for (size_t i = 2; i < face.size(); ++i)
+        {
+            c.indices.push_back(face[0]);
+            c.indices.push_back(face[i - 1]);
+            c.indices.push_back(face[i]);
+        }
+    }
+
+    // Calls job(i) for every chunk, on a thread per chunk if there are several
+    template <typename Job>
+    void forEachChunk(size_t chunkCount, const Job& job)
+    {
+        if (chunkCount == 1)
+        {
+            job(0);
+            return;
+        }
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < chunkCount; ++i)
+            threads.emplace_back([&job, i] { job(i); });
+        for (auto& t : threads)
+            t.join();
+    }
+
+    void parseChunk(Chunk& c, RawAttributes& raw)
+    {
+        size_t vSeen = c.vFirst, vtSeen = c.vtFirst, vnSeen = c.vnFirst;
+        std::vector<uint32_t> face;
+        const char* args;
+        for (const char* p = c.begin; p < c.end && c.valid;)
+        {
+            const char* e = lineEnd(p, c.end);
+            switch (lineKind(p, e, args))
+            {
+                case 'v':
+                {
+                    float* out = &raw.positions[3 * vSeen++];
+                    for (int i = 0; i < 3; ++i)
+                        args = parseFloat(args, e, out[i]);
+                    break;
+                }
+                case 't':
+                {
+                    float* out = &raw.texCoords[2 * vtSeen++];
+                    for (int i = 0; i < 2; ++i)
+                        args = parseFloat(args, e, out[i]);
+                    break;
+                }
+                case 'n':
+                {
+                    float* out = &raw.normals[3 * vnSeen++];
+                    for (int i = 0; i < 3; ++i)
+                        args = parseFloat(args, e, out[i]);
+                    break;
+                }
+                case 'f':
+                    parseFace(c, args, e, vSeen, vtSeen, vnSeen, face);
+                    break;
+            }
+            p = e == c.end ? e : e + 1;
+        }
+    }
+}
+
+bool loadObj(const std::string& path, ObjMesh& mesh, int numThreads)
+{
+    mesh = {};
+
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+    const char* data = file.data();
+    const char* dataEnd = data + file.size();
+
+    if (numThreads <= 0)
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    size_t chunkCount = std::clamp<size_t>(file.size() / MIN_CHUNK_BYTES, 1, numThreads);
+
+    // Chunks end after a newline, so no line is split between two of them
+    std::vector<Chunk> chunks(chunkCount);
+    const char* begin = data;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        const char* end = i + 1 == chunkCount ? dataEnd : std::max(begin, data + file.size() * (i + 1) / chunkCount);
+        end = lineEnd(end, dataEnd);
+        end = end == dataEnd ? end : end + 1;
+        chunks[i].begin = begin;
+        chunks[i].end = end;
+        begin = end;
+    }
+
+    // First count the lines of each kind, so every chunk knows where its v, vt and vn lines go in the arrays of
+    // the file and how to resolve negative indices, then parse all of them at once
+    forEachChunk(chunkCount, [&](size_t i) { countLines(chunks[i]); });
+
+    size_t vTotal = 0, vtTotal = 0, vnTotal = 0;
+    for (Chunk& c : chunks)
+    {
+        c.vFirst = vTotal;
+        c.vtFirst = vtTotal;
+        c.vnFirst = vnTotal;
+        vTotal += c.vCount;
+        vtTotal += c.vtCount;
+        vnTotal += c.vnCount;
+    }
+
+    RawAttributes raw;
+    raw.positions.resize(3 * vTotal);
+    raw.texCoords.resize(2 * vtTotal);
+    raw.normals.resize(3 * vnTotal);
+    forEachChunk(chunkCount, [&](size_t i) { parseChunk(chunks[i], raw); });
+
+    for (const Chunk& c : chunks)
+    {
+        if (!c.valid)
+            return false;
+    }
+
+    // Merge the corners of the chunks in file order, so vertices are numbered as if a single thread parsed the file
+    std::vector<Corner> corners;
+    if (chunkCount == 1)
+    {
+        corners.swap(chunks[0].corners);
+        mesh.indices.swap(chunks[0].indices);
+    }
+    else
+    {
+        CornerTable table;
+        std::vector<uint32_t> remap;
+        for (const Chunk& c : chunks)
+        {
+            remap.resize(c.corners.size());
+            for (size_t i = 0; i < c.corners.size(); ++i)
+            {
+                bool inserted;
+                remap[i] = table.insert(c.corners[i], (uint32_t)corners.size(), inserted);
+                if (inserted)
+                    corners.push_back(c.corners[i]);
+            }
+            for (uint32_t index : c.indices)
+                mesh.indices.push_back(remap[index]);
+        }
+    }
+
+    mesh.positions.resize(3 * corners.size());
+    mesh.normals.resize(3 * corners.size());
+    mesh.texCoords.resize(2 * corners.size());
+    for (size_t i = 0; i < corners.size(); ++i)
+    {
+        const Corner& k = corners[i];
+        if ((size_t)k.v >= vTotal || (k.vt >= 0 && (size_t)k.vt >= vtTotal) || (k.vn >= 0 && (size_t)k.vn >= vnTotal))
+        {
+            mesh = {};
+            return false;
+        }
+        std::copy_n(&raw.positions[3 * k.v], 3, &mesh.positions[3 * i]);
+        if (k.vn >= 0)
+            std::copy_n(&raw.normals[3 * k.vn], 3, &mesh.normals[3 * i]);
+        if (k.vt >= 0)
+            std::copy_n(&raw.texCoords[2 * k.vt], 2, &mesh.texCoords[2 * i]);
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+//
+// Streaming Wavefront obj parser producing indexed vertex arrays.
+//
+
+#ifndef RAYTRACING_OBJPARSER_H
+#define RAYTRACING_OBJPARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Only the v, vt, vn and f lines are read, every other line (groups, materials, smoothing...) is skipped and
+ * all groups end up in the same mesh. Each distinct v/vt/vn index triple used by the faces becomes one vertex,
+ * numbered in the order the faces first use it. Corners without vt or vn get zero texture coordinates or
+ * normals; polygons are split into fans around their first corner.
+ * */
+struct ObjMesh
+{
+    std::vector<float> positions;   // xyz per vertex
+    std::vector<float> normals;     // xyz per vertex
+    std::vector<float> texCoords;   // uv per vertex
+    std::vector<uint32_t> indices;  // 3 per triangle
+
+    size_t vertexCount() const { return positions.size() / 3; }
+    size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// The file is memory mapped and, above a few MB, parsed in chunks of whole lines on numThreads threads
+// (0: one per hardware core); the result does not depend on the thread count. Returns false, with an empty
+// mesh, if the file cannot be read or a face refers to a vertex the file does not have.
+bool loadObj(const std::string& path, ObjMesh& mesh, int numThreads = 0);
+
+#endif //RAYTRACING_OBJPARSER_H
@@ -10,6 +10,7 @@
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "RayPacket.hpp"
 
 class Object
 {
@@ -19,6 +20,18 @@ public:
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // Replaces hits[i] with the hit of ray i on the object if it is nearer, for the rays set in active. Objects
+    // without a packet test take the rays one by one.
+    virtual void getIntersections(const RayPacket& packet, int active, Intersection* hits)
+    {
+        for (int i = 0; i < packet.count; ++i) {
+            if (!(active & (1 << i)))
+                continue;
+            Intersection hit = getIntersection(packet.rays[i]);
+            if (hit.happened && hit.distance < hits[i].distance)
+                hits[i] = hit;
+        }
+    }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
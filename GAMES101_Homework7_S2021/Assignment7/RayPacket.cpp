@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cmath>
+#include "RayPacket.hpp"
+#include "global.hpp"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PACKET_USE_SSE
+#include <immintrin.h>
+#endif
+
+// How far, in barycentric coordinates, the float triangle test lets a ray pass outside the edges before dropping it.
+// Far more than the difference between float and the double arithmetic of Triangle::getIntersection.
+static constexpr float TRIANGLE_SLACK = 1e-4f;
+
+RayPacket::RayPacket(const Ray* rays, int count) : rays(rays), count(count)
+{
+    for (int i = 0; i < PACKET_SIZE; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            // Unused slots get a ray that gives finite numbers; no mask ever includes them
+            origin[axis][i] = i < count ? rays[i].origin[axis] : 0.0f;
+            direction[axis][i] = i < count ? rays[i].direction[axis] : 1.0f;
+            invDir[axis][i] = i < count ? rays[i].direction_inv[axis] : 1.0f;
+        }
+    }
+}
+
+int RayPacket::intersectBox(const Bounds3& box, int active, const float* tFar) const
+{
+    const float boxMin[3] = { box.pMin.x, box.pMin.y, box.pMin.z };
+    const float boxMax[3] = { box.pMax.x, box.pMax.y, box.pMax.z };
+    int mask = 0;
+#if defined(PACKET_USE_SSE)
+    for (int i = 0; i < PACKET_SIZE; i += 4) {
+        if (!((active >> i) & 0xf))
+            continue;
+        __m128 tNear[3], tExit[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 o = _mm_load_ps(origin[axis] + i), inv = _mm_load_ps(invDir[axis] + i);
+            __m128 tMin = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMin[axis]), o), inv);
+            __m128 tMax = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMax[axis]), o), inv);
+            // Rays going up the axis enter through the min slab, the others through the max one
+            __m128 up = _mm_cmpgt_ps(_mm_load_ps(direction[axis] + i), _mm_setzero_ps());
+            tNear[axis] = _mm_or_ps(_mm_and_ps(up, tMin), _mm_andnot_ps(up, tMax));
+            tExit[axis] = _mm_or_ps(_mm_and_ps(up, tMax), _mm_andnot_ps(up, tMin));
+        }
+        __m128 tEnter = _mm_max_ps(_mm_max_ps(tNear[0], tNear[1]), tNear[2]);
+        __m128 tLeave = _mm_min_ps(_mm_min_ps(tExit[0], tExit[1]), tExit[2]);
+        __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tLeave, _mm_setzero_ps()), _mm_cmple_ps(tEnter, tLeave)),
+                                _mm_cmple_ps(tEnter, _mm_loadu_ps(tFar + i)));
+        mask |= _mm_movemask_ps(hit) << i;
+    }
+#else
+    for (int i = 0; i < PACKET_SIZE; ++i) {
+        if (!(active & (1 << i)))
+            continue;
+        float tNear[3], tExit[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            float tMin = (boxMin[axis] - origin[axis][i]) * invDir[axis][i];
+            float tMax = (boxMax[axis] - origin[axis][i]) * invDir[axis][i];
+            bool up = direction[axis][i] > 0;
+            tNear[axis] = up ? tMin : tMax;
+            tExit[axis] = up ? tMax : tMin;
+        }
+        float tEnter = std::max({ tNear[0], tNear[1], tNear[2] });
+        float tLeave = std::min({ tExit[0], tExit[1], tExit[2] });
+        mask |= (tLeave >= 0 && tEnter <= tLeave && tEnter <= tFar[i]) << i;
+    }
+#endif
+    return mask & active;
+}
+
+// The steps of Triangle::getIntersection, in the same order
+int RayPacket::mayHitTriangle(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2, const Vector3f& normal,
+                              int active) const
+{
+    int mask = 0;
+#if defined(PACKET_USE_SSE)
+    __m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+    __m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+    __m128 slack = _mm_set1_ps(TRIANGLE_SLACK), one = _mm_set1_ps(1.0f + TRIANGLE_SLACK);
+    __m128 minusSlack = _mm_set1_ps(-TRIANGLE_SLACK);
+    __m128 signBit = _mm_set1_ps(-0.0f);
+    for (int i = 0; i < PACKET_SIZE; i += 4) {
+        if (!((active >> i) & 0xf))
+            continue;
+        __m128 dx = _mm_load_ps(direction[0] + i), dy = _mm_load_ps(direction[1] + i), dz = _mm_load_ps(direction[2] + i);
+        // Rays that come from behind the triangle
+        __m128 facing = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(normal.x)), _mm_mul_ps(dy, _mm_set1_ps(normal.y))),
+                                   _mm_mul_ps(dz, _mm_set1_ps(normal.z)));
+        __m128 keep = _mm_cmple_ps(facing, slack);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        keep = _mm_and_ps(keep, _mm_cmpge_ps(_mm_andnot_ps(signBit, det), _mm_set1_ps(EPSILON * (1.0f - TRIANGLE_SLACK))));
+        __m128 detInv = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+        __m128 tx = _mm_sub_ps(_mm_load_ps(origin[0] + i), _mm_set1_ps(v0.x));
+        __m128 ty = _mm_sub_ps(_mm_load_ps(origin[1] + i), _mm_set1_ps(v0.y));
+        __m128 tz = _mm_sub_ps(_mm_load_ps(origin[2] + i), _mm_set1_ps(v0.z));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), detInv);
+        keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(u, minusSlack), _mm_cmple_ps(u, one)));
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), detInv);
+        keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(v, minusSlack), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), detInv);
+        keep = _mm_and_ps(keep, _mm_cmpge_ps(t, minusSlack));
+        mask |= _mm_movemask_ps(keep) << i;
+    }
+#else
+    for (int i = 0; i < PACKET_SIZE; ++i) {
+        if (!(active & (1 << i)))
+            continue;
+        Vector3f dir(direction[0][i], direction[1][i], direction[2][i]);
+        if (dotProduct(dir, normal) > TRIANGLE_SLACK)
+            continue;
+        Vector3f pvec = crossProduct(dir, e2);
+        float det = dotProduct(e1, pvec);
+        if (std::fabs(det) < EPSILON * (1.0f - TRIANGLE_SLACK))
+            continue;
+        float detInv = 1.0f / det;
+        Vector3f tvec = Vector3f(origin[0][i], origin[1][i], origin[2][i]) - v0;
+        float u = dotProduct(tvec, pvec) * detInv;
+        if (u < -TRIANGLE_SLACK || u > 1.0f + TRIANGLE_SLACK)
+            continue;
+        Vector3f qvec = crossProduct(tvec, e1);
+        float v = dotProduct(dir, qvec) * detInv;
+        if (v < -TRIANGLE_SLACK || u + v > 1.0f + TRIANGLE_SLACK)
+            continue;
+        if (dotProduct(e2, qvec) * detInv < -TRIANGLE_SLACK)
+            continue;
+        mask |= 1 << i;
+    }
+#endif
+    return mask & active;
+}
@@ -0,0 +1,38 @@
+//
+// Rays traced together through the BVH.
+//
+
+#ifndef RAYTRACING_RAYPACKET_H
+#define RAYTRACING_RAYPACKET_H
+
+#include "Bounds3.hpp"
+#include "Ray.hpp"
+#include "Vector.hpp"
+
+constexpr int PACKET_SIZE = 8;
+
+// Up to PACKET_SIZE rays that take the same way through the BVH, as the camera rays of neighbouring pixels or their
+// shadow rays. The rays are stored one array per component, so a box or a triangle is tested against all of them at
+// once with SIMD. Sets of rays are passed around as masks, bit i standing for ray i.
+struct alignas(16) RayPacket {
+    float origin[3][PACKET_SIZE];
+    float direction[3][PACKET_SIZE];
+    float invDir[3][PACKET_SIZE];
+    const Ray* rays;    // for the objects that test the rays one by one
+    int count;
+
+    // rays has to outlive the packet; count is at most PACKET_SIZE
+    RayPacket(const Ray* rays, int count);
+
+    int allRays() const { return (1 << count) - 1; }
+
+    // The active rays that hit box, entering it no further than tFar[i]. Same arithmetic as Bounds3::IntersectP.
+    int intersectBox(const Bounds3& box, int active, const float* tFar) const;
+
+    // Drops the active rays that certainly miss the front of the triangle v0, v0 + e1, v0 + e2. The test runs in
+    // float with a little slack, so the rays it keeps still have to be checked with Triangle::getIntersection.
+    int mayHitTriangle(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2, const Vector3f& normal,
+                       int active) const;
+};
+
+#endif //RAYTRACING_RAYPACKET_H
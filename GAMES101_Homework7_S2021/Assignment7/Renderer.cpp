@@ -2,6 +2,7 @@
 // Created by goksu on 2/25/20.
 //
 
+#include <algorithm>
 #include <fstream>
 #include "Scene.hpp"
 #include "Renderer.hpp"
@@ -17,15 +18,58 @@ const float EPSILON = 1e-4;
 //                     https://blueflame.org.cn/archives/439
 //                     https://github.com/ysj1173886760/Learning/tree/master/graphics/GAMES101/PA7
 
-std::mutex mtx;
-void Renderer::MultiThreadRender(const Scene& scene)
+// Adds spp samples of each pixel in row j to pixels
+void Renderer::traceRow(const Scene& scene, uint32_t j, int spp, Vector3f* pixels) const
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
-
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(278, 273, -800);
 
+    // generate primary ray direction
+    auto cameraRay = [&](uint32_t i) {
+        float x = (2 * (i + 0.5) / (float)scene.width - 1) *
+            imageAspectRatio * scale;
+        float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+        return Ray(eye_pos, normalize(Vector3f(-x, y, 1)));
+    };
+
+    if (!rayPackets) {
+        for (uint32_t i = 0; i < scene.width; ++i) {
+            Ray ray = cameraRay(i);
+            for (int k = 0; k < spp; k++) {
+                pixels[i] += scene.castRay(ray, 0) / spp;
+            }
+        }
+        return;
+    }
+
+    std::vector<Ray> rays;
+    rays.reserve(PACKET_SIZE);
+    for (uint32_t i = 0; i < scene.width; i += PACKET_SIZE) {
+        int count = std::min<int>(PACKET_SIZE, scene.width - i);
+        rays.clear();
+        Vector3f wo[PACKET_SIZE];
+        for (int k = 0; k < count; ++k) {
+            rays.push_back(cameraRay(i + k));
+            wo[k] = rays[k].direction;
+        }
+        // Every sample of a pixel starts with the same camera ray, so it is traced once for all of them
+        Intersection hits[PACKET_SIZE];
+        scene.intersectPacket(RayPacket(rays.data(), count), hits);
+        for (int s = 0; s < spp; ++s) {
+            Vector3f radiance[PACKET_SIZE];
+            scene.shadePacket(hits, wo, count, radiance);
+            for (int k = 0; k < count; ++k)
+                pixels[i + k] += radiance[k] / spp;
+        }
+    }
+}
+
+std::mutex mtx;
+void Renderer::MultiThreadRender(const Scene& scene)
+{
+    std::vector<Vector3f> framebuffer(scene.width * scene.height);
+
     // change the spp value to change sample ammount
     int spp = 16;
     std::cout << "SPP: " << spp << "\n";
@@ -39,20 +83,8 @@ void Renderer::MultiThreadRender(const Scene& scene)
 
     auto renderRow = [&](int start_row, int end_row) { // &: pass by reference; =: pass by value
 
-        int m = scene.width * start_row;
         for (uint32_t j = start_row; j < end_row; ++j) {
-            for (uint32_t i = 0; i < scene.width; ++i) {
-                // generate primary ray direction
-                float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                    imageAspectRatio * scale;
-                float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-                Vector3f dir = normalize(Vector3f(-x, y, 1));
-                for (int k = 0; k < spp; k++) {
-                    framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
-                }
-                m++;
-            }
+            traceRow(scene, j, spp, &framebuffer[scene.width * j]);
 
             // RAII Compliant: Handles lock & unlock
             std::lock_guard<std::mutex> lg(mtx);
@@ -92,27 +124,11 @@ void Renderer::Render(const Scene& scene)
 {
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
 
-    float scale = tan(deg2rad(scene.fov * 0.5));
-    float imageAspectRatio = scene.width / (float)scene.height;
-    Vector3f eye_pos(278, 273, -800);
-    int m = 0;
-
     // change the spp value to change sample ammount
     int spp = 16;
     std::cout << "SPP: " << spp << "\n";
     for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-            Vector3f dir = normalize(Vector3f(-x, y, 1));
-            for (int k = 0; k < spp; k++) {
-                framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
-            }
-            m++;
-        }
+        traceRow(scene, j, spp, &framebuffer[scene.width * j]);
         UpdateProgress(j / (float)scene.height);
     }
     UpdateProgress(1.f);
@@ -18,5 +18,10 @@ public:
     void Render(const Scene& scene);
     void ThreadRender(const Scene& scene);
     void MultiThreadRender(const Scene& scene);
+
+    // Trace the camera rays of PACKET_SIZE neighbouring pixels, and their shadow rays, as packets. The bounces
+    // after the first hit still go one ray at a time.
+    bool rayPackets = false;
 private:
+    void traceRow(const Scene& scene, uint32_t j, int spp, Vector3f* pixels) const;
 };
@@ -7,6 +7,7 @@
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
     this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh->collapseToWide(8);
 }
 
 Intersection Scene::intersect(const Ray& ray) const
@@ -82,17 +83,34 @@ Vector3f Scene::shade(const Intersection& p, const Vector3f& wo) const {
     sampleLight(x, pdf_light);
 
     Vector3f ws = (x.coords - p.coords).normalized(); 
-    float dist = (x.coords - p.coords).norm();
     Ray r1(p.coords, ws); 
 
     Intersection hit = intersect(r1);
+    Vector3f L_dir = directLight(p, wo, x, pdf_light, hit);
+
+    // Part II: Indirect lighting contribution from non-emitting objects
+    Vector3f L_indir = indirectLight(p, wo);
+
+    // The point p considers both direct and indirect light sources by superposition
+    return L_dir + L_indir;
+}
+
+// The light from the sample x on a light source, if hit, the first thing on the way from p to x, is x itself
+Vector3f Scene::directLight(const Intersection& p, const Vector3f& wo, const Intersection& x, float pdf_light,
+                            const Intersection& hit) const
+{
+    Vector3f ws = (x.coords - p.coords).normalized();
+    float dist = (x.coords - p.coords).norm();
     Vector3f L_dir(0.0f, 0.0f, 0.0f);
     if (hit.happened && (hit.coords - x.coords).norm() < EPSILON) { // If not blocked in the middle
         L_dir = x.emit * p.m->eval(wo, ws, p.normal) * dotProduct(p.normal, ws) * dotProduct(x.normal, -ws)
             / (dist * dist) / pdf_light; 
     }
+    return L_dir;
+}
 
-    // Part II: Indirect lighting contribution from non-emitting objects
+Vector3f Scene::indirectLight(const Intersection& p, const Vector3f& wo) const
+{
     Vector3f L_indir(0.f, 0.f, 0.f);
     if (get_random_float() < RussianRoulette) { // Want high probability => Capture of indirect effects. 
 
@@ -107,9 +125,44 @@ Vector3f Scene::shade(const Intersection& p, const Vector3f& wo) const {
                 / std::max(p.m->pdf(wo, wi, p.normal), EPSILON) / RussianRoulette;
         } 
     }
-
-    // The point p considers both direct and indirect light sources by superposition
-    return L_dir + L_indir;
+    return L_indir;
 }
 
+void Scene::intersectPacket(const RayPacket& packet, Intersection* hits) const
+{
+    for (int i = 0; i < packet.count; ++i)
+        hits[i] = Intersection();
+    this->bvh->IntersectPacket(packet, packet.allRays(), hits);
+}
 
+void Scene::shadePacket(const Intersection* p, const Vector3f* wo, int count, Vector3f* radiance) const
+{
+    // The points that need a light sample, and their shadow rays
+    int shaded[PACKET_SIZE];
+    Intersection x[PACKET_SIZE];
+    float pdf_light[PACKET_SIZE];
+    std::vector<Ray> shadowRays;
+    shadowRays.reserve(PACKET_SIZE);
+    for (int i = 0; i < count; ++i) {
+        radiance[i] = Vector3f(0.f, 0.f, 0.f);
+        if (!p[i].happened)
+            continue;
+        if (p[i].obj->hasEmit()) {
+            radiance[i] = p[i].m->getEmission();
+            continue;
+        }
+        int k = (int)shadowRays.size();
+        shaded[k] = i;
+        sampleLight(x[k], pdf_light[k]);
+        shadowRays.emplace_back(p[i].coords, (x[k].coords - p[i].coords).normalized());
+    }
+    if (shadowRays.empty())
+        return;
+
+    Intersection hits[PACKET_SIZE];
+    intersectPacket(RayPacket(shadowRays.data(), (int)shadowRays.size()), hits);
+    for (int k = 0; k < (int)shadowRays.size(); ++k) {
+        int i = shaded[k];
+        radiance[i] = directLight(p[i], wo[i], x[k], pdf_light[k], hits[k]) + indirectLight(p[i], wo[i]);
+    }
+}
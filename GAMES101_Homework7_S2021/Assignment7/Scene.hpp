@@ -37,6 +37,14 @@ public:
     void buildBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
     Vector3f shade(const Intersection& p, const Vector3f& wo) const;
+    // The nearest hits of the rays of packet, as intersect would find them one by one
+    void intersectPacket(const RayPacket& packet, Intersection* hits) const;
+    // shade for count points at once: their shadow rays are traced as one packet, the bounces after them, which
+    // scatter, one ray at a time. Points without a hit are black, as in castRay.
+    void shadePacket(const Intersection* p, const Vector3f* wo, int count, Vector3f* radiance) const;
+    Vector3f directLight(const Intersection& p, const Vector3f& wo, const Intersection& x, float pdf_light,
+                         const Intersection& hit) const;
+    Vector3f indirectLight(const Intersection& p, const Vector3f& wo) const;
     void sampleLight(Intersection &pos, float &pdf) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
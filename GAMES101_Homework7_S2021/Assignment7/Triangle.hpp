@@ -3,11 +3,14 @@
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "ObjParser.hpp"
+#include "MeshOptimizer.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 #include <cassert>
 #include <array>
+#include <iostream>
+#include <vector>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -62,6 +65,19 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    // The SIMD test drops the rays that miss; the few left are intersected one by one, so the hits are exactly
+    // those of getIntersection
+    void getIntersections(const RayPacket& packet, int active, Intersection* hits) override
+    {
+        int candidates = packet.mayHitTriangle(v0, e1, e2, normal, active);
+        for (int i = 0; candidates; ++i, candidates >>= 1) {
+            if (!(candidates & 1))
+                continue;
+            Intersection hit = getIntersection(packet.rays[i]);
+            if (hit.happened && hit.distance < hits[i].distance)
+                hits[i] = hit;
+        }
+    }
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -89,28 +105,93 @@ public:
 class MeshTriangle : public Object
 {
 public:
+    // Names what the constructor builds from the obj in the cache: bump it with changes to the welding, the
+    // triangle order or the BVH build
+    static const uint32_t MESH_CACHE_KEY = 4;
+
+    // The parsed positions and the BVH are cached next to the obj; later runs map them instead of parsing and
+    // building again
     MeshTriangle(const std::string& filename, Material *mt = new Material())
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
         area = 0;
         m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
 
+        MeshCache cache;
+        if (cache.open(filename, MESH_CACHE_KEY) && loadCached(cache.arrays()))
+            return;
+
+        ObjMesh obj;
+        if (!loadObj(filename, obj))
+            std::cout << "Could not load " << filename << "\n";
+        // Neighbouring triangles, which usually share BVH leaves and rays, are stored next to each other
+        weldVertices(obj);
+        optimizeVertexCache(obj);
+        buildTriangles(obj.positions.data(), obj.indices.data(), obj.triangleCount());
+
+        std::vector<Object*> ptrs;
+        for (auto& tri : triangles)
+            ptrs.push_back(&tri);
+        bvh = new BVHAccel(ptrs, 1, BVHAccel::SplitMethod::SAH);
+        // Rays test the 8 children of a wide node at once, faster than walking the binary tree
+        bvh->collapseToWide(8);
+
+        if (triangles.empty())
+            return;
+
+        MeshArrays arrays;
+        arrays.positions = obj.positions.data();
+        arrays.normals = obj.normals.data();
+        arrays.texCoords = obj.texCoords.data();
+        arrays.vertexCount = obj.vertexCount();
+        arrays.indices = obj.indices.data();
+        arrays.triangleCount = obj.triangleCount();
+        std::vector<MeshCacheNode> nodes;
+        if (!bvh->save(nodes))
+            return; // leaves of several triangles do not fit the cache, so the mesh is built again next time
+        arrays.nodes = nodes.data();
+        arrays.nodeCount = nodes.size();
+        if (!MeshCache::write(filename, MESH_CACHE_KEY, arrays))
+            std::cout << "Could not write the mesh cache of " << filename << "\n";
+    }
+
+    // Triangles from the cached positions, and the cached BVH over them. False if the cache does not fit together.
+    bool loadCached(const MeshArrays& arrays)
+    {
+        for (size_t i = 0; i < arrays.triangleCount * 3; ++i) {
+            if (arrays.indices[i] >= arrays.vertexCount)
+                return false;
+        }
+        if (arrays.triangleCount == 0 || !BVHAccel::validNodes(arrays.nodes, arrays.nodeCount, arrays.triangleCount))
+            return false;
+
+        buildTriangles(arrays.positions, arrays.indices, arrays.triangleCount);
+
+        std::vector<Object*> ptrs;
+        for (auto& tri : triangles)
+            ptrs.push_back(&tri);
+        bvh = new BVHAccel(ptrs, arrays.nodes, arrays.nodeCount);
+        bvh->collapseToWide(8);
+        return true;
+    }
+
+    // Also sums up the mesh's area, for sampling it as a light
+    void buildTriangles(const float* positions, const uint32_t* indices, size_t triangleCount)
+    {
         Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity()};
         Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+        triangles.clear();
+        triangles.reserve(triangleCount);
+        area = 0;
+        for (size_t i = 0; i < triangleCount; ++i) {
             std::array<Vector3f, 3> face_vertices;
 
             for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
+                const float* p = positions + 3 * indices[i * 3 + j];
+                auto vert = Vector3f(p[0], p[1], p[2]);
                 face_vertices[j] = vert;
 
                 min_vert = Vector3f(std::min(min_vert.x, vert.x),
@@ -122,17 +203,11 @@ public:
             }
 
             triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+                                   face_vertices[2], m);
+            area += triangles.back().area;
         }
 
         bounding_box = Bounds3(min_vert, max_vert);
-
-        std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
-            ptrs.push_back(&tri);
-            area += tri.area;
-        }
-        bvh = new BVHAccel(ptrs);
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -194,6 +269,12 @@ public:
 
         return intersec;
     }
+
+    void getIntersections(const RayPacket& packet, int active, Intersection* hits)
+    {
+        if (bvh)
+            bvh->IntersectPacket(packet, active, hits);
+    }
     
     void Sample(Intersection &pos, float &pdf){
         bvh->Sample(pos, pdf);
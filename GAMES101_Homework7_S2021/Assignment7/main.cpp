@@ -46,6 +46,8 @@ int main(int argc, char** argv)
     scene.buildBVH();
 
     Renderer r;
+    // Trace camera and shadow rays in packets; false traces every ray on its own
+    r.rayPackets = true;
 
     auto start = std::chrono::system_clock::now();
     // r.Render(scene);